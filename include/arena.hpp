@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+struct ArenaStats {
+	size_t allocations;      // Allocations since the last reset
+	size_t bytesUsed;        // Bytes handed out since the last reset
+	size_t peakBytesUsed;    // Highest bytesUsed seen over the arena lifetime
+	size_t bytesReserved;    // Bytes held in blocks, reused across resets
+	size_t blockAllocations; // Blocks requested from the system over the arena lifetime
+};
+
+// Bump allocator over large blocks. reset() keeps the blocks around so building
+// again reuses the same memory, objects are never destroyed individually.
+class Arena {
+public:
+	explicit Arena(size_t blockSize = 1 << 20);
+	~Arena();
+
+	Arena(Arena const&) = delete;
+	Arena& operator=(Arena const&) = delete;
+
+	// Thread safe, exits when the system is out of memory like PANIC_BAD_RESULT
+	void* allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+	// Only for trivially destructible types
+	template <typename T>
+	T* create(size_t count = 1)
+	{
+		T* ptr = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+		for (size_t i = 0; i < count; ++i)
+			new (ptr + i) T();
+		return ptr;
+	}
+
+	void reset();
+	void release();
+
+	ArenaStats stats() const;
+
+private:
+	struct Block {
+		char* data;
+		size_t size;
+	};
+
+	std::vector<Block> mBlocks;
+	size_t mBlockSize;
+	size_t mCurrentBlock;
+	size_t mOffset;
+	ArenaStats mStats;
+
+	mutable std::mutex mMutex;
+};
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -5,9 +7,14 @@
 #include <tuple>
 #include <optional>
 #include <sstream>
+#include <algorithm>
+#include <limits>
 
 #include <glm/glm.hpp>
 
+#include <thread_pool.hpp>
+#include <arena.hpp>
+
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
@@ -59,11 +66,12 @@ struct Mesh {
 	Mesh() {}
 };
 
+// Build record, only the bounds and which triangle they belong to. Stays on the CPU.
 struct BVHTriangleRef {
-    alignas(16) glm::vec3 v0, e1, e2;
 	AABB bounds;
-	alignas(16) unsigned index;
+	unsigned index;
 
+	BVHTriangleRef() = default;
 	BVHTriangleRef(TriangleRef const& tri,
 				   std::vector<Vertex> const& vertex_data,
 				   unsigned index) :
@@ -72,10 +80,6 @@ struct BVHTriangleRef {
 		auto& v1 = vertex_data[tri.v1];
 		auto& v2 = vertex_data[tri.v2];
 
-		this->v0 = v0.pos;
-		e1 = v1.pos - v0.pos;
-		e2 = v2.pos - v0.pos;
-
 		bounds = {glm::max(v0.pos, glm::max(v1.pos, v2.pos)),
 				  glm::min(v0.pos, glm::min(v1.pos, v2.pos))};
 
@@ -84,6 +88,33 @@ struct BVHTriangleRef {
 	}
 };
 
+// What the hit test reads, one per ref in refList order and the only
+// triangle data uploaded. index is BVHTriangleRef::index.
+struct BVHTriangle {
+	glm::vec3 v0;
+	unsigned index;
+	glm::vec3 e1;
+	float pad0;
+	glm::vec3 e2;
+	float pad1;
+
+	BVHTriangle() = default;
+	BVHTriangle(TriangleRef const& tri,
+				std::vector<Vertex> const& vertex_data,
+				unsigned index) :
+		index(index), pad0(0.0f), pad1(0.0f) {
+		auto& v0 = vertex_data[tri.v0];
+		auto& v1 = vertex_data[tri.v1];
+		auto& v2 = vertex_data[tri.v2];
+
+		this->v0 = v0.pos;
+		e1 = v1.pos - v0.pos;
+		e2 = v2.pos - v0.pos;
+	}
+};
+
+static_assert(sizeof(BVHTriangle) == 48, "BVHTriangle must match compute.comp");
+
 struct BVHBuildNode {
     AABB leftBounds;
     AABB rightBounds;
@@ -92,7 +123,11 @@ struct BVHBuildNode {
     BVHBuildNode* left;
     BVHBuildNode* right;
 
-    std::vector<BVHTriangleRef> refList;
+    // Leaves cover [refBegin, refEnd) of the list the tree was built over
+    uint32_t refBegin, refEnd;
+
+    // Unnormalized SAH cost of the subtree, only kept up to date by treelet optimization
+    float cost;
 
 	BVHBuildNode() = default;
 };
@@ -108,14 +143,102 @@ struct BVHNode {
 struct BVH {
     std::vector<BVHNode> nodeList;
     std::vector<BVHTriangleRef> refList;
+    std::vector<BVHTriangle> triangleList;
+};
+
+// Order of the flattened nodes, see node_layout.hpp
+enum BVHNodeLayout {
+  DEPTH_FIRST_LAYOUT = 0,
+  CACHE_OBLIVIOUS_LAYOUT = 1
+};
+
+enum BVHBuilder {
+  MEDIAN_BUILDER = 0,
+  SAH_BUILDER = 1,
+  LBVH_BUILDER = 2,
+  SBVH_BUILDER = 3
+};
+
+struct BVHBuildOptions {
+	BVHBuilder builder = MEDIAN_BUILDER;
+
+	// Binned SAH parameters, costs are relative to each other
+	unsigned sahBinCount = 16;
+	float traversalCost = 1.0f;
+	float intersectionCost = 1.0f;
+
+	// Spatial splits for SBVH_BUILDER: tried where the best object split's
+	// children overlap by more than spatialSplitAlpha of the root area, and
+	// refList grows by at most spatialSplitBudget times the triangle count
+	float spatialSplitAlpha = 1e-5f;
+	float spatialSplitBudget = 0.3f;
+
+	// Leaves are never larger than this, the SAH builder may stop earlier
+	unsigned maxLeafSize = 10;
+
+	// Subtrees with at least parallelCutoff refs are built as separate tasks,
+	// nodes with at least parallelBinningCutoff refs are also binned in parallel
+	bool parallel = true;
+	unsigned parallelCutoff = 4096;
+	unsigned parallelBinningCutoff = 65536;
+
+	// Restructures treelets of up to treeletSize (max 7) leaves for lower SAH cost,
+	// applied to LBVH trees after emission
+	bool treeletOptimize = false;
+	unsigned treeletSize = 7;
+	unsigned treeletRounds = 3;
+
+	// Children per node of the tree handed to traversal, 4 and 8 collapse the
+	// binary tree into WideBVHNode
+	unsigned width = 2;
+
+	// Stores 4-wide nodes with 8 bit child bounds in 64 bytes, see QuantizedBVHNode
+	bool quantizeNodes = false;
+
+	// Nodes stay in buildBVH's depth first order unless a layout pass is asked for
+	BVHNodeLayout nodeLayout = DEPTH_FIRST_LAYOUT;
+
+	// refitBVH asks for a rebuild once the SAH cost grew by more than this factor
+	float refitRebuildRatio = 1.5f;
 };
 
 std::optional<Mesh> loadMesh(std::string const& path);
+Mesh meshFromAssimp(aiMesh const* mesh);
 std::vector<BVHTriangleRef> buildTriangleRefList(std::vector<TriangleRef> const& refs,
     std::vector<Vertex> const& vertex_data);
-BVHBuildNode* buildBVHNode(std::vector<BVHTriangleRef>& refList);
+
+// Builders reorder refList in place and take their nodes from the arena, so the
+// tree stays valid until the arena is reset. Flatten with refList moved into bvh.
+BVHBuildNode* buildBVHNode(std::vector<BVHTriangleRef>& refList, Arena& arena);
+BVHBuildNode* buildBVHNodeSAH(std::vector<BVHTriangleRef>& refList, BVHBuildOptions const& options,
+    Arena& arena);
+BVHBuildNode* buildBVHNode(std::vector<BVHTriangleRef>& refList, BVHBuildOptions const& options,
+    Arena& arena);
+BVHBuildNode* buildBVHNodeLBVH(std::vector<BVHTriangleRef>& refList, BVHBuildOptions const& options,
+    Arena& arena);
+// 21 bits per axis, p is normalized to [0, 1] inside the bounds being sorted
+uint64_t mortonCode(glm::vec3 p);
+// Stable LSD radix sort of (key, value) pairs, 8 bits per pass, serial without a pool
+void radixSortMorton(std::vector<uint64_t>& keys, std::vector<uint32_t>& values,
+    ThreadPool* pool, size_t grain);
+// Spatial splits clip triangles, so this one needs the mesh. refList comes back
+// longer than it went in and may hold the same index more than once.
+BVHBuildNode* buildBVHNodeSBVH(std::vector<BVHTriangleRef>& refList, Mesh const& mesh,
+    BVHBuildOptions const& options, Arena& arena);
+// Same as above, and also runs SBVH_BUILDER
+BVHBuildNode* buildBVHNode(std::vector<BVHTriangleRef>& refList, Mesh const& mesh,
+    BVHBuildOptions const& options, Arena& arena);
+void optimizeBVHTreelets(BVHBuildNode* root, std::vector<BVHTriangleRef> const& refList,
+    BVHBuildOptions const& options);
 uint32_t buildBVH(BVHBuildNode* buildNode, BVH& bvh);
+// Hot triangles in the final refList order, after the build reordered it
+std::vector<BVHTriangle> buildTriangleList(std::vector<BVHTriangleRef> const& refList,
+    std::vector<TriangleRef> const& triangles, std::vector<Vertex> const& vertex_data);
 AABB refListBounds(std::vector<BVHTriangleRef> const& refList);
+AABB emptyAABB();
+AABB mergeAABB(AABB const& a, AABB const& b);
+float surfaceArea(AABB const& bounds);
+glm::vec3 centroid(AABB const& bounds);
 
 enum BVHAxis {
   X_AXIS = 0,
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include <bvh.hpp>
+#include <scene.hpp>
+
+// Bumped whenever the layout of the file or of any stored record changes
+constexpr uint32_t BVH_CACHE_VERSION = 2;
+
+// The buffers compute.comp reads, each stored exactly as uploaded behind the 16 byte header
+enum BVHCacheSection {
+  CACHE_TRIANGLES = 0,
+  CACHE_NODES = 1,
+  CACHE_TOP_LEVEL_NODES = 2,
+  CACHE_INSTANCES = 3,
+  CACHE_SECTION_COUNT = 4
+};
+
+struct BVHCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t format;   // BVHNodeFormat of CACHE_NODES
+	uint64_t key;      // bvhCacheKey the file was written for
+	uint64_t checksum; // hashBytes of everything behind the header
+	uint64_t fileSize;
+
+	float boundsMin[3];
+	float boundsMax[3];
+	uint32_t stackBound; // Stack entries the render walks need, see renderStackBound
+
+	uint32_t counts[CACHE_SECTION_COUNT];  // Elements, what the shader finds in the buffer header
+	uint64_t offsets[CACHE_SECTION_COUNT]; // From the start of the file
+	uint64_t sizes[CACHE_SECTION_COUNT];   // Bytes
+};
+
+// FNV-1a over 64 bit words, the tail bytes are folded in one by one
+uint64_t hashBytes(void const* data, size_t size, uint64_t seed = 0xcbf29ce484222325ull);
+
+// Hash of the source file contents and everything that changes the built tree,
+// 0 if the source can not be read
+uint64_t bvhCacheKey(std::string const& meshPath, unsigned copies, BVHBuildOptions const& options,
+	BVHNodeFormat format);
+
+// Writes to a temporary file first and renames it, readers never see half a cache
+bool writeBVHCache(std::string const& path, uint64_t key, TwoLevelBVH const& accel, AABB const& bounds,
+	uint32_t stackBound);
+
+// Read only mapping of a cache file, sections point into the mapping and stay
+// valid until it is closed
+class MappedBVHCache {
+public:
+	MappedBVHCache() : mData(nullptr), mSize(0) {}
+	~MappedBVHCache();
+
+	MappedBVHCache(MappedBVHCache const&) = delete;
+	MappedBVHCache& operator=(MappedBVHCache const&) = delete;
+
+	// False for a missing, stale or corrupt file, which is then left unmapped
+	bool open(std::string const& path, uint64_t key, BVHNodeFormat format);
+	void close();
+
+	BVHCacheHeader const& header() const;
+	void const* section(BVHCacheSection section) const;
+	uint64_t sectionSize(BVHCacheSection section) const;
+	uint32_t count(BVHCacheSection section) const;
+	AABB bounds() const;
+	uint32_t stackBound() const;
+
+private:
+	char const* mData;
+	size_t mSize;
+};
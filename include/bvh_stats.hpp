@@ -0,0 +1,66 @@
+#pragma once
+
+#include <ostream>
+
+#include <bvh.hpp>
+#include <traverse.hpp>
+
+// Per ray traversal work over a ray set, see traceBVHStats
+struct BVHRayStats {
+	const char* traversalOrder = "";
+	uint64_t rayCount = 0;
+	uint64_t hitCount = 0;
+	double traceMs = 0.0;
+
+	double meanNodesVisited = 0.0;
+	double meanBoxTests = 0.0;
+	double meanTriangleTests = 0.0;
+	uint64_t maxNodesVisited = 0;
+	uint64_t maxTriangleTests = 0;
+
+	// Node fetch locality, see TraversalStats
+	double meanNodeJumpBytes = 0.0; // Per fetch
+	double meanPageJumps = 0.0;     // Per ray
+};
+
+struct BVHStats {
+	const char* builder;
+	const char* nodeFormat;
+	const char* nodeLayout;
+	double buildMs = 0.0;
+
+	float sahCost = 0.0f;
+
+	uint32_t nodeCount = 0; // Binary nodes, leaves included
+	uint32_t leafCount = 0;
+	uint32_t refCount = 0;
+	uint32_t traversalNodeCount = 0; // In nodeFormat
+
+	// Indexed by leaf depth and by leaf size, the root is at depth 0
+	std::vector<uint32_t> depthHistogram;
+	std::vector<uint32_t> leafSizeHistogram;
+	double meanLeafDepth = 0.0;
+
+	// Mean over inner nodes of the area both children share, relative to the node area
+	double siblingOverlap = 0.0;
+
+	// What the build keeps on the CPU and what is uploaded
+	size_t binaryNodeBytes = 0;
+	size_t traversalNodeBytes = 0;
+	size_t refBytes = 0;
+	size_t triangleBytes = 0;
+
+	BVHRayStats rays;
+};
+
+// Tree shape and memory of the tree, buildMs and rays are left to the caller
+BVHStats computeBVHStats(TraversalBVH const& tree, BVHBuildOptions const& options);
+
+// Traces every ray on the CPU in parallel and fills stats.rays
+void traceBVHStats(TraversalBVH const& tree, std::vector<Ray> const& rays, BVHStats& stats,
+	TraversalOrder order = NEAREST_FIRST);
+
+// One JSON object per BVHStats, written as an array
+void writeBVHStatsJSON(std::ostream& out, std::vector<BVHStats> const& stats);
+
+const char* builderName(BVHBuilder builder);
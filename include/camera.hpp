@@ -0,0 +1,47 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <traverse.hpp>
+
+constexpr glm::vec3 WORLD_UP = glm::vec3(0.0, 1.0, 0.0);
+
+struct Camera {
+	alignas(16) glm::vec3 mPos;
+	alignas(16) glm::vec3 mUp;
+	alignas(16) glm::vec3 mForward;
+	alignas(16) glm::vec3 mRight;
+
+	Camera() = default;
+	Camera(glm::vec3 const& pos,
+		glm::vec3 const& forward,
+		glm::vec3 const& up) :
+		mPos(pos),
+		mForward(forward),
+		mUp(up)
+	{
+		mRight = glm::cross(up, forward);
+	}
+
+	void lookAt(glm::vec3 const& pos, glm::vec3 const& center)
+	{
+		mForward = glm::normalize(center - pos);
+		mPos = pos;
+
+		mRight = glm::cross(mForward, WORLD_UP);
+		mUp = glm::normalize(glm::cross(mForward, mRight));
+		mRight = glm::cross(mUp, mForward);
+	}
+};
+
+// Same primary ray as compute.comp generates for pixel (x, y)
+inline Ray cameraRay(Camera const& cam, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	glm::vec2 uv = glm::vec2(x, y) / glm::vec2(w, h);
+	float ratio = float(w) / float(h);
+
+	glm::vec2 p = (-1.0f + 2.0f * uv) * glm::vec2(ratio, 1.0f);
+	glm::vec3 d = cam.mForward + (cam.mRight * p.x) + (cam.mUp * p.y);
+
+	return {cam.mPos, glm::normalize(d)};
+}
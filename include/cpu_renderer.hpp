@@ -0,0 +1,21 @@
+#pragma once
+
+#include <image.hpp>
+#include <camera.hpp>
+#include <scene.hpp>
+
+// Pixels per side of the square tiles the image is split into, one task each
+constexpr uint32_t CPU_TILE_SIZE = 16;
+
+// Paints every pixel the way compute.comp does, from the same trees and camera.
+// pixels has w * h entries in the row order of the GPU image buffer.
+void renderCPU(TwoLevelBVH const& accel, Camera const& cam, uint32_t w, uint32_t h, vrt::Pixel* pixels,
+	ThreadPool& pool = defaultThreadPool());
+
+struct PixelDifference {
+	uint32_t differing;  // Pixels with any channel further apart than the tolerance
+	float maxDifference; // Over all channels of all pixels
+};
+
+PixelDifference comparePixels(std::vector<vrt::Pixel> const& a, std::vector<vrt::Pixel> const& b,
+	float tolerance);
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -28,4 +30,6 @@ public:
 };
 
 bool savePPMImage(Image const& image, std::string const& path);
+// w * h pixels straight from a mapped buffer, no copy into an Image
+bool savePPMImage(unsigned w, unsigned h, Pixel const* pixels, std::string const& path);
 }
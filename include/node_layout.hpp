@@ -0,0 +1,21 @@
+#pragma once
+
+#include <bvh.hpp>
+#include <wide_bvh.hpp>
+#include <quantized_bvh.hpp>
+
+// Binary traversal finds the left child right after its parent, so only the
+// order of the children is free. The smaller subtree goes left, which puts the
+// right child as close to its parent as it can get. Rewrites rightOffsetEnd,
+// refList and triangleList stay as they are.
+void orderBVHChildren(BVH& bvh);
+
+// Wide nodes index every child, so they are permuted into a van Emde Boas
+// layout: the top half of the levels first, then every subtree hanging below
+// it, each laid out the same way. Any subtree of h levels ends up in
+// O(h / log B) blocks of B nodes, whatever B is. The root stays at 0.
+template <unsigned N>
+void layoutVEB(WideBVH<N>& wide);
+void layoutVEB(QuantizedBVH& quantized);
+
+const char* nodeLayoutName(BVHNodeLayout layout);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <bvh.hpp>
+#include <wide_bvh.hpp>
+
+// 4-wide node in one 64 byte cache line. Child bounds are stored as 8 bit
+// offsets on a per axis grid of 2^exponent steps starting at origin, the
+// bounds of the node itself. Children and counts as in WideBVHNode.
+struct QuantizedBVHNode {
+	float origin[3];
+	int8_t exponent[3];
+	uint8_t pad;
+	int32_t child[4];
+	uint8_t qminX[4], qminY[4], qminZ[4];
+	uint8_t qmaxX[4], qmaxY[4], qmaxZ[4];
+	uint16_t count[4];
+};
+
+static_assert(sizeof(QuantizedBVHNode) == 64, "QuantizedBVHNode must match compute.comp");
+
+// Largest leaf the 16 bit counts hold
+constexpr unsigned QUANTIZED_MAX_LEAF_SIZE = 0xFFFF;
+
+// options with maxLeafSize capped at QUANTIZED_MAX_LEAF_SIZE, for building a
+// tree that is quantized afterwards
+BVHBuildOptions quantizedBuildOptions(BVHBuildOptions const& options);
+
+// Leaves index the refList of the binary BVH the wide tree was collapsed from
+struct QuantizedBVH {
+	std::vector<QuantizedBVHNode> nodeList;
+};
+
+// Rounds child bounds outwards, decoded boxes always contain the exact ones
+QuantizedBVH quantizeBVH(WideBVH<4> const& wide);
+
+// origin + q * 2^exponent, exact in float so fused and separate multiply-add agree
+float quantizedScale(int8_t exponent);
+float dequantize(float origin, float scale, uint8_t q);
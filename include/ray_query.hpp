@@ -0,0 +1,70 @@
+#pragma once
+
+#include <type_traits>
+
+#include <scene.hpp>
+
+// Contiguous elements owned by someone else, std::span is C++20
+template <typename T>
+struct Span {
+	T* data = nullptr;
+	size_t size = 0;
+
+	Span() = default;
+	Span(T* data, size_t size) : data(data), size(size) {}
+	template <typename U, typename = std::enable_if_t<std::is_convertible<U*, T*>::value>>
+	Span(std::vector<U>& values) : data(values.data()), size(values.size()) {}
+	template <typename U, typename = std::enable_if_t<std::is_convertible<U const*, T*>::value>>
+	Span(std::vector<U> const& values) : data(values.data()), size(values.size()) {}
+
+	T& operator[](size_t i) const { return data[i]; }
+	T* begin() const { return data; }
+	T* end() const { return data + size; }
+};
+
+constexpr uint32_t RAY_QUERY_MISS = ~0u;
+
+// t is the max float and both indices are RAY_QUERY_MISS when nothing was hit.
+// Laid out like Hit in compute.comp.
+struct RayQueryHit {
+	float t;
+	uint32_t primitive; // Triangle index within the mesh
+	uint32_t instance;  // Into Scene::instances
+	float u, v;         // Barycentrics of the hit, see RayHit
+};
+
+static_assert(sizeof(RayQueryHit) == 20, "RayQueryHit must match compute.comp");
+
+// Shadow or visibility query from o along d over [tmin, tmax], in units of d.
+// Laid out like Segment in compute.comp.
+struct OcclusionSegment {
+	glm::vec3 o;
+	float tmin;
+	glm::vec3 d;
+	float tmax;
+};
+
+static_assert(sizeof(OcclusionSegment) == 32, "OcclusionSegment must match compute.comp");
+
+struct RayQueryOptions {
+	// Batches this large are traced in coherence order, smaller ones as given
+	size_t sortThreshold = 4096;
+	size_t grain = 256; // Rays per task
+};
+
+// Closest hit of every ray, hits[i] belongs to rays[i] and both spans have the
+// same size. Only reads accel, so any number of threads may query the same
+// scene at once as long as nobody refits or rebuilds it meanwhile.
+void traceRays(TwoLevelBVH const& accel, Span<Ray const> rays, Span<RayQueryHit> hits,
+	RayQueryOptions const& options = RayQueryOptions(), ThreadPool& pool = defaultThreadPool());
+RayQueryHit traceRay(TwoLevelBVH const& accel, Ray const& r);
+
+// occludedFlags[i] is 1 when segments[i] hits anything, any hit ends its walk
+void traceOcclusion(TwoLevelBVH const& accel, Span<OcclusionSegment const> segments, Span<uint8_t> occludedFlags,
+	RayQueryOptions const& options = RayQueryOptions(), ThreadPool& pool = defaultThreadPool());
+bool occluded(TwoLevelBVH const& accel, OcclusionSegment const& segment);
+
+// Trace order for the batch: by direction octant, then origin, then direction,
+// so neighbouring rays walk mostly the same nodes
+std::vector<uint32_t> coherentRayOrder(Span<Ray const> rays, ThreadPool* pool = nullptr);
+std::vector<uint32_t> coherentRayOrder(Span<OcclusionSegment const> segments, ThreadPool* pool = nullptr);
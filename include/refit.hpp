@@ -0,0 +1,33 @@
+#pragma once
+
+#include <bvh.hpp>
+
+// Elements per dirty range granule, uploads never split below this
+constexpr size_t DIRTY_RANGE_GRANULARITY = 256;
+
+// [begin, end) in elements of the array it refers to
+struct DirtyRange {
+	size_t begin;
+	size_t end;
+};
+
+struct BVHRefitResult {
+	float sahCost;     // bvhSAHCost after the refit
+	float costRatio;   // sahCost over the cost the tree was built with
+	bool needsRebuild; // costRatio went past BVHBuildOptions::refitRebuildRatio
+
+	std::vector<DirtyRange> dirtyTriangles; // Ranges of bvh.triangleList
+	std::vector<DirtyRange> dirtyNodes;     // Ranges of bvh.nodeList
+};
+
+// SAH cost of the flattened tree relative to the root area, the quality metric refits are held to
+float bvhSAHCost(BVH const& bvh, BVHBuildOptions const& options);
+
+// Moves the tree onto new vertex positions with the same topology: refreshes
+// refList bounds and triangleList, then every node bottom-up. Split SBVH refs
+// grow back to whole triangle bounds, which stays correct but costs quality.
+BVHRefitResult refitBVH(BVH& bvh, std::vector<TriangleRef> const& triangles,
+	std::vector<Vertex> const& vertex_data, BVHBuildOptions const& options, float builtCost);
+
+// Granules of two equally long arrays that differ
+std::vector<DirtyRange> diffRanges(void const* before, void const* after, size_t count, size_t stride);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <bvh.hpp>
+#include <traverse.hpp>
+
+// One placement of Scene::meshes[mesh], transform goes from mesh to world space
+struct MeshInstance {
+	glm::mat4 transform;
+	uint32_t mesh;
+
+	MeshInstance() = default;
+	MeshInstance(glm::mat4 const& transform, uint32_t mesh) :
+		transform(transform), mesh(mesh) {}
+};
+
+// Every mesh is stored once, no matter how many instances use it
+struct Scene {
+	std::vector<Mesh> meshes;
+	std::vector<MeshInstance> instances;
+};
+
+// What the top level leaves point at, one per instance in topLevel.refList order.
+// Rows of the world to mesh transform, the offsets locate the mesh in the
+// concatenated node and triangle buffers.
+struct BVHInstance {
+	glm::vec4 worldToMesh[3];
+	uint32_t nodeOffset;
+	uint32_t triangleOffset;
+	uint32_t mesh;
+	uint32_t index; // Into Scene::instances
+};
+
+static_assert(sizeof(BVHInstance) == 64, "BVHInstance must match compute.comp");
+
+// Bottom level BVHs shared by instances, under a binary top level BVH over the
+// instance bounds. Bottom level indices are relative to their mesh, traversal
+// adds the offsets of the instance.
+struct TwoLevelBVH {
+	BVHNodeFormat format;
+
+	std::vector<BVH> meshBVHs;           // One per Scene::meshes
+	std::vector<TraversalBVH> meshTrees; // Point into meshBVHs
+	std::vector<float> builtCosts;       // bvhSAHCost of each mesh right after its build
+
+	// Where every mesh starts in the concatenated buffers, and their sizes
+	std::vector<uint32_t> nodeOffsets;
+	std::vector<uint32_t> triangleOffsets;
+	uint32_t nodeCount;
+	uint32_t triangleCount;
+
+	BVH topLevel; // refList bounds instances, triangleList stays empty
+	std::vector<BVHInstance> instanceList;
+};
+
+// Loads every mesh of the file once and instances it at every node using it
+std::optional<Scene> loadScene(std::string const& path);
+Scene singleMeshScene(Mesh const& mesh);
+
+AABB meshBounds(Mesh const& mesh);
+AABB transformAABB(AABB const& bounds, glm::mat4 const& transform);
+AABB sceneBounds(Scene const& scene);
+
+TwoLevelBVH buildTwoLevelBVH(Scene const& scene, BVHBuildOptions const& options, BVHNodeFormat format,
+	Arena& arena);
+// Builds one bottom level BVH again, the top level has to be rebuilt afterwards
+void rebuildMeshBVH(TwoLevelBVH& accel, Scene const& scene, uint32_t mesh, BVHBuildOptions const& options,
+	Arena& arena);
+// Offsets, instance bounds and the top level BVH from the current bottom level BVHs.
+// Cheap next to the bottom level, so it is simply redone after refits.
+void buildTopLevelBVH(TwoLevelBVH& accel, Scene const& scene, BVHBuildOptions const& options, Arena& arena);
+
+// The ray in mesh space, the direction is not normalized again so t is the same in both spaces
+Ray instanceRay(BVHInstance const& instance, Ray const& r);
+
+// Moves the ray into every instance it overlaps, hit.index is the triangle
+// within the mesh of instance hitInstance
+bool traceRay(TwoLevelBVH const& accel, Ray const& r, RayHit& hit, uint32_t& hitInstance,
+	TraversalStats* stats = nullptr, TraversalOrder order = NEAREST_FIRST);
+// Stops at the first instance with a hit in [tmin, tmax]
+bool occluded(TwoLevelBVH const& accel, Ray const& r, float tmin, float tmax, TraversalStats* stats = nullptr);
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <traverse.hpp>
+
+// Instruction sets the intersection kernels are compiled for. Every kernel is
+// built into the one binary, simdKernels() picks the best one the CPU has.
+enum SimdISA {
+	SCALAR_ISA = 0,
+	SSE_ISA = 1,    // 4 lanes, always there on x86-64
+	AVX2_ISA = 2,   // 8 lanes
+	AVX512_ISA = 3, // 16 lanes, AVX-512F
+	SIMD_ISA_COUNT = 4
+};
+
+// Widest vector any kernel loads at once
+constexpr uint32_t SIMD_MAX_LANES = 16;
+
+// BVHTriangle split into one array per component, in triangleList order so the
+// triangles of a leaf are one contiguous run. SIMD_MAX_LANES zeroed triangles
+// follow the last one, so a kernel can load a full vector at any triangle.
+struct SoATriangles {
+	std::vector<float> v0x, v0y, v0z;
+	std::vector<float> e1x, e1y, e1z;
+	std::vector<float> e2x, e2y, e2z;
+	std::vector<uint32_t> index;
+	uint32_t count = 0;
+};
+
+SoATriangles makeSoATriangles(std::vector<BVHTriangle> const& triangleList);
+
+// count <= 32 boxes with their bounds stored per axis, the way WideBVHNode keeps its children
+struct SoABoxes {
+	float const* minX;
+	float const* minY;
+	float const* minZ;
+	float const* maxX;
+	float const* maxY;
+	float const* maxZ;
+	uint32_t count;
+};
+
+template <unsigned N>
+SoABoxes nodeBoxes(WideBVHNode<N> const& node)
+{
+	return {node.minX, node.minY, node.minZ, node.maxX, node.maxY, node.maxZ, N};
+}
+
+// Child bounds of a QuantizedBVHNode decoded with dequantize, what its SoABoxes point into
+struct DequantizedBoxes {
+	float minX[4], minY[4], minZ[4];
+	float maxX[4], maxY[4], maxZ[4];
+};
+
+SoABoxes nodeBoxes(QuantizedBVHNode const& node, DequantizedBoxes& decoded);
+
+// Up to SIMD_MAX_LANES rays with their reciprocal directions. A box only
+// counts as hit for a ray when it starts before that ray's tmax.
+struct RayPacket {
+	alignas(64) float ox[SIMD_MAX_LANES];
+	alignas(64) float oy[SIMD_MAX_LANES];
+	alignas(64) float oz[SIMD_MAX_LANES];
+	alignas(64) float invX[SIMD_MAX_LANES];
+	alignas(64) float invY[SIMD_MAX_LANES];
+	alignas(64) float invZ[SIMD_MAX_LANES];
+	alignas(64) float tmax[SIMD_MAX_LANES];
+	uint32_t count;
+};
+
+RayPacket makeRayPacket(Ray const* rays, uint32_t count);
+
+// One ray against many triangles or boxes, or many rays against one box.
+// Each gives the same answers as intersectBVHTriangle, intersectSlabs and
+// intersectBox, lane i of a mask is bit i.
+struct SimdKernels {
+	SimdISA isa;
+	const char* name;
+	uint32_t lanes;
+
+	// Closest triangle of [begin, end) nearer than hit.t, true when hit was updated.
+	// Fills t, index, u and v like intersectBVHTriangle.
+	bool (*intersectTriangles)(SoATriangles const& triangles, uint32_t begin, uint32_t end, Ray const& r,
+		RayHit& hit);
+	uint32_t (*intersectBoxes)(SoABoxes const& boxes, Ray const& r, glm::vec3 const& inv);
+	uint32_t (*intersectPacket)(AABB const& box, RayPacket const& packet);
+};
+
+bool simdSupported(SimdISA isa);
+SimdKernels const& simdKernels(SimdISA isa);
+// The widest supported kernels, detected once
+SimdKernels const& simdKernels();
+// The narrowest supported kernels that test count boxes in one vector, the
+// wide walks pick theirs by node width
+SimdKernels const& simdBoxKernels(uint32_t count);
+
+const char* simdISAName(SimdISA isa);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+// Work-stealing pool: every worker owns a deque, pushes and pops at the back
+// and steals from the front of the others when its own deque runs dry.
+class ThreadPool {
+public:
+	explicit ThreadPool(unsigned threadCount = std::thread::hardware_concurrency());
+	~ThreadPool();
+
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool& operator=(ThreadPool const&) = delete;
+
+	unsigned size() const;
+
+	void submit(std::function<void()> task);
+
+	// Runs one queued task on the calling thread, used by waiters to help out
+	bool runPendingTask();
+
+private:
+	struct WorkerQueue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	void workerLoop(unsigned index);
+	bool popTask(unsigned index, std::function<void()>& task);
+
+	std::vector<std::unique_ptr<WorkerQueue>> mQueues;
+	std::vector<std::thread> mThreads;
+
+	std::mutex mSleepMutex;
+	std::condition_variable mWake;
+	std::atomic<unsigned> mQueuedTasks;
+	std::atomic<unsigned> mNextQueue;
+	bool mStop;
+};
+
+// Process wide pool sized to the machine, created on first use
+ThreadPool& defaultThreadPool();
+
+// Tracks a set of tasks, tasks may add more tasks to the group while running
+class TaskGroup {
+public:
+	explicit TaskGroup(ThreadPool& pool) : mPool(pool), mPending(0) {}
+	~TaskGroup() { wait(); }
+
+	void run(std::function<void()> task);
+	void wait();
+
+private:
+	ThreadPool& mPool;
+	std::atomic<unsigned> mPending;
+};
+
+// Calls f(chunkBegin, chunkEnd) for every grain sized chunk of [begin, end)
+template <typename F>
+void parallelFor(ThreadPool& pool, size_t begin, size_t end, size_t grain, F const& f)
+{
+	grain = std::max<size_t>(grain, 1);
+	if (end - begin <= grain) {
+		f(begin, end);
+		return;
+	}
+
+	TaskGroup group(pool);
+	for (size_t chunk = begin; chunk < end; chunk += grain) {
+		size_t chunkEnd = std::min(chunk + grain, end);
+		group.run([&f, chunk, chunkEnd]() { f(chunk, chunkEnd); });
+	}
+	group.wait();
+}
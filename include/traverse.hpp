@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <bvh.hpp>
+#include <wide_bvh.hpp>
+#include <quantized_bvh.hpp>
+#include <node_layout.hpp>
+
+// Default indexStack size of compute.comp, the host raises it for deeper trees
+constexpr unsigned TRAVERSAL_STACK_SIZE = 64;
+
+// Walk stack of the CPU traversals, TRAVERSAL_STACK_SIZE entries inline and
+// moved to the heap when a deep or wide tree pushes past them. A wide node
+// pushes up to N - 1 children, so (N - 1) * depth + 1 entries can be live.
+template <typename T>
+class TraversalStack {
+public:
+	TraversalStack() = default;
+	TraversalStack(TraversalStack const&) = delete;
+	TraversalStack& operator=(TraversalStack const&) = delete;
+
+	T& operator[](size_t i)
+	{
+		if (i >= mCapacity)
+			grow(i + 1);
+		return mData[i];
+	}
+
+private:
+	void grow(size_t size)
+	{
+		size_t capacity = std::max(size, 2 * mCapacity);
+		if (mHeap.empty())
+			mHeap.assign(mInline, mInline + mCapacity);
+		mHeap.resize(capacity);
+		mData = mHeap.data();
+		mCapacity = capacity;
+	}
+
+	T mInline[TRAVERSAL_STACK_SIZE];
+	std::vector<T> mHeap;
+	T* mData = mInline;
+	size_t mCapacity = TRAVERSAL_STACK_SIZE;
+};
+
+// CPU side of the traversal in compute.comp, used to measure and compare trees
+struct Ray {
+	glm::vec3 o;
+	glm::vec3 d;
+
+	Ray() = default;
+	Ray(glm::vec3 o, glm::vec3 d) : o(o), d(d) {}
+};
+
+struct RayHit {
+	float t;
+	uint32_t index; // BVHTriangle::index of the closest triangle
+	float u, v;     // Barycentrics of e1 and e2, left alone by the SimdKernels
+};
+
+// How closest hit walks pick and cull children
+enum TraversalOrder {
+	// Left or first child first and every overlapped child is visited, the
+	// walk the render in compute.comp does
+	FIXED_ORDER = 0,
+	// Nearest entry first, children starting beyond the closest hit so far are culled
+	NEAREST_FIRST = 1
+};
+
+const char* traversalOrderName(TraversalOrder order);
+
+struct TraversalStats {
+	uint64_t nodesVisited = 0;
+	uint64_t boxTests = 0;
+	uint64_t triangleTests = 0;
+
+	// Locality of the node fetches: bytes between consecutive fetches, and
+	// fetches landing on another page than the one before
+	uint64_t nodeJumpBytes = 0;
+	uint64_t pageJumps = 0;
+};
+
+// Page size pageJumps counts against
+constexpr uint64_t TRAVERSAL_PAGE_BYTES = 4096;
+
+bool intersectBox(AABB const& b, Ray const& r);
+// The same test with the reciprocal direction computed once per ray
+bool intersectBox(AABB const& b, Ray const& r, glm::vec3 const& inv);
+float intersectBVHTriangle(BVHTriangle const& tri, Ray const& r);
+// Fills t, u, v and index when the triangle is hit nearer than hit.t
+bool intersectBVHTriangle(BVHTriangle const& tri, Ray const& r, RayHit& hit);
+// Box test with the reciprocal direction computed once per ray
+bool intersectSlabs(float minX, float minY, float minZ, float maxX, float maxY, float maxZ,
+	Ray const& r, glm::vec3 const& inv);
+// True when the part of the box along the ray overlaps [tmin, tmax]
+bool intersectSegment(AABB const& b, Ray const& r, glm::vec3 const& inv, float tmin, float tmax);
+// Where the ray enters the box, clamped to 0. The max float when it misses or
+// enters at or beyond tmax.
+float intersectBoxEntry(AABB const& b, Ray const& r, glm::vec3 const& inv, float tmax);
+
+// Returns true and fills hit when the ray hits a triangle, stats is optional
+bool traceRay(BVH const& bvh, Ray const& r, RayHit& hit, TraversalStats* stats = nullptr,
+	TraversalOrder order = NEAREST_FIRST);
+
+// Tests all N children of a node at once, leaves are intersected before inner
+// children are pushed
+template <unsigned N>
+bool traceRay(WideBVH<N> const& bvh, std::vector<BVHTriangle> const& triangleList, Ray const& r,
+	RayHit& hit, TraversalStats* stats = nullptr, TraversalOrder order = NEAREST_FIRST);
+
+// Decodes the child bounds of every node before the same 4-wide test
+bool traceRay(QuantizedBVH const& bvh, std::vector<BVHTriangle> const& triangleList, Ray const& r,
+	RayHit& hit, TraversalStats* stats = nullptr, TraversalOrder order = NEAREST_FIRST);
+
+// Any hit in [tmin, tmax] ends the walk, boxes outside the segment are skipped
+bool occluded(BVH const& bvh, Ray const& r, float tmin, float tmax, TraversalStats* stats = nullptr);
+template <unsigned N>
+bool occluded(WideBVH<N> const& bvh, std::vector<BVHTriangle> const& triangleList, Ray const& r,
+	float tmin, float tmax, TraversalStats* stats = nullptr);
+bool occluded(QuantizedBVH const& bvh, std::vector<BVHTriangle> const& triangleList, Ray const& r,
+	float tmin, float tmax, TraversalStats* stats = nullptr);
+
+// The tree in the node format traversal runs on, the binary BVH it was made
+// from has to outlive it since wide leaves index its triangleList
+struct TraversalBVH {
+	BVHNodeFormat format;
+	BVH const* bvh;
+	WideBVH<4> wide4;
+	WideBVH<8> wide8;
+	QuantizedBVH quantized4;
+
+	uint32_t nodeCount() const;
+	size_t nodeStride() const;
+	void const* nodeData() const;
+};
+
+// Wide and quantized nodes are permuted for CACHE_OBLIVIOUS_LAYOUT, binary nodes
+// are ordered with orderBVHChildren on the BVH itself before this
+TraversalBVH makeTraversalBVH(BVH const& bvh, BVHNodeFormat format,
+	BVHNodeLayout layout = DEPTH_FIRST_LAYOUT);
+bool traceRay(TraversalBVH const& tree, Ray const& r, RayHit& hit, TraversalStats* stats = nullptr,
+	TraversalOrder order = NEAREST_FIRST);
+// Only hits nearer than tmax count, the two-level walk passes its closest hit so far
+bool traceRay(TraversalBVH const& tree, Ray const& r, float tmax, RayHit& hit, TraversalStats* stats = nullptr,
+	TraversalOrder order = NEAREST_FIRST);
+bool occluded(TraversalBVH const& tree, Ray const& r, float tmin, float tmax, TraversalStats* stats = nullptr);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <bvh.hpp>
+
+enum BVHNodeFormat {
+  BINARY_NODES = 0,
+  WIDE4_NODES = 1,
+  WIDE8_NODES = 2,
+  QUANTIZED4_NODES = 3
+};
+
+// N children with their bounds stored per axis, so one fetch tests all of them.
+// count[i] > 0 is a leaf over refList[child[i], child[i] + count[i]),
+// count[i] == 0 is an inner node at nodeList[child[i]], child[i] == -1 is empty.
+template <unsigned N>
+struct WideBVHNode {
+	float minX[N], minY[N], minZ[N];
+	float maxX[N], maxY[N], maxZ[N];
+	int32_t child[N];
+	uint32_t count[N];
+};
+
+static_assert(sizeof(WideBVHNode<4>) == 128, "WideBVHNode<4> must match compute.comp");
+static_assert(sizeof(WideBVHNode<8>) == 256, "WideBVHNode<8> must match compute.comp");
+
+// Leaves index the refList of the binary BVH the tree was collapsed from
+template <unsigned N>
+struct WideBVH {
+	std::vector<WideBVHNode<N>> nodeList;
+};
+
+// Pulls the largest grandchildren up into each node until it has N children
+template <unsigned N>
+WideBVH<N> collapseBVH(BVH const& bvh);
+
+BVHNodeFormat nodeFormatForWidth(unsigned width, bool quantized = false);
+const char* nodeFormatName(BVHNodeFormat format);
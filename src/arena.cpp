@@ -0,0 +1,86 @@
+#include <arena.hpp>
+
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+
+Arena::Arena(size_t blockSize) :
+	mBlockSize(blockSize), mCurrentBlock(0), mOffset(0), mStats()
+{
+}
+
+Arena::~Arena()
+{
+	release();
+}
+
+void* Arena::allocate(size_t size, size_t alignment)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	for (;;) {
+		if (mCurrentBlock < mBlocks.size()) {
+			Block& block = mBlocks[mCurrentBlock];
+			size_t offset = (mOffset + alignment - 1) & ~(alignment - 1);
+
+			if (offset + size <= block.size) {
+				mOffset = offset + size;
+				mStats.allocations++;
+				mStats.bytesUsed += size;
+				mStats.peakBytesUsed = std::max(mStats.peakBytesUsed, mStats.bytesUsed);
+				return block.data + offset;
+			}
+
+			// Move on to the next block, reused ones included
+			if (mCurrentBlock + 1 < mBlocks.size()) {
+				mCurrentBlock++;
+				mOffset = 0;
+				continue;
+			}
+		}
+
+		size_t blockSize = std::max(mBlockSize, size + alignment);
+		Block block = {static_cast<char*>(std::malloc(blockSize)), blockSize};
+		if (!block.data) {
+			std::cerr << "Arena could not allocate a block of " << blockSize << " bytes" << std::endl;
+			exit(-1);
+		}
+
+		mBlocks.push_back(block);
+		mCurrentBlock = mBlocks.size() - 1;
+		mOffset = 0;
+		mStats.bytesReserved += blockSize;
+		mStats.blockAllocations++;
+	}
+}
+
+void Arena::reset()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	mCurrentBlock = 0;
+	mOffset = 0;
+	mStats.allocations = 0;
+	mStats.bytesUsed = 0;
+}
+
+void Arena::release()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	for (auto& block : mBlocks)
+		std::free(block.data);
+
+	mBlocks.clear();
+	mCurrentBlock = 0;
+	mOffset = 0;
+	mStats.allocations = 0;
+	mStats.bytesUsed = 0;
+	mStats.bytesReserved = 0;
+}
+
+ArenaStats Arena::stats() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mStats;
+}
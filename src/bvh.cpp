@@ -11,6 +11,21 @@ std::vector<BVHTriangleRef> buildTriangleRefList(std::vector<TriangleRef> const&
 	return bvh_refs;
 }
 
+std::vector<BVHTriangle> buildTriangleList(std::vector<BVHTriangleRef> const& refList,
+    std::vector<TriangleRef> const& triangles, std::vector<Vertex> const& vertex_data)
+{
+  std::vector<BVHTriangle> triangleList(refList.size());
+
+  parallelFor(defaultThreadPool(), 0, refList.size(), 16384, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      unsigned index = refList[i].index;
+      triangleList[i] = BVHTriangle(triangles[index], vertex_data, index);
+    }
+  });
+
+  return triangleList;
+}
+
 void sortBVHRefList(std::vector<BVHTriangleRef>& refList, BVHAxis axis)
 {
   std::sort(refList.begin(), refList.end(), 
@@ -34,20 +49,70 @@ AABB refListBounds(std::vector<BVHTriangleRef> const& refList)
   return bounds;
 }
 
-BVHBuildNode* buildBVHNode(std::vector<BVHTriangleRef>& refList)
+AABB emptyAABB()
 {
-  //auto node = std::make_unique<BVHBuildNode>();
-  auto node = new BVHBuildNode;
-  AABB bounds = refListBounds(refList);
+  AABB bounds;
+  bounds.max = glm::vec3(-100000000000000);
+  bounds.min = glm::vec3(+100000000000000);
+  return bounds;
+}
 
-	if (refList.size() <= 10) {
-    node->isLeaf = true;
-    node->refList = refList;
-    node->leftBounds = bounds;
+AABB mergeAABB(AABB const& a, AABB const& b)
+{
+  return {glm::max(a.max, b.max), glm::min(a.min, b.min)};
+}
 
-    return node;
-	}
+float surfaceArea(AABB const& bounds)
+{
+  glm::vec3 d = glm::max(bounds.max - bounds.min, glm::vec3(0.0f));
+  return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
 
+glm::vec3 centroid(AABB const& bounds)
+{
+  return (bounds.max + bounds.min) / 2.0f;
+}
+
+// Shared state of one in-place build, nodes only ever refer to ranges of refs
+struct BVHBuildContext {
+  std::vector<BVHTriangleRef>& refs;
+  BVHBuildOptions const& options;
+  ThreadPool* pool;
+  TaskGroup* group;
+  Arena& arena;
+};
+
+static bool parallelRange(BVHBuildContext const& ctx, uint32_t count)
+{
+  return ctx.pool && count >= ctx.options.parallelBinningCutoff;
+}
+
+static AABB rangeBounds(BVHBuildContext const& ctx, uint32_t begin, uint32_t end)
+{
+  auto boundsOf = [&](size_t chunkBegin, size_t chunkEnd) -> AABB {
+    AABB bounds = emptyAABB();
+    for (size_t i = chunkBegin; i < chunkEnd; ++i)
+      bounds = mergeAABB(bounds, ctx.refs[i].bounds);
+    return bounds;
+  };
+
+  if (!parallelRange(ctx, end - begin))
+    return boundsOf(begin, end);
+
+  size_t grain = std::max(ctx.options.parallelBinningCutoff / 4, 1u);
+  std::vector<AABB> partial((end - begin + grain - 1) / grain);
+  parallelFor(*ctx.pool, begin, end, grain, [&](size_t chunkBegin, size_t chunkEnd) {
+    partial[(chunkBegin - begin) / grain] = boundsOf(chunkBegin, chunkEnd);
+  });
+
+  AABB bounds = emptyAABB();
+  for (auto& b : partial)
+    bounds = mergeAABB(bounds, b);
+  return bounds;
+}
+
+static BVHAxis longestAxis(AABB const& bounds)
+{
   BVHAxis sortAxis;
   if (bounds.max.x - bounds.min.x < bounds.max.y - bounds.min.y) {
     if (bounds.max.y - bounds.min.y < bounds.max.z - bounds.min.z) {
@@ -60,36 +125,313 @@ BVHBuildNode* buildBVHNode(std::vector<BVHTriangleRef>& refList)
   } else {
     sortAxis = X_AXIS;
   }
-  
-	sortBVHRefList(refList, sortAxis);
 
-  auto mid = refList.begin() + (refList.size() / 2);
-  std::vector<BVHTriangleRef> leftRefs(refList.begin(), mid);
-  std::vector<BVHTriangleRef> rightRefs(mid, refList.end());
+  return sortAxis;
+}
+
+struct SAHSplit {
+  BVHAxis axis;
+  unsigned bin;
+  float cost;
+  float centroidMin;
+  float binScale;
+  AABB leftBounds;
+  AABB rightBounds;
+  bool valid;
+};
+
+constexpr unsigned MAX_SAH_BINS = 64;
+
+// Bounds and counts of every bin on all three axes, kept off the heap
+struct SAHBins {
+  AABB bounds[3][MAX_SAH_BINS];
+  uint32_t counts[3][MAX_SAH_BINS];
+
+  SAHBins() = default;
+  SAHBins(unsigned binCount)
+  {
+    for (int axis = X_AXIS; axis <= Z_AXIS; ++axis) {
+      for (unsigned b = 0; b < binCount; ++b) {
+        bounds[axis][b] = emptyAABB();
+        counts[axis][b] = 0;
+      }
+    }
+  }
+};
 
-  node->leftBounds = refListBounds(leftRefs);
-  node->rightBounds = refListBounds(rightRefs);
+static unsigned sahBinCount(BVHBuildOptions const& options)
+{
+  return glm::clamp(options.sahBinCount, 2u, MAX_SAH_BINS);
+}
+
+static unsigned sahBinIndex(float c, float centroidMin, float binScale, unsigned binCount)
+{
+  unsigned bin = static_cast<unsigned>((c - centroidMin) * binScale);
+  return std::min(bin, binCount - 1);
+}
+
+// Sweeps binCount - 1 candidate planes on each axis and returns the cheapest one
+static SAHSplit findSAHSplit(BVHBuildContext const& ctx, uint32_t begin, uint32_t end,
+  AABB const& bounds)
+{
+  BVHBuildOptions const& options = ctx.options;
+  unsigned binCount = sahBinCount(options);
+  uint32_t count = end - begin;
+
+  auto centroidBoundsOf = [&](size_t chunkBegin, size_t chunkEnd) -> AABB {
+    AABB cb = emptyAABB();
+    for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+      glm::vec3 c = centroid(ctx.refs[i].bounds);
+      cb.max = glm::max(c, cb.max);
+      cb.min = glm::min(c, cb.min);
+    }
+    return cb;
+  };
+
+  size_t grain = std::max(options.parallelBinningCutoff / 4, 1u);
+  size_t chunkCount = (count + grain - 1) / grain;
+
+  AABB centroidBounds = emptyAABB();
+  if (parallelRange(ctx, count)) {
+    std::vector<AABB> partial(chunkCount);
+    parallelFor(*ctx.pool, begin, end, grain, [&](size_t chunkBegin, size_t chunkEnd) {
+      partial[(chunkBegin - begin) / grain] = centroidBoundsOf(chunkBegin, chunkEnd);
+    });
+    for (auto& b : partial)
+      centroidBounds = mergeAABB(centroidBounds, b);
+  } else {
+    centroidBounds = centroidBoundsOf(begin, end);
+  }
+
+  SAHSplit best = {};
+  best.valid = false;
+  best.cost = std::numeric_limits<float>::max();
+
+  float rootArea = surfaceArea(bounds);
+  if (rootArea <= 0.0f)
+    return best;
+
+  glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+  glm::vec3 binScale;
+  for (int axis = X_AXIS; axis <= Z_AXIS; ++axis)
+    binScale[axis] = extent[axis] > 0.0f ? binCount / extent[axis] : 0.0f;
+
+  auto binRange = [&](SAHBins& bins, size_t chunkBegin, size_t chunkEnd) {
+    for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+      auto const& ref = ctx.refs[i];
+      glm::vec3 c = centroid(ref.bounds);
+      for (int axis = X_AXIS; axis <= Z_AXIS; ++axis) {
+        unsigned b = sahBinIndex(c[axis], centroidBounds.min[axis], binScale[axis], binCount);
+        bins.bounds[axis][b] = mergeAABB(bins.bounds[axis][b], ref.bounds);
+        bins.counts[axis][b]++;
+      }
+    }
+  };
+
+  SAHBins bins(binCount);
+  if (parallelRange(ctx, count)) {
+    std::vector<SAHBins> partial(chunkCount, SAHBins(binCount));
+    parallelFor(*ctx.pool, begin, end, grain, [&](size_t chunkBegin, size_t chunkEnd) {
+      binRange(partial[(chunkBegin - begin) / grain], chunkBegin, chunkEnd);
+    });
+    for (auto& p : partial) {
+      for (int axis = X_AXIS; axis <= Z_AXIS; ++axis) {
+        for (unsigned b = 0; b < binCount; ++b) {
+          bins.bounds[axis][b] = mergeAABB(bins.bounds[axis][b], p.bounds[axis][b]);
+          bins.counts[axis][b] += p.counts[axis][b];
+        }
+      }
+    }
+  } else {
+    binRange(bins, begin, end);
+  }
+
+  AABB rightBounds[MAX_SAH_BINS];
+  float rightCost[MAX_SAH_BINS];
+
+  for (int axis = X_AXIS; axis <= Z_AXIS; ++axis) {
+    if (binScale[axis] <= 0.0f)
+      continue;
+
+    AABB const* binBounds = bins.bounds[axis];
+    uint32_t const* binCounts = bins.counts[axis];
+
+    // rightCost[b] holds the cost of everything in bins [b, binCount)
+    AABB acc = binBounds[binCount - 1];
+    uint32_t accCount = binCounts[binCount - 1];
+    for (unsigned b = binCount - 1; b > 0; --b) {
+      rightBounds[b] = acc;
+      rightCost[b] = accCount ? surfaceArea(acc) * accCount : 0.0f;
+      acc = mergeAABB(acc, binBounds[b - 1]);
+      accCount += binCounts[b - 1];
+    }
+
+    acc = binBounds[0];
+    accCount = binCounts[0];
+    for (unsigned b = 1; b < binCount; ++b) {
+      float leftCost = accCount ? surfaceArea(acc) * accCount : 0.0f;
+      float cost = options.traversalCost +
+        options.intersectionCost * (leftCost + rightCost[b]) / rootArea;
+
+      if (accCount > 0 && accCount < count && cost < best.cost) {
+        best.axis = static_cast<BVHAxis>(axis);
+        best.bin = b;
+        best.cost = cost;
+        best.centroidMin = centroidBounds.min[axis];
+        best.binScale = binScale[axis];
+        best.leftBounds = acc;
+        best.rightBounds = rightBounds[b];
+        best.valid = true;
+      }
+
+      acc = mergeAABB(acc, binBounds[b]);
+      accCount += binCounts[b];
+    }
+  }
+
+  return best;
+}
+
+static void buildBVHRange(BVHBuildContext& ctx, BVHBuildNode* node,
+  uint32_t begin, uint32_t end, AABB const& bounds)
+{
+  BVHBuildOptions const& options = ctx.options;
+  uint32_t count = end - begin;
+
+  SAHSplit split = {};
+  bool makeLeaf;
+  if (options.builder == SAH_BUILDER) {
+    if (count > 1)
+      split = findSAHSplit(ctx, begin, end, bounds);
+
+    float leafCost = options.intersectionCost * count;
+    makeLeaf = count <= 1 ||
+      (count <= options.maxLeafSize && (!split.valid || leafCost <= split.cost));
+  } else {
+    makeLeaf = count <= std::max(options.maxLeafSize, 1u);
+  }
+
+  if (makeLeaf) {
+    node->isLeaf = true;
+    node->refBegin = begin;
+    node->refEnd = end;
+    node->leftBounds = bounds;
+
+    return;
+  }
+
+  auto first = ctx.refs.begin() + begin;
+  auto last = ctx.refs.begin() + end;
+  uint32_t mid;
+
+  if (split.valid) {
+    unsigned binCount = sahBinCount(options);
+    auto it = std::partition(first, last,
+      [&](BVHTriangleRef const& ref) -> bool {
+        float c = centroid(ref.bounds)[split.axis];
+        return sahBinIndex(c, split.centroidMin, split.binScale, binCount) < split.bin;
+      });
+    mid = begin + static_cast<uint32_t>(it - first);
+
+    node->leftBounds = split.leftBounds;
+    node->rightBounds = split.rightBounds;
+  } else {
+    // Median split, also taken by SAH when every centroid is in the same spot
+    BVHAxis axis = longestAxis(bounds);
+    mid = begin + count / 2;
+    std::nth_element(first, ctx.refs.begin() + mid, last,
+      [&](BVHTriangleRef const& ref0, BVHTriangleRef const& ref1) -> bool {
+        return centroid(ref0.bounds)[axis] < centroid(ref1.bounds)[axis];
+      });
+
+    node->leftBounds = rangeBounds(ctx, begin, mid);
+    node->rightBounds = rangeBounds(ctx, mid, end);
+  }
 
   node->isLeaf = false;
 
-  //node->left = std::unique_ptr<BVHBuildNode>(buildBVHNode(leftRefs));
-  //node->right = std::unique_ptr<BVHBuildNode>(buildBVHNode(rightRefs));
-  node->left = buildBVHNode(leftRefs);
-  node->right = buildBVHNode(rightRefs);
+  // Siblings are allocated together, one arena allocation per split
+  node->left = ctx.arena.create<BVHBuildNode>(2);
+  node->right = node->left + 1;
+
+  BVHBuildNode* left = node->left;
+  AABB leftBounds = node->leftBounds;
+  if (ctx.pool && count >= options.parallelCutoff) {
+    ctx.group->run([&ctx, left, begin, mid, leftBounds]() {
+      buildBVHRange(ctx, left, begin, mid, leftBounds);
+    });
+  } else {
+    buildBVHRange(ctx, left, begin, mid, leftBounds);
+  }
+
+  buildBVHRange(ctx, node->right, mid, end, node->rightBounds);
+}
+
+BVHBuildNode* buildBVHNode(std::vector<BVHTriangleRef>& refList, Arena& arena)
+{
+  BVHBuildOptions options;
+  options.builder = MEDIAN_BUILDER;
+  options.parallel = false;
+
+  return buildBVHNode(refList, options, arena);
+}
+
+BVHBuildNode* buildBVHNodeSAH(std::vector<BVHTriangleRef>& refList, BVHBuildOptions const& options,
+  Arena& arena)
+{
+  BVHBuildOptions sahOptions = options;
+  sahOptions.builder = SAH_BUILDER;
+
+  return buildBVHNode(refList, sahOptions, arena);
+}
+
+BVHBuildNode* buildBVHNode(std::vector<BVHTriangleRef>& refList, BVHBuildOptions const& options,
+  Arena& arena)
+{
+  if (options.builder == LBVH_BUILDER)
+    return buildBVHNodeLBVH(refList, options, arena);
+
+  BVHBuildOptions buildOptions = options;
+  if (options.builder == SBVH_BUILDER) {
+    std::cerr << "SBVH needs the mesh to split triangles, building a SAH BVH instead" << std::endl;
+    buildOptions.builder = SAH_BUILDER;
+  }
+
+  ThreadPool* pool = options.parallel ? &defaultThreadPool() : nullptr;
+  std::optional<TaskGroup> group;
+  if (pool)
+    group.emplace(*pool);
+
+  BVHBuildContext ctx = {refList, buildOptions, pool, group ? &*group : nullptr, arena};
+
+  auto node = arena.create<BVHBuildNode>();
+  buildBVHRange(ctx, node, 0, refList.size(), rangeBounds(ctx, 0, refList.size()));
+
+  if (group)
+    group->wait();
 
   return node;
 }
 
+BVHBuildNode* buildBVHNode(std::vector<BVHTriangleRef>& refList, Mesh const& mesh,
+  BVHBuildOptions const& options, Arena& arena)
+{
+  if (options.builder == SBVH_BUILDER)
+    return buildBVHNodeSBVH(refList, mesh, options, arena);
+
+  return buildBVHNode(refList, options, arena);
+}
+
 uint32_t buildBVH(BVHBuildNode* buildNode, BVH& bvh)
 {
   BVHNode node;
   node.isLeafBegin = buildNode->isLeaf ? 1 : -1;
 
+  // Leaves already index bvh.refList, the build partitioned it into final order
   if (node.isLeafBegin > 0) {
-    node.isLeafBegin = bvh.refList.size();
-    node.rightOffsetEnd = bvh.refList.size() + buildNode->refList.size();
+    node.isLeafBegin = buildNode->refBegin;
+    node.rightOffsetEnd = buildNode->refEnd;
     bvh.nodeList.push_back(node);
-    bvh.refList.insert(bvh.refList.end(), buildNode->refList.begin(), buildNode->refList.end());
 
     return bvh.nodeList.size() - 1;
   }
@@ -106,29 +448,10 @@ uint32_t buildBVH(BVHBuildNode* buildNode, BVH& bvh)
   return nodeIndex;
 }
 
-std::optional<Mesh> loadMesh(std::string const& path) {
+Mesh meshFromAssimp(aiMesh const* mesh) {
   std::vector<Vertex> vertex_data;
   std::vector<TriangleRef> triangles;
 
-  Assimp::Importer importer;
-  const aiScene *scene = importer.ReadFile(path, aiProcess_Triangulate |
-                                           aiProcess_FlipUVs |
-                                           aiProcess_GenNormals);
-
-  if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
-    std::cerr << "Failed to open mesh: " + path + "; " + importer.GetErrorString() + "\n";
-    return {};
-  }
-
-  aiNode *node = scene->mRootNode->mChildren[0];
-
-  if (node->mNumMeshes != 1) {
-    std::cerr << "Only a single mesh is suported\n";
-    return {};
-  }
-
-  aiMesh *mesh = scene->mMeshes[node->mMeshes[0]];
-
   for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
     glm::vec3 p, n;
     glm::vec2 t = {};
@@ -149,14 +472,34 @@ std::optional<Mesh> loadMesh(std::string const& path) {
     vertex_data.emplace_back(p, n, t);
   }
 
+  // Once per face, the faces are triangles after aiProcess_Triangulate
   for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
     aiFace face = mesh->mFaces[i];
+    triangles.emplace_back(face.mIndices[0],
+                        face.mIndices[1],
+                        face.mIndices[2]);
+  }
 
-    for (unsigned int j = 0; j < 3; j++) 
-      triangles.emplace_back(face.mIndices[0],
-                          face.mIndices[1],
-                          face.mIndices[2]);
+  return {vertex_data, triangles};
+}
+
+std::optional<Mesh> loadMesh(std::string const& path) {
+  Assimp::Importer importer;
+  const aiScene *scene = importer.ReadFile(path, aiProcess_Triangulate |
+                                           aiProcess_FlipUVs |
+                                           aiProcess_GenNormals);
+
+  if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
+    std::cerr << "Failed to open mesh: " + path + "; " + importer.GetErrorString() + "\n";
+    return {};
+  }
+
+  aiNode *node = scene->mRootNode->mChildren[0];
+
+  if (node->mNumMeshes != 1) {
+    std::cerr << "Only a single mesh is suported, use loadScene\n";
+    return {};
   }
 
-	return {{vertex_data, triangles}};
+	return meshFromAssimp(scene->mMeshes[node->mMeshes[0]]);
 }
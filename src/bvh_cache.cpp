@@ -0,0 +1,244 @@
+#include <bvh_cache.hpp>
+
+#include <cstring>
+#include <cstdio>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char BVH_CACHE_MAGIC[8] = {'V', 'R', 'T', 'B', 'V', 'H', 'C', '\0'};
+
+constexpr uint64_t FNV_PRIME = 0x100000001b3ull;
+
+uint64_t hashBytes(void const* data, size_t size, uint64_t seed)
+{
+  char const* bytes = static_cast<char const*>(data);
+  uint64_t hash = seed;
+
+  size_t words = size / sizeof(uint64_t);
+  for (size_t i = 0; i < words; ++i) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+    hash = (hash ^ word) * FNV_PRIME;
+  }
+
+  for (size_t i = words * sizeof(uint64_t); i < size; ++i)
+    hash = (hash ^ static_cast<uint8_t>(bytes[i])) * FNV_PRIME;
+
+  return hash;
+}
+
+template <typename T>
+static uint64_t hashValue(uint64_t hash, T const& value)
+{
+  return hashBytes(&value, sizeof(T), hash);
+}
+
+// Maps a whole file read only, returns nullptr for a missing or empty file
+static char const* mapFile(std::string const& path, size_t& size)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    ::close(fd);
+    return nullptr;
+  }
+
+  size = info.st_size;
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+
+  return data == MAP_FAILED ? nullptr : static_cast<char const*>(data);
+}
+
+uint64_t bvhCacheKey(std::string const& meshPath, unsigned copies, BVHBuildOptions const& options,
+  BVHNodeFormat format)
+{
+  size_t size;
+  char const* source = mapFile(meshPath, size);
+  if (!source)
+    return 0;
+
+  uint64_t hash = hashBytes(source, size);
+  munmap(const_cast<char*>(source), size);
+
+  // Only what changes the tree, thread counts and refit settings do not
+  hash = hashValue(hash, copies);
+  hash = hashValue(hash, format);
+  hash = hashValue(hash, options.builder);
+  hash = hashValue(hash, options.sahBinCount);
+  hash = hashValue(hash, options.traversalCost);
+  hash = hashValue(hash, options.intersectionCost);
+  hash = hashValue(hash, options.spatialSplitAlpha);
+  hash = hashValue(hash, options.spatialSplitBudget);
+  hash = hashValue(hash, options.maxLeafSize);
+  hash = hashValue(hash, options.treeletOptimize);
+  hash = hashValue(hash, options.treeletSize);
+  hash = hashValue(hash, options.treeletRounds);
+  hash = hashValue(hash, options.width);
+  hash = hashValue(hash, options.quantizeNodes);
+  hash = hashValue(hash, options.nodeLayout);
+
+  // 0 is reserved for unreadable sources
+  return hash ? hash : 1;
+}
+
+bool writeBVHCache(std::string const& path, uint64_t key, TwoLevelBVH const& accel, AABB const& bounds,
+  uint32_t stackBound)
+{
+  BVHCacheHeader header = {};
+  std::memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+  header.version = BVH_CACHE_VERSION;
+  header.format = accel.format;
+  header.key = key;
+
+  for (int i = 0; i < 3; ++i) {
+    header.boundsMin[i] = bounds.min[i];
+    header.boundsMax[i] = bounds.max[i];
+  }
+  header.stackBound = stackBound;
+
+  size_t nodeStride = accel.meshTrees.empty() ? 0 : accel.meshTrees.front().nodeStride();
+  header.counts[CACHE_TRIANGLES] = accel.triangleCount;
+  header.counts[CACHE_NODES] = accel.nodeCount;
+  header.counts[CACHE_TOP_LEVEL_NODES] = accel.topLevel.nodeList.size();
+  header.counts[CACHE_INSTANCES] = accel.instanceList.size();
+  header.sizes[CACHE_TRIANGLES] = sizeof(BVHTriangle) * accel.triangleCount;
+  header.sizes[CACHE_NODES] = nodeStride * accel.nodeCount;
+  header.sizes[CACHE_TOP_LEVEL_NODES] = sizeof(BVHNode) * accel.topLevel.nodeList.size();
+  header.sizes[CACHE_INSTANCES] = sizeof(BVHInstance) * accel.instanceList.size();
+
+  // Sections start 16 byte aligned, like the records in them
+  uint64_t offset = (sizeof(BVHCacheHeader) + 15) & ~15ull;
+  for (int i = 0; i < CACHE_SECTION_COUNT; ++i) {
+    header.offsets[i] = offset;
+    offset = (offset + header.sizes[i] + 15) & ~15ull;
+  }
+  header.fileSize = offset;
+
+  // Assembled once, the checksum runs over exactly the bytes written
+  std::vector<char> payload(header.fileSize - sizeof(BVHCacheHeader), 0);
+  auto sectionData = [&](BVHCacheSection section) {
+    return payload.data() + header.offsets[section] - sizeof(BVHCacheHeader);
+  };
+
+  for (size_t i = 0; i < accel.meshBVHs.size(); ++i) {
+    auto const& triangleList = accel.meshBVHs[i].triangleList;
+    std::memcpy(sectionData(CACHE_TRIANGLES) + accel.triangleOffsets[i] * sizeof(BVHTriangle),
+      triangleList.data(), triangleList.size() * sizeof(BVHTriangle));
+
+    auto const& tree = accel.meshTrees[i];
+    std::memcpy(sectionData(CACHE_NODES) + accel.nodeOffsets[i] * nodeStride,
+      tree.nodeData(), tree.nodeCount() * nodeStride);
+  }
+  std::memcpy(sectionData(CACHE_TOP_LEVEL_NODES), accel.topLevel.nodeList.data(),
+    header.sizes[CACHE_TOP_LEVEL_NODES]);
+  std::memcpy(sectionData(CACHE_INSTANCES), accel.instanceList.data(), header.sizes[CACHE_INSTANCES]);
+
+  header.checksum = hashBytes(payload.data(), payload.size());
+
+  std::string tmpPath = path + ".tmp";
+  std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    std::cerr << "Failed to write BVH cache: " << tmpPath << std::endl;
+    return false;
+  }
+
+  file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+  file.write(payload.data(), payload.size());
+  file.close();
+
+  if (!file || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+    std::cerr << "Failed to write BVH cache: " << path << std::endl;
+    std::remove(tmpPath.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+MappedBVHCache::~MappedBVHCache()
+{
+  close();
+}
+
+bool MappedBVHCache::open(std::string const& path, uint64_t key, BVHNodeFormat format)
+{
+  close();
+
+  mData = mapFile(path, mSize);
+  if (!mData)
+    return false;
+
+  const char* problem = nullptr;
+  BVHCacheHeader const& h = header();
+  if (mSize < sizeof(BVHCacheHeader) || std::memcmp(h.magic, BVH_CACHE_MAGIC, sizeof(h.magic)) != 0)
+    problem = "not a BVH cache";
+  else if (h.version != BVH_CACHE_VERSION)
+    problem = "written by another version";
+  else if (h.key != key || h.format != format)
+    problem = "stale";
+  else if (h.fileSize != mSize)
+    problem = "truncated";
+
+  for (int i = 0; !problem && i < CACHE_SECTION_COUNT; ++i)
+    if (h.offsets[i] < sizeof(BVHCacheHeader) || h.offsets[i] > mSize || h.sizes[i] > mSize - h.offsets[i])
+      problem = "section out of bounds";
+
+  if (!problem && hashBytes(mData + sizeof(BVHCacheHeader), mSize - sizeof(BVHCacheHeader)) != h.checksum)
+    problem = "checksum mismatch";
+
+  if (problem) {
+    std::cout << "Ignoring BVH cache " << path << ": " << problem << std::endl;
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+void MappedBVHCache::close()
+{
+  if (mData)
+    munmap(const_cast<char*>(mData), mSize);
+
+  mData = nullptr;
+  mSize = 0;
+}
+
+BVHCacheHeader const& MappedBVHCache::header() const
+{
+  return *reinterpret_cast<BVHCacheHeader const*>(mData);
+}
+
+void const* MappedBVHCache::section(BVHCacheSection section) const
+{
+  return mData + header().offsets[section];
+}
+
+uint64_t MappedBVHCache::sectionSize(BVHCacheSection section) const
+{
+  return header().sizes[section];
+}
+
+uint32_t MappedBVHCache::count(BVHCacheSection section) const
+{
+  return header().counts[section];
+}
+
+AABB MappedBVHCache::bounds() const
+{
+  BVHCacheHeader const& h = header();
+  return {glm::vec3(h.boundsMax[0], h.boundsMax[1], h.boundsMax[2]),
+    glm::vec3(h.boundsMin[0], h.boundsMin[1], h.boundsMin[2])};
+}
+
+uint32_t MappedBVHCache::stackBound() const
+{
+  return header().stackBound;
+}
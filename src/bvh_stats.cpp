@@ -0,0 +1,205 @@
+#include <bvh_stats.hpp>
+#include <refit.hpp>
+
+#include <chrono>
+
+// Zero when the boxes only touch or miss, surfaceArea alone would still count the other axes
+static float overlapArea(AABB const& a, AABB const& b)
+{
+  AABB overlap = {glm::min(a.max, b.max), glm::max(a.min, b.min)};
+  if (glm::any(glm::lessThanEqual(overlap.max, overlap.min)))
+    return 0.0f;
+
+  return surfaceArea(overlap);
+}
+
+template <typename T>
+static void countInto(std::vector<T>& histogram, size_t bucket)
+{
+  if (histogram.size() <= bucket)
+    histogram.resize(bucket + 1, 0);
+  histogram[bucket]++;
+}
+
+BVHStats computeBVHStats(TraversalBVH const& tree, BVHBuildOptions const& options)
+{
+  BVH const& bvh = *tree.bvh;
+
+  BVHStats stats;
+  stats.builder = builderName(options.builder);
+  stats.nodeFormat = nodeFormatName(tree.format);
+  stats.nodeLayout = nodeLayoutName(options.nodeLayout);
+  stats.sahCost = bvhSAHCost(bvh, options);
+  stats.nodeCount = bvh.nodeList.size();
+  stats.refCount = bvh.refList.size();
+  stats.traversalNodeCount = tree.nodeCount();
+
+  stats.binaryNodeBytes = bvh.nodeList.size() * sizeof(BVHNode);
+  stats.traversalNodeBytes = tree.nodeCount() * tree.nodeStride();
+  stats.refBytes = bvh.refList.size() * sizeof(BVHTriangleRef);
+  stats.triangleBytes = bvh.triangleList.size() * sizeof(BVHTriangle);
+
+  if (bvh.nodeList.empty())
+    return stats;
+
+  // DFS order, the left child follows its parent and the right one is at rightOffsetEnd
+  std::vector<std::pair<uint32_t, uint32_t>> stack = {{0, 0}};
+  uint64_t depthSum = 0;
+  double overlapSum = 0.0;
+  uint32_t innerCount = 0;
+
+  while (!stack.empty()) {
+    auto [index, depth] = stack.back();
+    stack.pop_back();
+
+    BVHNode const& node = bvh.nodeList[index];
+    if (node.isLeafBegin >= 0) {
+      stats.leafCount++;
+      depthSum += depth;
+      countInto(stats.depthHistogram, depth);
+      countInto(stats.leafSizeHistogram, node.rightOffsetEnd - node.isLeafBegin);
+      continue;
+    }
+
+    float area = surfaceArea(mergeAABB(node.leftBounds, node.rightBounds));
+    if (area > 0.0f)
+      overlapSum += overlapArea(node.leftBounds, node.rightBounds) / area;
+    innerCount++;
+
+    stack.push_back({node.rightOffsetEnd, depth + 1});
+    stack.push_back({index + 1, depth + 1});
+  }
+
+  stats.meanLeafDepth = stats.leafCount ? double(depthSum) / stats.leafCount : 0.0;
+  stats.siblingOverlap = innerCount ? overlapSum / innerCount : 0.0;
+
+  return stats;
+}
+
+void traceBVHStats(TraversalBVH const& tree, std::vector<Ray> const& rays, BVHStats& stats,
+  TraversalOrder order)
+{
+  constexpr size_t grain = 4096;
+  size_t chunkCount = (rays.size() + grain - 1) / grain;
+
+  // One slot per chunk, merged once every ray is traced
+  struct ChunkStats {
+    TraversalStats total;
+    uint64_t hits = 0;
+    uint64_t maxNodesVisited = 0;
+    uint64_t maxTriangleTests = 0;
+  };
+  std::vector<ChunkStats> chunks(chunkCount);
+
+  auto traceStart = std::chrono::steady_clock::now();
+  parallelFor(defaultThreadPool(), 0, rays.size(), grain, [&](size_t begin, size_t end) {
+    ChunkStats& chunk = chunks[begin / grain];
+    for (size_t i = begin; i < end; ++i) {
+      TraversalStats ray;
+      RayHit hit;
+      if (traceRay(tree, rays[i], hit, &ray, order))
+        chunk.hits++;
+
+      chunk.total.nodesVisited += ray.nodesVisited;
+      chunk.total.boxTests += ray.boxTests;
+      chunk.total.triangleTests += ray.triangleTests;
+      chunk.total.nodeJumpBytes += ray.nodeJumpBytes;
+      chunk.total.pageJumps += ray.pageJumps;
+      chunk.maxNodesVisited = std::max(chunk.maxNodesVisited, ray.nodesVisited);
+      chunk.maxTriangleTests = std::max(chunk.maxTriangleTests, ray.triangleTests);
+    }
+  });
+  std::chrono::duration<double, std::milli> traceTime = std::chrono::steady_clock::now() - traceStart;
+
+  BVHRayStats& result = stats.rays;
+  result = BVHRayStats();
+  result.traversalOrder = traversalOrderName(order);
+  result.rayCount = rays.size();
+  result.traceMs = traceTime.count();
+
+  TraversalStats total;
+  for (auto const& chunk : chunks) {
+    total.nodesVisited += chunk.total.nodesVisited;
+    total.boxTests += chunk.total.boxTests;
+    total.triangleTests += chunk.total.triangleTests;
+    total.nodeJumpBytes += chunk.total.nodeJumpBytes;
+    total.pageJumps += chunk.total.pageJumps;
+    result.hitCount += chunk.hits;
+    result.maxNodesVisited = std::max(result.maxNodesVisited, chunk.maxNodesVisited);
+    result.maxTriangleTests = std::max(result.maxTriangleTests, chunk.maxTriangleTests);
+  }
+
+  if (result.rayCount) {
+    result.meanNodesVisited = double(total.nodesVisited) / result.rayCount;
+    result.meanBoxTests = double(total.boxTests) / result.rayCount;
+    result.meanTriangleTests = double(total.triangleTests) / result.rayCount;
+    result.meanPageJumps = double(total.pageJumps) / result.rayCount;
+  }
+
+  if (total.nodesVisited)
+    result.meanNodeJumpBytes = double(total.nodeJumpBytes) / total.nodesVisited;
+}
+
+static void writeArray(std::ostream& out, std::vector<uint32_t> const& values)
+{
+  out << "[";
+  for (size_t i = 0; i < values.size(); ++i)
+    out << (i ? ", " : "") << values[i];
+  out << "]";
+}
+
+void writeBVHStatsJSON(std::ostream& out, std::vector<BVHStats> const& stats)
+{
+  out << "[\n";
+  for (size_t i = 0; i < stats.size(); ++i) {
+    BVHStats const& s = stats[i];
+    out << "  {\n"
+      << "    \"builder\": \"" << s.builder << "\",\n"
+      << "    \"nodeFormat\": \"" << s.nodeFormat << "\",\n"
+      << "    \"nodeLayout\": \"" << s.nodeLayout << "\",\n"
+      << "    \"buildMs\": " << s.buildMs << ",\n"
+      << "    \"sahCost\": " << s.sahCost << ",\n"
+      << "    \"nodeCount\": " << s.nodeCount << ",\n"
+      << "    \"leafCount\": " << s.leafCount << ",\n"
+      << "    \"refCount\": " << s.refCount << ",\n"
+      << "    \"traversalNodeCount\": " << s.traversalNodeCount << ",\n"
+      << "    \"meanLeafDepth\": " << s.meanLeafDepth << ",\n"
+      << "    \"depthHistogram\": ";
+    writeArray(out, s.depthHistogram);
+    out << ",\n    \"leafSizeHistogram\": ";
+    writeArray(out, s.leafSizeHistogram);
+    out << ",\n"
+      << "    \"siblingOverlap\": " << s.siblingOverlap << ",\n"
+      << "    \"memory\": {\"binaryNodeBytes\": " << s.binaryNodeBytes
+      << ", \"traversalNodeBytes\": " << s.traversalNodeBytes
+      << ", \"refBytes\": " << s.refBytes
+      << ", \"triangleBytes\": " << s.triangleBytes << "},\n"
+      << "    \"rays\": {\"traversalOrder\": \"" << s.rays.traversalOrder << "\""
+      << ", \"count\": " << s.rays.rayCount
+      << ", \"hits\": " << s.rays.hitCount
+      << ", \"traceMs\": " << s.rays.traceMs
+      << ", \"meanNodesVisited\": " << s.rays.meanNodesVisited
+      << ", \"meanBoxTests\": " << s.rays.meanBoxTests
+      << ", \"meanTriangleTests\": " << s.rays.meanTriangleTests
+      << ", \"maxNodesVisited\": " << s.rays.maxNodesVisited
+      << ", \"maxTriangleTests\": " << s.rays.maxTriangleTests
+      << ", \"meanNodeJumpBytes\": " << s.rays.meanNodeJumpBytes
+      << ", \"meanPageJumps\": " << s.rays.meanPageJumps << "}\n"
+      << "  }" << (i + 1 < stats.size() ? "," : "") << "\n";
+  }
+  out << "]" << std::endl;
+}
+
+const char* builderName(BVHBuilder builder)
+{
+  switch (builder) {
+  case SAH_BUILDER:
+    return "sah";
+  case LBVH_BUILDER:
+    return "lbvh";
+  case SBVH_BUILDER:
+    return "sbvh";
+  default:
+    return "median";
+  }
+}
@@ -0,0 +1,241 @@
+#include <cpu_renderer.hpp>
+#include <simd.hpp>
+
+#include <cmath>
+
+// compute.comp's EPSILON, not the one the CPU traversals use
+constexpr float SHADER_EPSILON = 0.0000001f;
+
+// What compute.comp adds per child box hit and per triangle hit
+const glm::vec4 BOX_PAINT = glm::vec4(0.006f);
+const glm::vec4 TRIANGLE_PAINT = glm::vec4(0.0f, 0.0f, 0.05f, 0.0f);
+
+static bool hitsTriangle(BVHTriangle const& tri, Ray const& r)
+{
+	glm::vec3 pvec = glm::cross(r.d, tri.e2);
+	glm::vec3 tvec = r.o - tri.v0;
+	glm::vec3 qvec = glm::cross(tvec, tri.e1);
+
+	float det = 1.0f / glm::dot(pvec, tri.e1);
+	float u = glm::dot(tvec, pvec) * det;
+	float v = glm::dot(r.d, qvec) * det;
+	float t = glm::dot(tri.e2, qvec) * det;
+
+	return !(t < SHADER_EPSILON || u < SHADER_EPSILON || v < SHADER_EPSILON || (u + v > 1.0f));
+}
+
+static void paintTriangles(std::vector<BVHTriangle> const& triangles, uint32_t begin, uint32_t end,
+	Ray const& r, glm::vec4& color)
+{
+	for (uint32_t i = begin; i < end; ++i)
+		if (hitsTriangle(triangles[i], r))
+			color += TRIANGLE_PAINT;
+}
+
+// traceBinary in compute.comp
+static void paintBinary(BVH const& bvh, Ray const& r, glm::vec4& color)
+{
+	glm::vec3 inv = 1.0f / r.d;
+
+	TraversalStack<uint32_t> indexStack;
+	int stackIndex = 0;
+	indexStack[0] = 0;
+
+	uint32_t index = 0;
+	while (stackIndex != -1) {
+		BVHNode const& node = bvh.nodeList[index];
+
+		if (node.isLeafBegin >= 0) {
+			paintTriangles(bvh.triangleList, node.isLeafBegin, node.rightOffsetEnd, r, color);
+			index = indexStack[stackIndex--];
+		} else {
+			bool r1 = intersectBox(node.leftBounds, r, inv);
+			bool r2 = intersectBox(node.rightBounds, r, inv);
+
+			if (!r1 && !r2) {
+				index = indexStack[stackIndex--];
+			} else {
+				if (r1) color += BOX_PAINT;
+				if (r2) color += BOX_PAINT;
+
+				if (r1) {
+					if (r2) indexStack[++stackIndex] = node.rightOffsetEnd;
+					index++;
+				} else {
+					index = node.rightOffsetEnd;
+				}
+			}
+		}
+	}
+}
+
+// visitWideChildren in compute.comp
+template <typename Node, unsigned N>
+static void paintWideChildren(Node const& node, bool const* hit, std::vector<BVHTriangle> const& triangles,
+	Ray const& r, TraversalStack<uint32_t>& stack, int& stackSize, glm::vec4& color)
+{
+	for (unsigned i = 0; i < N; ++i) {
+		if (!hit[i] || node.child[i] < 0)
+			continue;
+
+		color += BOX_PAINT;
+
+		if (node.count[i] == 0)
+			stack[stackSize++] = node.child[i];
+		else
+			paintTriangles(triangles, node.child[i], node.child[i] + node.count[i], r, color);
+	}
+}
+
+// traceWide4 and traceWide8 in compute.comp
+template <unsigned N>
+static void paintWide(WideBVH<N> const& bvh, std::vector<BVHTriangle> const& triangles, Ray const& r,
+	glm::vec4& color)
+{
+	glm::vec3 inv = 1.0f / r.d;
+	SimdKernels const& kernels = simdBoxKernels(N);
+
+	TraversalStack<uint32_t> stack;
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+		WideBVHNode<N> const& node = bvh.nodeList[stack[--stackSize]];
+
+		uint32_t childHits = kernels.intersectBoxes(nodeBoxes(node), r, inv);
+		bool hit[N];
+		for (unsigned i = 0; i < N; ++i)
+			hit[i] = childHits & (1u << i);
+
+		paintWideChildren<WideBVHNode<N>, N>(node, hit, triangles, r, stack, stackSize, color);
+	}
+}
+
+// traceQuantized4 in compute.comp
+static void paintQuantized(QuantizedBVH const& bvh, std::vector<BVHTriangle> const& triangles, Ray const& r,
+	glm::vec4& color)
+{
+	glm::vec3 inv = 1.0f / r.d;
+	SimdKernels const& kernels = simdBoxKernels(4);
+
+	TraversalStack<uint32_t> stack;
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+		QuantizedBVHNode const& node = bvh.nodeList[stack[--stackSize]];
+
+		DequantizedBoxes decoded;
+		uint32_t childHits = kernels.intersectBoxes(nodeBoxes(node, decoded), r, inv);
+		bool hit[4];
+		for (unsigned i = 0; i < 4; ++i)
+			hit[i] = childHits & (1u << i);
+
+		paintWideChildren<QuantizedBVHNode, 4>(node, hit, triangles, r, stack, stackSize, color);
+	}
+}
+
+// traceInstance in compute.comp
+static void paintInstance(TwoLevelBVH const& accel, BVHInstance const& instance, Ray const& r,
+	glm::vec4& color)
+{
+	Ray local = instanceRay(instance, r);
+	TraversalBVH const& tree = accel.meshTrees[instance.mesh];
+	std::vector<BVHTriangle> const& triangles = tree.bvh->triangleList;
+
+	switch (tree.format) {
+	case WIDE4_NODES:
+		paintWide(tree.wide4, triangles, local, color);
+		break;
+	case WIDE8_NODES:
+		paintWide(tree.wide8, triangles, local, color);
+		break;
+	case QUANTIZED4_NODES:
+		paintQuantized(tree.quantized4, triangles, local, color);
+		break;
+	default:
+		paintBinary(*tree.bvh, local, color);
+		break;
+	}
+}
+
+// traceScene in compute.comp, top level boxes are not painted
+static glm::vec4 paintScene(TwoLevelBVH const& accel, Ray const& r)
+{
+	glm::vec4 color(0.0f);
+	glm::vec3 inv = 1.0f / r.d;
+
+	BVH const& topLevel = accel.topLevel;
+	if (topLevel.nodeList.empty())
+		return color;
+
+	TraversalStack<uint32_t> instanceStack;
+	int instanceIndex = 0;
+	instanceStack[0] = 0;
+
+	uint32_t index = 0;
+	while (instanceIndex != -1) {
+		BVHNode const& node = topLevel.nodeList[index];
+
+		if (node.isLeafBegin >= 0) {
+			for (int32_t i = node.isLeafBegin; i < node.rightOffsetEnd; ++i)
+				paintInstance(accel, accel.instanceList[i], r, color);
+
+			index = instanceStack[instanceIndex--];
+		} else {
+			bool r1 = intersectBox(node.leftBounds, r, inv);
+			bool r2 = intersectBox(node.rightBounds, r, inv);
+
+			if (!r1 && !r2) {
+				index = instanceStack[instanceIndex--];
+			} else if (r1) {
+				if (r2) instanceStack[++instanceIndex] = node.rightOffsetEnd;
+				index++;
+			} else {
+				index = node.rightOffsetEnd;
+			}
+		}
+	}
+
+	return color;
+}
+
+void renderCPU(TwoLevelBVH const& accel, Camera const& cam, uint32_t w, uint32_t h, vrt::Pixel* pixels,
+	ThreadPool& pool)
+{
+	uint32_t tilesX = (w + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+	uint32_t tilesY = (h + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+
+	// One tile per task, idle workers steal tiles from busy ones
+	parallelFor(pool, 0, tilesX * tilesY, 1, [&](size_t tileBegin, size_t tileEnd) {
+		for (size_t tile = tileBegin; tile < tileEnd; ++tile) {
+			uint32_t x0 = (tile % tilesX) * CPU_TILE_SIZE;
+			uint32_t y0 = (tile / tilesX) * CPU_TILE_SIZE;
+			uint32_t x1 = std::min(x0 + CPU_TILE_SIZE, w);
+			uint32_t y1 = std::min(y0 + CPU_TILE_SIZE, h);
+
+			for (uint32_t y = y0; y < y1; ++y) {
+				for (uint32_t x = x0; x < x1; ++x) {
+					glm::vec4 color = paintScene(accel, cameraRay(cam, x, y, w, h));
+					pixels[x + y * w] = vrt::Pixel(color.r, color.g, color.b, color.a);
+				}
+			}
+		}
+	});
+}
+
+PixelDifference comparePixels(std::vector<vrt::Pixel> const& a, std::vector<vrt::Pixel> const& b,
+	float tolerance)
+{
+	PixelDifference difference = {0, 0.0f};
+	for (size_t i = 0; i < std::min(a.size(), b.size()); ++i) {
+		float d = std::max(std::max(std::abs(a[i].r - b[i].r), std::abs(a[i].g - b[i].g)),
+			std::max(std::abs(a[i].b - b[i].b), std::abs(a[i].a - b[i].a)));
+
+		difference.maxDifference = std::max(difference.maxDifference, d);
+		if (d > tolerance)
+			difference.differing++;
+	}
+
+	return difference;
+}
@@ -50,6 +50,11 @@ void Image::put(unsigned x, Pixel const& p)
 }
 
 bool savePPMImage(Image const& image, std::string const& path)
+{
+	return savePPMImage(image.width(), image.height(), image.getPixels().data(), path);
+}
+
+bool savePPMImage(unsigned w, unsigned h, Pixel const* pixels, std::string const& path)
 {
 	std::ofstream fs(path);
 
@@ -61,11 +66,12 @@ bool savePPMImage(Image const& image, std::string const& path)
 	}
 
 	fs << "P3\n"
-	   << image.width() << " "
-	   << image.height() << "\n"
+	   << w << " "
+	   << h << "\n"
 		<< "255\n";
 
-	for (auto& p : image.getPixels()) {
+	for (unsigned i = 0; i < w * h; ++i) {
+		Pixel const& p = pixels[i];
 		fs << static_cast<uint32_t>(std::fmin((p.r * 255), 255)) << " "
 		   << static_cast<uint32_t>(std::fmin((p.g * 255), 255)) << " "
 		   << static_cast<uint32_t>(std::fmin((p.b * 255), 255)) << " ";
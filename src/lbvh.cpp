@@ -0,0 +1,387 @@
+#include <bvh.hpp>
+
+#include <array>
+
+// Spreads the low 21 bits of v so that two zero bits follow every bit
+static uint64_t expandBits21(uint32_t v)
+{
+  uint64_t x = v & 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffffull;
+  x = (x | x << 16) & 0x1f0000ff0000ffull;
+  x = (x | x << 8) & 0x100f00f00f00f00full;
+  x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+  x = (x | x << 2) & 0x1249249249249249ull;
+  return x;
+}
+
+uint64_t mortonCode(glm::vec3 p)
+{
+  glm::vec3 q = glm::clamp(p * 2097152.0f, glm::vec3(0.0f), glm::vec3(2097151.0f));
+  return (expandBits21(static_cast<uint32_t>(q.x)) << 2) |
+         (expandBits21(static_cast<uint32_t>(q.y)) << 1) |
+          expandBits21(static_cast<uint32_t>(q.z));
+}
+
+// Runs f(chunkIndex, chunkBegin, chunkEnd) over grain sized chunks, serially without a pool
+template <typename F>
+static void forChunks(ThreadPool* pool, size_t count, size_t grain, F const& f)
+{
+  if (!pool) {
+    f(0, 0, count);
+    return;
+  }
+
+  parallelFor(*pool, 0, count, grain, [&](size_t begin, size_t end) {
+    f(begin / grain, begin, end);
+  });
+}
+
+// Each chunk builds a histogram, the chunk offsets are scanned and each chunk scatters
+void radixSortMorton(std::vector<uint64_t>& keys, std::vector<uint32_t>& values,
+  ThreadPool* pool, size_t grain)
+{
+  size_t count = keys.size();
+  if (count == 0)
+    return;
+
+  if (!pool)
+    grain = count;
+  size_t chunkCount = (count + grain - 1) / grain;
+
+  std::vector<uint64_t> keysTmp(count);
+  std::vector<uint32_t> valuesTmp(count);
+  std::vector<std::array<size_t, 256>> histograms(chunkCount);
+
+  for (unsigned shift = 0; shift < 64; shift += 8) {
+    forChunks(pool, count, grain, [&](size_t chunk, size_t begin, size_t end) {
+      auto& hist = histograms[chunk];
+      hist.fill(0);
+      for (size_t i = begin; i < end; ++i)
+        hist[(keys[i] >> shift) & 0xff]++;
+    });
+
+    // Digits that are the same for every key do not change the order
+    bool skipPass = false;
+    for (unsigned digit = 0; digit < 256 && !skipPass; ++digit) {
+      size_t digitCount = 0;
+      for (auto& hist : histograms)
+        digitCount += hist[digit];
+      skipPass = digitCount == count;
+    }
+    if (skipPass)
+      continue;
+
+    size_t offset = 0;
+    for (unsigned digit = 0; digit < 256; ++digit) {
+      for (auto& hist : histograms) {
+        size_t digitCount = hist[digit];
+        hist[digit] = offset;
+        offset += digitCount;
+      }
+    }
+
+    forChunks(pool, count, grain, [&](size_t chunk, size_t begin, size_t end) {
+      auto& hist = histograms[chunk];
+      for (size_t i = begin; i < end; ++i) {
+        size_t dst = hist[(keys[i] >> shift) & 0xff]++;
+        keysTmp[dst] = keys[i];
+        valuesTmp[dst] = values[i];
+      }
+    });
+
+    keys.swap(keysTmp);
+    values.swap(valuesTmp);
+  }
+}
+
+struct LBVHContext {
+  std::vector<uint64_t> const& codes;
+  BVHBuildOptions const& options;
+  ThreadPool* pool;
+  TaskGroup* group;
+  Arena& arena;
+};
+
+// First index in [begin, end) whose code has the highest differing bit of the range set
+static uint32_t findMortonSplit(std::vector<uint64_t> const& codes, uint32_t begin, uint32_t end)
+{
+  uint64_t first = codes[begin];
+  uint64_t last = codes[end - 1];
+
+  if (first == last)
+    return begin + (end - begin) / 2;
+
+  int bit = 63 - __builtin_clzll(first ^ last);
+  auto it = std::partition_point(codes.begin() + begin, codes.begin() + end,
+    [bit](uint64_t code) -> bool { return ((code >> bit) & 1) == 0; });
+
+  return static_cast<uint32_t>(it - codes.begin());
+}
+
+static void emitLBVHRange(LBVHContext& ctx, BVHBuildNode* node, uint32_t begin, uint32_t end)
+{
+  uint32_t count = end - begin;
+
+  node->refBegin = begin;
+  node->refEnd = end;
+
+  if (count <= std::max(ctx.options.maxLeafSize, 1u)) {
+    node->isLeaf = true;
+    return;
+  }
+
+  uint32_t mid = findMortonSplit(ctx.codes, begin, end);
+
+  node->isLeaf = false;
+  node->left = ctx.arena.create<BVHBuildNode>(2);
+  node->right = node->left + 1;
+
+  BVHBuildNode* left = node->left;
+  if (ctx.pool && count >= ctx.options.parallelCutoff) {
+    ctx.group->run([&ctx, left, begin, mid]() {
+      emitLBVHRange(ctx, left, begin, mid);
+    });
+  } else {
+    emitLBVHRange(ctx, left, begin, mid);
+  }
+
+  emitLBVHRange(ctx, node->right, mid, end);
+}
+
+static AABB buildNodeBounds(BVHBuildNode const* node)
+{
+  return node->isLeaf ? node->leftBounds : mergeAABB(node->leftBounds, node->rightBounds);
+}
+
+// Bottom-up pass filling in the bounds and SAH cost the emission left out
+static AABB refitBuildNode(BVHBuildNode* node, std::vector<BVHTriangleRef> const& refList,
+  BVHBuildOptions const& options)
+{
+  if (node->isLeaf) {
+    AABB bounds = emptyAABB();
+    for (uint32_t i = node->refBegin; i < node->refEnd; ++i)
+      bounds = mergeAABB(bounds, refList[i].bounds);
+
+    node->leftBounds = bounds;
+    node->cost = options.intersectionCost * surfaceArea(bounds) * (node->refEnd - node->refBegin);
+    return bounds;
+  }
+
+  node->leftBounds = refitBuildNode(node->left, refList, options);
+  node->rightBounds = refitBuildNode(node->right, refList, options);
+
+  AABB bounds = buildNodeBounds(node);
+  node->cost = options.traversalCost * surfaceArea(bounds) + node->left->cost + node->right->cost;
+  return bounds;
+}
+
+BVHBuildNode* buildBVHNodeLBVH(std::vector<BVHTriangleRef>& refList, BVHBuildOptions const& options,
+  Arena& arena)
+{
+  ThreadPool* pool = options.parallel ? &defaultThreadPool() : nullptr;
+  size_t grain = std::max(options.parallelBinningCutoff / 4, 1u);
+  size_t count = refList.size();
+
+  AABB centroidBounds = emptyAABB();
+  for (auto const& ref : refList) {
+    glm::vec3 c = centroid(ref.bounds);
+    centroidBounds.max = glm::max(c, centroidBounds.max);
+    centroidBounds.min = glm::min(c, centroidBounds.min);
+  }
+
+  glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+  glm::vec3 scale = glm::vec3(1.0f) / glm::max(extent, glm::vec3(EPSILON));
+
+  std::vector<uint64_t> codes(count);
+  std::vector<uint32_t> order(count);
+  forChunks(pool, count, grain, [&](size_t, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      codes[i] = mortonCode((centroid(refList[i].bounds) - centroidBounds.min) * scale);
+      order[i] = i;
+    }
+  });
+
+  radixSortMorton(codes, order, pool, grain);
+
+  // Leaves index ranges of the sorted list, so the refs move into Morton order once
+  std::vector<BVHTriangleRef> sorted;
+  sorted.reserve(count);
+  for (size_t i = 0; i < count; ++i)
+    sorted.push_back(refList[order[i]]);
+  refList.swap(sorted);
+
+  std::optional<TaskGroup> group;
+  if (pool)
+    group.emplace(*pool);
+
+  LBVHContext ctx = {codes, options, pool, group ? &*group : nullptr, arena};
+
+  auto root = arena.create<BVHBuildNode>();
+  if (count > 0)
+    emitLBVHRange(ctx, root, 0, count);
+  else
+    root->isLeaf = true;
+
+  if (group)
+    group->wait();
+
+  refitBuildNode(root, refList, options);
+
+  if (options.treeletOptimize)
+    optimizeBVHTreelets(root, refList, options);
+
+  return root;
+}
+
+constexpr unsigned MAX_TREELET_LEAVES = 7;
+
+struct TreeletContext {
+  BVHBuildOptions const& options;
+  ThreadPool* pool;
+  unsigned treeletSize;
+};
+
+// Rebuilds the subtree for the leaf subset 'set', taking inner nodes from 'internals'
+static void rebuildTreelet(BVHBuildNode* node, unsigned set, BVHBuildNode* const* leaves,
+  BVHBuildNode* const* internals, unsigned& nextInternal, unsigned const* partition, float const* cost)
+{
+  unsigned subsets[2] = {partition[set], set ^ partition[set]};
+  BVHBuildNode* children[2];
+
+  for (int i = 0; i < 2; ++i) {
+    if ((subsets[i] & (subsets[i] - 1)) == 0) {
+      children[i] = leaves[__builtin_ctz(subsets[i])];
+    } else {
+      children[i] = internals[nextInternal++];
+      rebuildTreelet(children[i], subsets[i], leaves, internals, nextInternal, partition, cost);
+    }
+  }
+
+  node->isLeaf = false;
+  node->left = children[0];
+  node->right = children[1];
+  node->leftBounds = buildNodeBounds(children[0]);
+  node->rightBounds = buildNodeBounds(children[1]);
+  node->cost = cost[set];
+}
+
+// Karras and Aila style restructuring: the treelet leaves with the largest area
+// are expanded until treeletSize leaves are found, then the topology over those
+// leaves with the lowest SAH cost is found by dynamic programming over subsets.
+static void optimizeTreelet(TreeletContext const& ctx, BVHBuildNode* root)
+{
+  BVHBuildNode* leaves[MAX_TREELET_LEAVES];
+  BVHBuildNode* internals[MAX_TREELET_LEAVES];
+  unsigned leafCount = 2;
+  unsigned internalCount = 0;
+
+  leaves[0] = root->left;
+  leaves[1] = root->right;
+
+  while (leafCount < ctx.treeletSize) {
+    int expand = -1;
+    float expandArea = -1.0f;
+    for (unsigned i = 0; i < leafCount; ++i) {
+      float area = surfaceArea(buildNodeBounds(leaves[i]));
+      if (!leaves[i]->isLeaf && area > expandArea) {
+        expand = i;
+        expandArea = area;
+      }
+    }
+
+    if (expand < 0)
+      break;
+
+    BVHBuildNode* node = leaves[expand];
+    internals[internalCount++] = node;
+    leaves[expand] = node->left;
+    leaves[leafCount++] = node->right;
+  }
+
+  if (leafCount < 3)
+    return;
+
+  unsigned setCount = 1u << leafCount;
+  float area[1 << MAX_TREELET_LEAVES];
+  float cost[1 << MAX_TREELET_LEAVES];
+  unsigned partition[1 << MAX_TREELET_LEAVES];
+
+  for (unsigned set = 1; set < setCount; ++set) {
+    AABB bounds = emptyAABB();
+    for (unsigned i = 0; i < leafCount; ++i)
+      if (set & (1u << i))
+        bounds = mergeAABB(bounds, buildNodeBounds(leaves[i]));
+    area[set] = surfaceArea(bounds);
+  }
+
+  // Proper subsets are numerically smaller, so ascending order sees them first
+  for (unsigned set = 1; set < setCount; ++set) {
+    if ((set & (set - 1)) == 0) {
+      cost[set] = leaves[__builtin_ctz(set)]->cost;
+      continue;
+    }
+
+    // Only partitions holding the lowest bit, the mirrored ones cost the same
+    unsigned lowest = set & (~set + 1);
+    float best = std::numeric_limits<float>::max();
+    for (unsigned part = (set - 1) & set; part; part = (part - 1) & set) {
+      if (!(part & lowest))
+        continue;
+
+      float c = cost[part] + cost[set ^ part];
+      if (c < best) {
+        best = c;
+        partition[set] = part;
+      }
+    }
+
+    cost[set] = ctx.options.traversalCost * area[set] + best;
+  }
+
+  unsigned fullSet = setCount - 1;
+  if (cost[fullSet] >= root->cost * 0.9999f)
+    return;
+
+  unsigned nextInternal = 0;
+  rebuildTreelet(root, fullSet, leaves, internals, nextInternal, partition, cost);
+}
+
+static void optimizeTreeletsPostOrder(TreeletContext const& ctx, BVHBuildNode* node, unsigned depth)
+{
+  if (node->isLeaf)
+    return;
+
+  // The top of the tree forks, children have to be optimized before their parent
+  if (ctx.pool && depth < 8) {
+    TaskGroup children(*ctx.pool);
+    BVHBuildNode* left = node->left;
+    children.run([&ctx, left, depth]() { optimizeTreeletsPostOrder(ctx, left, depth + 1); });
+    optimizeTreeletsPostOrder(ctx, node->right, depth + 1);
+    children.wait();
+  } else {
+    optimizeTreeletsPostOrder(ctx, node->left, depth + 1);
+    optimizeTreeletsPostOrder(ctx, node->right, depth + 1);
+  }
+
+  node->leftBounds = buildNodeBounds(node->left);
+  node->rightBounds = buildNodeBounds(node->right);
+  node->cost = ctx.options.traversalCost * surfaceArea(buildNodeBounds(node)) +
+    node->left->cost + node->right->cost;
+
+  optimizeTreelet(ctx, node);
+}
+
+void optimizeBVHTreelets(BVHBuildNode* root, std::vector<BVHTriangleRef> const& refList,
+  BVHBuildOptions const& options)
+{
+  refitBuildNode(root, refList, options);
+
+  TreeletContext ctx = {
+    options,
+    options.parallel ? &defaultThreadPool() : nullptr,
+    glm::clamp(options.treeletSize, 3u, MAX_TREELET_LEAVES)
+  };
+
+  for (unsigned round = 0; round < options.treeletRounds; ++round)
+    optimizeTreeletsPostOrder(ctx, root, 0);
+}
@@ -9,6 +9,12 @@
 #include <sstream>
 #include <cstring>
 #include <cstdlib>
+#include <chrono>
+#include <string>
+#include <iomanip>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
 
 /*
 #define GLFW_INCLUDE_VULKAN
@@ -25,6 +31,18 @@
 
 #include <image.hpp>
 #include <bvh.hpp>
+#include <camera.hpp>
+#include <traverse.hpp>
+#include <refit.hpp>
+#include <scene.hpp>
+#include <bvh_cache.hpp>
+#include <bvh_stats.hpp>
+#include <cpu_renderer.hpp>
+#include <simd.hpp>
+#include <ray_query.hpp>
+
+// compute_comp_spirv, generated by the shaders target
+#include <compute.comp.h>
 
 using namespace vrt;
 
@@ -56,33 +74,261 @@ public:
 	NonMovable& operator=(NonMovable&&) = delete;
 };
 
+// Where a buffer's memory lives, see MemoryManager::allocate
+enum MemoryUsage {
+	DEVICE_MEMORY = 0,  // Only the GPU touches it, filled through a StagingRing
+	UPLOAD_MEMORY = 1,  // Written by the host, read by the GPU
+	READBACK_MEMORY = 2 // Written by the GPU, read by the host, cached when the device has it
+};
+
+struct MemoryAllocation {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	uint32_t memoryType = 0;
+	uint32_t block = 0;
+	char* mapped = nullptr; // Start of the allocation, null unless host visible
+	bool coherent = true;
+};
+
+// Hands out ranges of large VkDeviceMemory blocks, one list of blocks per
+// memory type. Host visible blocks stay mapped for their whole life, since a
+// VkDeviceMemory can only be mapped once and many buffers share each block.
+class MemoryManager : public NonCopiable {
+public:
+	static constexpr VkDeviceSize BLOCK_SIZE = VkDeviceSize(64) << 20;
+
+	MemoryManager() = default;
+
+	~MemoryManager()
+	{
+		release();
+	}
+
+	// queueFamilies are the families that share buffers written by transfers
+	void init(VkDevice device, VkPhysicalDevice physDevice, std::vector<uint32_t> const& queueFamilies)
+	{
+		mDevice = device;
+		mQueueFamilies = queueFamilies;
+		vkGetPhysicalDeviceMemoryProperties(physDevice, &mProperties);
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physDevice, &properties);
+		mAtomSize = properties.limits.nonCoherentAtomSize;
+		mMaxStorageRange = properties.limits.maxStorageBufferRange;
+	}
+
+	VkDevice device() const { return mDevice; }
+	std::vector<uint32_t> const& queueFamilies() const { return mQueueFamilies; }
+	VkDeviceSize maxStorageRange() const { return mMaxStorageRange; }
+
+	MemoryAllocation allocate(VkMemoryRequirements const& requirements, MemoryUsage usage)
+	{
+		uint32_t type = memoryType(requirements.memoryTypeBits, usage);
+		std::vector<Block>& blocks = mBlocks[type];
+
+		MemoryAllocation allocation;
+		allocation.memoryType = type;
+		allocation.size = requirements.size;
+
+		uint32_t b = 0;
+		for (; b < blocks.size(); ++b)
+			if (takeRange(blocks[b], requirements.size, requirements.alignment, allocation.offset))
+				break;
+
+		// Larger requests get a block of their own
+		if (b == blocks.size()) {
+			blocks.push_back(createBlock(type, std::max(BLOCK_SIZE, requirements.size)));
+			takeRange(blocks[b], requirements.size, requirements.alignment, allocation.offset);
+		}
+
+		Block& block = blocks[b];
+		block.allocations++;
+		allocation.block = b;
+		allocation.memory = block.memory;
+		allocation.mapped = block.mapped ? block.mapped + allocation.offset : nullptr;
+		allocation.coherent = mProperties.memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+		return allocation;
+	}
+
+	// Blocks are kept when they empty, rebuilt scenes allocate the same sizes again
+	void free(MemoryAllocation const& allocation)
+	{
+		Block& block = mBlocks[allocation.memoryType][allocation.block];
+		block.allocations--;
+
+		// Sorted by offset, merged with the neighbours it touches
+		std::vector<Range>& ranges = block.freeRanges;
+		auto next = std::lower_bound(ranges.begin(), ranges.end(), allocation.offset,
+			[](Range const& r, VkDeviceSize offset) { return r.offset < offset; });
+		next = ranges.insert(next, {allocation.offset, allocation.size});
+
+		if (next + 1 != ranges.end() && next->offset + next->size == (next + 1)->offset) {
+			next->size += (next + 1)->size;
+			ranges.erase(next + 1);
+		}
+		if (next != ranges.begin() && (next - 1)->offset + (next - 1)->size == next->offset) {
+			(next - 1)->size += next->size;
+			ranges.erase(next);
+		}
+	}
+
+	// Non coherent memory needs these around host accesses, ranges are widened to nonCoherentAtomSize
+	void flush(MemoryAllocation const& allocation, VkDeviceSize offset, VkDeviceSize size)
+	{
+		if (allocation.coherent)
+			return;
+
+		VkMappedMemoryRange range = mappedRange(allocation, offset, size);
+		vkFlushMappedMemoryRanges(mDevice, 1, &range);
+	}
+
+	void invalidate(MemoryAllocation const& allocation, VkDeviceSize offset, VkDeviceSize size)
+	{
+		if (allocation.coherent)
+			return;
+
+		VkMappedMemoryRange range = mappedRange(allocation, offset, size);
+		vkInvalidateMappedMemoryRanges(mDevice, 1, &range);
+	}
+
+	void release()
+	{
+		for (auto& blocks : mBlocks) {
+			for (Block& block : blocks)
+				vkFreeMemory(mDevice, block.memory, nullptr);
+			blocks.clear();
+		}
+	}
+
+private:
+	struct Range {
+		VkDeviceSize offset;
+		VkDeviceSize size;
+	};
+
+	struct Block {
+		VkDeviceMemory memory;
+		VkDeviceSize size;
+		char* mapped;
+		std::vector<Range> freeRanges;
+		uint32_t allocations;
+	};
+
+	// First pass wants the preferred flags as well, the second only the required ones
+	uint32_t memoryType(uint32_t typeBits, MemoryUsage usage)
+	{
+		VkMemoryPropertyFlags required = 0, preferred = 0;
+		switch (usage) {
+		case DEVICE_MEMORY:
+			preferred = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+			break;
+		case UPLOAD_MEMORY:
+			required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+			break;
+		case READBACK_MEMORY:
+			required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+			preferred = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+			break;
+		}
+
+		for (VkMemoryPropertyFlags flags : {required | preferred, required})
+			for (uint32_t i = 0; i < mProperties.memoryTypeCount; ++i)
+				if ((typeBits & (1u << i)) && (mProperties.memoryTypes[i].propertyFlags & flags) == flags)
+					return i;
+
+		std::cerr << "No memory type for buffer usage " << usage << std::endl;
+		exit(-1);
+	}
+
+	Block createBlock(uint32_t type, VkDeviceSize size)
+	{
+		VkMemoryAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocInfo.memoryTypeIndex = type;
+		allocInfo.allocationSize = size;
+
+		Block block = {VK_NULL_HANDLE, size, nullptr, {{0, size}}, 0};
+		PANIC_BAD_RESULT(vkAllocateMemory(mDevice, &allocInfo, nullptr, &block.memory));
+
+		if (mProperties.memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+			PANIC_BAD_RESULT(vkMapMemory(mDevice, block.memory, 0, VK_WHOLE_SIZE, 0, (void**)&block.mapped));
+
+		return block;
+	}
+
+	// First fit
+	static bool takeRange(Block& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset)
+	{
+		std::vector<Range>& ranges = block.freeRanges;
+		for (size_t i = 0; i < ranges.size(); ++i) {
+			Range range = ranges[i];
+			VkDeviceSize begin = (range.offset + alignment - 1) / alignment * alignment;
+			if (begin + size > range.offset + range.size)
+				continue;
+
+			// What is left on either side stays free
+			ranges.erase(ranges.begin() + i);
+			if (begin + size < range.offset + range.size)
+				ranges.insert(ranges.begin() + i, {begin + size, range.offset + range.size - begin - size});
+			if (begin > range.offset)
+				ranges.insert(ranges.begin() + i, {range.offset, begin - range.offset});
+
+			offset = begin;
+			return true;
+		}
+
+		return false;
+	}
+
+	VkMappedMemoryRange mappedRange(MemoryAllocation const& allocation, VkDeviceSize offset, VkDeviceSize size)
+	{
+		Block const& block = mBlocks[allocation.memoryType][allocation.block];
+		VkDeviceSize begin = (allocation.offset + offset) / mAtomSize * mAtomSize;
+		VkDeviceSize end = std::min(block.size,
+			(allocation.offset + offset + size + mAtomSize - 1) / mAtomSize * mAtomSize);
+
+		VkMappedMemoryRange range = {};
+		range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+		range.memory = allocation.memory;
+		range.offset = begin;
+		range.size = end - begin;
+		return range;
+	}
+
+	VkDevice mDevice = VK_NULL_HANDLE;
+	VkPhysicalDeviceMemoryProperties mProperties;
+	VkDeviceSize mAtomSize = 1;
+	VkDeviceSize mMaxStorageRange = 0;
+	std::vector<uint32_t> mQueueFamilies;
+	std::vector<Block> mBlocks[VK_MAX_MEMORY_TYPES];
+};
+
 class Buffer : public NonCopiable //Restrict Vk objects creation/destruction
 {
 public:
 	//Make private const
 	VkBuffer mBuffer;
-	VkDeviceMemory mDeviceMemory;
-	uint32_t mBufferSize;
+	MemoryAllocation mAllocation;
+	VkDeviceSize mBufferSize;
 
 	//Init to null (probaly could be defaulted)
-	Buffer() : mBuffer(VK_NULL_HANDLE), mDeviceMemory(VK_NULL_HANDLE) {}
-	Buffer(VkDevice device, VkPhysicalDevice physDevice, uint32_t queueFamilyIndex, 
-		VkBufferUsageFlags usage, uint32_t bufferSize) 
+	Buffer() : mBuffer(VK_NULL_HANDLE), mMemory(nullptr) {}
+	Buffer(MemoryManager& memory, VkBufferUsageFlags usage, VkDeviceSize bufferSize,
+		MemoryUsage memoryUsage = UPLOAD_MEMORY)
 	{
-		init(device, physDevice, queueFamilyIndex, usage, bufferSize);
+		init(memory, usage, bufferSize, memoryUsage);
 	}
 
 	~Buffer()
 	{
-		if (mBuffer != VK_NULL_HANDLE) {
-			vkDestroyBuffer(mDevice, mBuffer, nullptr);
-			vkFreeMemory(mDevice, mDeviceMemory, nullptr);
-		}
+		release();
 	}
 
 	Buffer& operator=(Buffer&& rhs)
 	{
 		if (mBuffer != rhs.mBuffer) {
+			release();
 			std::memcpy(this, &rhs, sizeof(Buffer));
 			std::memset(&rhs, 0, sizeof(Buffer)); // Leave in a valid state
 		}
@@ -90,61 +336,270 @@ public:
 		return *this;
 	}
 
-	Buffer(Buffer&& in) 
+	// Starts out empty so the assignment has nothing to release
+	Buffer(Buffer&& in) : mBuffer(VK_NULL_HANDLE), mMemory(nullptr)
 	{
 		*this = std::move(in);
 	}
 
+	// Only for host visible memory. The mapping itself lasts as long as the
+	// buffer, map() makes GPU writes visible and unMap() makes host writes visible.
 	void map(VkDeviceSize offset, VkDeviceSize size, void** ptr)
 	{
-		PANIC_BAD_RESULT(vkMapMemory(mDevice, mDeviceMemory, offset, size, 0, ptr));
+		if (!mAllocation.mapped) {
+			std::cerr << "Mapped a buffer in device memory" << std::endl;
+			exit(-1);
+		}
+
+		mMapOffset = offset;
+		mMapSize = size == VK_WHOLE_SIZE ? mBufferSize - offset : size;
+		mMemory->invalidate(mAllocation, mMapOffset, mMapSize);
+		*ptr = mAllocation.mapped + offset;
 	}
 
 	void unMap()
 	{
-		vkUnmapMemory(mDevice, mDeviceMemory);
+		mMemory->flush(mAllocation, mMapOffset, mMapSize);
 	}
 
-	//Use Vk objects until other systems are done
-	void init(VkDevice device, VkPhysicalDevice physDevice, uint32_t queueFamilyIndex, 
-		VkBufferUsageFlags usage, uint32_t bufferSize)
+	// Buffers written by transfers are shared by every queue family of memory,
+	// so the staging copies need no ownership transfers
+	void init(MemoryManager& memory, VkBufferUsageFlags usage, VkDeviceSize bufferSize,
+		MemoryUsage memoryUsage = UPLOAD_MEMORY)
 	{
-		mDevice = device;
+		mMemory = &memory;
 		mBufferSize = bufferSize;
 
-		VkPhysicalDeviceMemoryProperties memoryProperties;
-		vkGetPhysicalDeviceMemoryProperties(physDevice, &memoryProperties);
+		if ((usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) && bufferSize > memory.maxStorageRange())
+			std::cerr << "Buffer of " << bufferSize << " bytes is larger than the device's storage buffer range "
+				<< memory.maxStorageRange() << std::endl;
+
+		std::vector<uint32_t> const& families = memory.queueFamilies();
+		bool shared = (usage & VK_BUFFER_USAGE_TRANSFER_DST_BIT) && families.size() > 1;
 
 		VkBufferCreateInfo bufferInfo = {};
 		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-		bufferInfo.queueFamilyIndexCount = 1;
-		bufferInfo.pQueueFamilyIndices = &queueFamilyIndex;
-		bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE; //TODO support for concurrent
+		bufferInfo.queueFamilyIndexCount = shared ? families.size() : 1;
+		bufferInfo.pQueueFamilyIndices = families.data();
+		bufferInfo.sharingMode = shared ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE;
 		bufferInfo.usage = usage;
 		bufferInfo.size = mBufferSize;	
 
-		PANIC_BAD_RESULT(vkCreateBuffer(device, &bufferInfo, nullptr, &mBuffer));
+		PANIC_BAD_RESULT(vkCreateBuffer(memory.device(), &bufferInfo, nullptr, &mBuffer));
 
-		// Use until memory manager is done
 		VkMemoryRequirements memoryRequirements;
-		vkGetBufferMemoryRequirements(device, mBuffer, &memoryRequirements);
+		vkGetBufferMemoryRequirements(memory.device(), mBuffer, &memoryRequirements);
+
+		mAllocation = memory.allocate(memoryRequirements, memoryUsage);
+		PANIC_BAD_RESULT(vkBindBufferMemory(memory.device(), mBuffer, mAllocation.memory, mAllocation.offset));
+	}
+private:
+	void release()
+	{
+		if (mBuffer != VK_NULL_HANDLE) {
+			vkDestroyBuffer(mMemory->device(), mBuffer, nullptr);
+			mMemory->free(mAllocation);
+			mBuffer = VK_NULL_HANDLE;
+		}
+	}
 
-		uint32_t memoryTypeIndex = 0;
-		for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i)
-			if (memoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT &&
-				memoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) 
-				memoryTypeIndex = i;
+	MemoryManager* mMemory;
+	VkDeviceSize mMapOffset;
+	VkDeviceSize mMapSize;
+};
 
-		VkMemoryAllocateInfo allocInfo = {};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.memoryTypeIndex = memoryTypeIndex;
-		allocInfo.allocationSize = memoryRequirements.size;
+// Ticks between two timestamps of a queue with validBits bits, they wrap around
+static uint64_t timestampTicks(uint64_t begin, uint64_t end, uint32_t validBits)
+{
+	uint64_t mask = validBits >= 64 ? ~uint64_t(0) : (uint64_t(1) << validBits) - 1;
+	return (end - begin) & mask;
+}
+
+// Uploads into device memory: data is copied into one segment of a host
+// visible ring and a transfer copies it on. A full segment is submitted right
+// away, so the host fills the next segment while the last one is copied.
+class StagingRing : public NonCopiable {
+public:
+	static constexpr uint32_t SEGMENT_COUNT = 4;
+	static constexpr VkDeviceSize SEGMENT_SIZE = VkDeviceSize(8) << 20;
+
+	StagingRing() = default;
+
+	~StagingRing()
+	{
+		if (mPool != VK_NULL_HANDLE) {
+			for (Segment& segment : mSegments)
+				vkDestroyFence(mDevice, segment.fence, nullptr);
+			vkDestroyCommandPool(mDevice, mPool, nullptr);
+		}
+		if (mTimestamps != VK_NULL_HANDLE)
+			vkDestroyQueryPool(mDevice, mTimestamps, nullptr);
+	}
+
+	// Every segment is timed when timestampBits is set, resetting the stamps
+	// needs a queue with compute or graphics
+	void init(MemoryManager& memory, VkQueue queue, uint32_t queueFamilyIndex, uint32_t timestampBits = 0,
+		float timestampPeriod = 0.0f)
+	{
+		mDevice = memory.device();
+		mQueue = queue;
+		mTimestampBits = timestampBits;
+		mTimestampPeriod = timestampPeriod;
+
+		if (timestampBits > 0) {
+			VkQueryPoolCreateInfo queryInfo = {};
+			queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+			queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+			queryInfo.queryCount = 2 * SEGMENT_COUNT;
+			vkCreateQueryPool(mDevice, &queryInfo, nullptr, &mTimestamps);
+		}
+
+		mBuffer = Buffer(memory, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, SEGMENT_SIZE * SEGMENT_COUNT, UPLOAD_MEMORY);
+
+		VkCommandPoolCreateInfo poolInfo = {};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.queueFamilyIndex = queueFamilyIndex;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+		vkCreateCommandPool(mDevice, &poolInfo, nullptr, &mPool);
+
+		VkCommandBufferAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandBufferCount = 1;
+		allocInfo.commandPool = mPool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+
+		VkFenceCreateInfo fenceInfo = {};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+		for (Segment& segment : mSegments) {
+			vkAllocateCommandBuffers(mDevice, &allocInfo, &segment.commandBuffer);
+			vkCreateFence(mDevice, &fenceInfo, nullptr, &segment.fence);
+			segment.submitted = false;
+		}
+	}
+
+	// Queues a copy of size bytes to offset of dst, which needs TRANSFER_DST usage.
+	// Nothing is guaranteed to have landed before flush().
+	void write(Buffer& dst, VkDeviceSize offset, void const* data, VkDeviceSize size)
+	{
+		while (size > 0) {
+			if (mHead == SEGMENT_SIZE)
+				submit();
+			if (!mRecording)
+				begin();
+
+			VkDeviceSize chunk = std::min(size, SEGMENT_SIZE - mHead);
+			VkDeviceSize staged = mCurrent * SEGMENT_SIZE + mHead;
+			std::memcpy(mBuffer.mAllocation.mapped + staged, data, chunk);
+
+			VkBufferCopy region = {staged, offset, chunk};
+			vkCmdCopyBuffer(mSegments[mCurrent].commandBuffer, mBuffer.mBuffer, dst.mBuffer, 1, &region);
+
+			mHead += chunk;
+			mBytes += chunk;
+			offset += chunk;
+			data = (char const*)data + chunk;
+			size -= chunk;
+		}
+	}
+
+	// Submits what is left and waits for every copy. Returns the bytes copied since the last flush.
+	VkDeviceSize flush()
+	{
+		if (mRecording)
+			submit();
+
+		for (Segment& segment : mSegments)
+			wait(segment);
 
-		PANIC_BAD_RESULT(vkAllocateMemory(device, &allocInfo, nullptr, &mDeviceMemory));
-		PANIC_BAD_RESULT(vkBindBufferMemory(device, mBuffer, mDeviceMemory, 0));
+		VkDeviceSize bytes = mBytes;
+		mTotalBytes += mBytes;
+		mBytes = 0;
+		return bytes;
 	}
+
+	bool timed() const { return mTimestamps != VK_NULL_HANDLE; }
+	// Bytes and GPU seconds of every copy finished so far, the time stays 0 when not timed()
+	VkDeviceSize totalBytes() const { return mTotalBytes; }
+	double gpuTime() const { return mGpuTime; }
+
 private:
-	VkDevice mDevice;
+	struct Segment {
+		VkCommandBuffer commandBuffer;
+		VkFence fence;
+		bool submitted;
+	};
+
+	void wait(Segment& segment)
+	{
+		if (!segment.submitted)
+			return;
+
+		vkWaitForFences(mDevice, 1, &segment.fence, VK_TRUE, 100000000000);
+		vkResetFences(mDevice, 1, &segment.fence);
+		segment.submitted = false;
+
+		if (timed()) {
+			uint64_t ticks[2];
+			vkGetQueryPoolResults(mDevice, mTimestamps, 2 * uint32_t(&segment - mSegments), 2, sizeof(ticks), ticks,
+				sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+			mGpuTime += timestampTicks(ticks[0], ticks[1], mTimestampBits) * mTimestampPeriod * 1e-9;
+		}
+	}
+
+	// The segment may still be copying from the last time around the ring
+	void begin()
+	{
+		Segment& segment = mSegments[mCurrent];
+		wait(segment);
+
+		VkCommandBufferBeginInfo beginInfo = {};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		vkBeginCommandBuffer(segment.commandBuffer, &beginInfo);
+
+		if (timed()) {
+			vkCmdResetQueryPool(segment.commandBuffer, mTimestamps, 2 * mCurrent, 2);
+			vkCmdWriteTimestamp(segment.commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, mTimestamps, 2 * mCurrent);
+		}
+
+		mRecording = true;
+		mHead = 0;
+	}
+
+	void submit()
+	{
+		Segment& segment = mSegments[mCurrent];
+		if (timed())
+			vkCmdWriteTimestamp(segment.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, mTimestamps, 2 * mCurrent + 1);
+		vkEndCommandBuffer(segment.commandBuffer);
+
+		VkSubmitInfo submitInfo = {};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.pCommandBuffers = &segment.commandBuffer;
+		submitInfo.commandBufferCount = 1;
+		vkQueueSubmit(mQueue, 1, &submitInfo, segment.fence);
+
+		segment.submitted = true;
+		mRecording = false;
+		mHead = 0;
+		mCurrent = (mCurrent + 1) % SEGMENT_COUNT;
+	}
+
+	VkDevice mDevice = VK_NULL_HANDLE;
+	VkQueue mQueue = VK_NULL_HANDLE;
+	VkCommandPool mPool = VK_NULL_HANDLE;
+	VkQueryPool mTimestamps = VK_NULL_HANDLE; // A begin and end stamp per segment
+	uint32_t mTimestampBits = 0;
+	float mTimestampPeriod = 0.0f; // Nanoseconds per tick
+	Buffer mBuffer;
+	Segment mSegments[SEGMENT_COUNT];
+	uint32_t mCurrent = 0;
+	VkDeviceSize mHead = 0;
+	VkDeviceSize mBytes = 0;
+	VkDeviceSize mTotalBytes = 0;
+	double mGpuTime = 0.0;
+	bool mRecording = false;
 };
 
 class DescriptorSet : public NonCopiable{
@@ -289,42 +744,402 @@ private:;
 	VkDevice mDevice;
 };
 
-constexpr glm::vec3 WORLD_UP = glm::vec3(0.0, 1.0, 0.0);
+constexpr uint32_t IMAGE_WIDTH = 800;
+constexpr uint32_t IMAGE_HEIGHT = 600;
+
+static Camera sceneCamera()
+{
+	Camera cam;
+	cam.lookAt(glm::vec3(1.5), glm::vec3(0.0, 0.1, 0.0));
+	return cam;
+}
+
+// The default view fits one unit sized mesh, scenes with more instances are framed as a whole
+static Camera sceneCamera(AABB const& bounds, size_t instanceCount)
+{
+	if (instanceCount <= 1)
+		return sceneCamera();
 
-struct Camera {
-	alignas(16) glm::vec3 mPos;
-	alignas(16) glm::vec3 mUp;
-	alignas(16) glm::vec3 mForward;
-	alignas(16) glm::vec3 mRight;
+	glm::vec3 center = centroid(bounds);
+	float radius = 0.5f * glm::length(bounds.max - bounds.min);
 
-	Camera() = default;
-	Camera(glm::vec3 const& pos,
-		glm::vec3 const& forward,
-		glm::vec3 const& up) :
-		mPos(pos),
-		mForward(forward),
-		mUp(up)
-	{
-		mRight = glm::cross(up, forward);
+	Camera cam;
+	cam.lookAt(center + glm::normalize(glm::vec3(1.0f)) * radius * 1.5f, center);
+	return cam;
+}
+
+// Lays copies of every instance out on a square grid in the xz plane, they
+// all share the meshes of the scene
+static void replicateScene(Scene& scene, unsigned copies)
+{
+	AABB bounds = sceneBounds(scene);
+	glm::vec3 extent = bounds.max - bounds.min;
+	float spacing = 1.2f * std::max(extent.x, extent.z);
+	unsigned side = (unsigned)std::ceil(std::sqrt((float)copies));
+
+	std::vector<MeshInstance> instances;
+	for (unsigned copy = 0; copy < copies; ++copy) {
+		glm::mat4 translation(1.0f);
+		translation[3] = glm::vec4(spacing * (copy % side), 0.0f, spacing * (copy / side), 1.0f);
+		for (auto const& instance : scene.instances)
+			instances.emplace_back(translation * instance.transform, instance.mesh);
 	}
 
-	void lookAt(glm::vec3 const& pos, glm::vec3 const& center)
-	{
-		mForward = glm::normalize(center - pos);
-		mPos = pos;
+	scene.instances = std::move(instances);
+}
+
+// Loads the scene both backends render and keeps its undeformed positions for animation
+static Scene loadAppScene(std::string const& meshPath, unsigned copies,
+	std::vector<std::vector<glm::vec3>>& restPositions)
+{
+	Scene scene = loadScene(meshPath).value();
+	if (copies > 1)
+		replicateScene(scene, copies);
+
+	restPositions.clear();
+	for (auto const& mesh : scene.meshes) {
+		restPositions.emplace_back();
+		for (auto const& vertex : mesh.vertex_data)
+			restPositions.back().push_back(vertex.pos);
+	}
+
+	return scene;
+}
+
+static std::vector<float> animationAmplitudes(TwoLevelBVH const& accel)
+{
+	std::vector<float> amplitudes;
+	for (auto const& bvh : accel.meshBVHs) {
+		AABB bounds = refListBounds(bvh.refList);
+		amplitudes.push_back(0.02f * glm::length(bounds.max - bounds.min));
+	}
+	return amplitudes;
+}
+
+// What one animation frame changed in the trees
+struct SceneRefit {
+	// Rebuilds and recollapses that change node counts move the offsets of later meshes
+	bool layoutChanged = false;
+	std::vector<std::vector<DirtyRange>> dirtyTriangles;
+	std::vector<std::vector<DirtyRange>> dirtyNodes;
+};
+
+// Wobbles the meshes along their normals, refits them and only rebuilds a mesh
+// once its refitted tree got too slow. The top level is rebuilt every frame.
+static SceneRefit animateScene(unsigned frame, Scene& scene, std::vector<std::vector<glm::vec3>> const& restPositions,
+	std::vector<float> const& amplitudes, TwoLevelBVH& accel, BVHBuildOptions const& options,
+	BVHNodeFormat nodeFormat, Arena& arena)
+{
+	float phase = frame * 0.3f;
+
+	SceneRefit result;
+	result.dirtyTriangles.resize(scene.meshes.size());
+	result.dirtyNodes.resize(scene.meshes.size());
+	std::chrono::duration<double, std::milli> refitTime(0);
+	float worstRatio = 0.0f;
+
+	for (uint32_t m = 0; m < scene.meshes.size(); ++m) {
+		Mesh& mesh = scene.meshes[m];
+		for (size_t i = 0; i < mesh.vertex_data.size(); ++i) {
+			Vertex& vertex = mesh.vertex_data[i];
+			float wave = std::sin(restPositions[m][i].y * 12.0f + phase);
+			vertex.pos = restPositions[m][i] + vertex.normal * (amplitudes[m] * wave);
+		}
+
+		auto refitStart = std::chrono::steady_clock::now();
+		BVHRefitResult refit = refitBVH(accel.meshBVHs[m], mesh.triangles, mesh.vertex_data, options,
+			accel.builtCosts[m]);
+		refitTime += std::chrono::steady_clock::now() - refitStart;
+		worstRatio = std::max(worstRatio, refit.costRatio);
+
+		if (refit.needsRebuild) {
+			std::cout << "Mesh " << m << " degraded past " << options.refitRebuildRatio
+				<< "x, rebuilding" << std::endl;
+			rebuildMeshBVH(accel, scene, m, options, arena);
+			result.layoutChanged = true;
+			continue;
+		}
+
+		result.dirtyTriangles[m] = std::move(refit.dirtyTriangles);
+		if (nodeFormat == BINARY_NODES) {
+			result.dirtyNodes[m] = std::move(refit.dirtyNodes);
+			continue;
+		}
+
+		// Wide nodes are collapsed again, their shape may follow the new bounds
+		TraversalBVH& tree = accel.meshTrees[m];
+		TraversalBVH refitted = makeTraversalBVH(accel.meshBVHs[m], nodeFormat, options.nodeLayout);
+		if (refitted.nodeCount() == tree.nodeCount())
+			result.dirtyNodes[m] = diffRanges(tree.nodeData(), refitted.nodeData(), tree.nodeCount(),
+				tree.nodeStride());
+		else
+			result.layoutChanged = true;
+		tree = std::move(refitted);
+	}
+
+	// Instance bounds follow their meshes
+	buildTopLevelBVH(accel, scene, options, arena);
+
+	std::cout << "Frame " << frame << ": refit " << scene.meshes.size() << " meshes in "
+		<< refitTime.count() << " ms, worst SAH cost ratio " << worstRatio << std::endl;
+
+	return result;
+}
+
+// QUERY_MODE in compute.comp
+enum QueryMode {
+	RENDER_QUERY = 0,
+	OCCLUSION_QUERY = 1,  // One invocation per segment of SEGMENT_BUFFER
+	CLOSEST_HIT_QUERY = 2, // Likewise, the hits go to HIT_BUFFER
+	// Stages of the wavefront path tracer, see recordWavefront()
+	WAVEFRONT_GENERATE = 3,
+	WAVEFRONT_EXTEND = 4,
+	WAVEFRONT_SHADE = 5,
+	WAVEFRONT_CONNECT = 6,
+	WAVEFRONT_RESOLVE = 7
+};
+
+// WAVEFRONT_CONSTANTS in compute.comp
+struct WavefrontConstants {
+	uint32_t bounce;
+	uint32_t bounceCount;
+};
+
+struct WavefrontOptions {
+	unsigned bounces = 0; // Path traces this many bounces instead of the BVH heatmap when set
+	uint32_t persistentGroups = 128; // Workgroups of the extend stage, each takes rays until none are left
+};
 
-		mRight = glm::cross(mForward, WORLD_UP);
-		mUp = glm::normalize(glm::cross(mForward, mRight));
-		mRight = glm::cross(mUp, mForward);
+// Resubmits the render, adding one jittered sample per pixel each time, until
+// either limit is reached. Off when both are 0.
+struct ProgressiveOptions {
+	unsigned samples = 0;
+	double timeBudget = 0.0; // Seconds
+	unsigned snapshotInterval = 0; // Saves the average so far every this many samples when set
+
+	bool enabled() const { return samples > 0 || timeBudget > 0.0; }
+};
+
+struct ProfileOptions {
+	bool counters = false;   // Compiles the work counters of the render walks in
+	std::string reportPath;  // JSON of the dispatch and upload times and the counters, "-" for stdout
+	std::string heatmapPath; // Nodes visited per pixel, needs the counters
+};
+
+// Specialization constants 3 to 7 of compute.comp. Only the render pipeline
+// uses anything but the defaults, apart from the stack every pipeline raises
+// for deep scenes.
+struct RenderTuning {
+	uint32_t groupW = 16;
+	uint32_t groupH = 16;
+	uint32_t stackSize = TRAVERSAL_STACK_SIZE;
+	uint32_t tileSwizzle = 0; // Workgroup columns per strip, 0 walks whole rows
+	uint32_t leafUnroll = 1;
+};
+
+struct TuningOptions {
+	bool autotune = false; // Times render pipeline variants on the scene and stores the fastest
+	std::string path = "render_tuning.txt";
+};
+
+static std::string tuningName(RenderTuning const& tuning)
+{
+	std::ostringstream name;
+	name << tuning.groupW << "x" << tuning.groupH << ", stack " << tuning.stackSize << ", swizzle "
+		<< tuning.tileSwizzle << ", unroll " << tuning.leafUnroll;
+	return name.str();
+}
+
+// Lines of the tuning file start with the vendor ID, device ID and driver version
+static bool isTuningOf(std::string const& line, VkPhysicalDeviceProperties const& device)
+{
+	std::istringstream fields(line);
+	uint32_t vendorID, deviceID, driverVersion;
+	return (fields >> vendorID >> deviceID >> driverVersion) && vendorID == device.vendorID &&
+		deviceID == device.deviceID && driverVersion == device.driverVersion;
+}
+
+static bool loadRenderTuning(std::string const& path, VkPhysicalDeviceProperties const& device,
+	RenderTuning& tuning)
+{
+	std::ifstream file(path);
+	std::string line;
+	while (std::getline(file, line)) {
+		if (!isTuningOf(line, device))
+			continue;
+
+		std::istringstream fields(line);
+		uint32_t id;
+		RenderTuning stored;
+		if (fields >> id >> id >> id >> stored.groupW >> stored.groupH >> stored.stackSize >> stored.tileSwizzle
+			>> stored.leafUnroll) {
+			tuning = stored;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Replaces the line of the device, the other devices keep theirs
+static bool saveRenderTuning(std::string const& path, VkPhysicalDeviceProperties const& device,
+	RenderTuning const& tuning)
+{
+	std::vector<std::string> lines;
+	std::ifstream in(path);
+	std::string line;
+	while (std::getline(in, line))
+		if (!line.empty() && !isTuningOf(line, device))
+			lines.push_back(line);
+	in.close();
+
+	std::ofstream out(path);
+	if (!out.is_open()) {
+		std::cerr << "Failed to write render tuning: " << path << std::endl;
+		return false;
 	}
+
+	for (auto const& other : lines)
+		out << other << "\n";
+	out << device.vendorID << " " << device.deviceID << " " << device.driverVersion << " " << tuning.groupW << " "
+		<< tuning.groupH << " " << tuning.stackSize << " " << tuning.tileSwizzle << " " << tuning.leafUnroll << "\n";
+	return true;
+}
+
+// In front of the vkGetPipelineCacheData blob on disk. Drivers check their own
+// header as well, but not every driver survives data from another build.
+struct PipelineCacheHeader {
+	char magic[8];
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	uint64_t dataSize;
+	uint64_t checksum; // hashBytes of the data
 };
 
+static PipelineCacheHeader pipelineCacheHeader(VkPhysicalDeviceProperties const& device)
+{
+	PipelineCacheHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, "VRTPIPE", 8);
+	header.vendorID = device.vendorID;
+	header.deviceID = device.deviceID;
+	header.driverVersion = device.driverVersion;
+	std::memcpy(header.pipelineCacheUUID, device.pipelineCacheUUID, VK_UUID_SIZE);
+	return header;
+}
+
+// Empty for a missing file or one written by another device or driver
+static std::vector<char> loadPipelineCache(std::string const& path, VkPhysicalDeviceProperties const& device)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		return {};
+
+	PipelineCacheHeader header;
+	PipelineCacheHeader expected = pipelineCacheHeader(device);
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+		header.vendorID != expected.vendorID || header.deviceID != expected.deviceID ||
+		header.driverVersion != expected.driverVersion ||
+		std::memcmp(header.pipelineCacheUUID, expected.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+		std::cout << "Pipeline cache " << path << " is for another device or driver, ignoring it" << std::endl;
+		return {};
+	}
+
+	std::vector<char> data(header.dataSize);
+	if (!file.read(data.data(), data.size()) || hashBytes(data.data(), data.size()) != header.checksum) {
+		std::cout << "Pipeline cache " << path << " is corrupt, ignoring it" << std::endl;
+		return {};
+	}
+
+	return data;
+}
+
+// Writes to a temporary file first and renames it, like writeBVHCache
+static bool savePipelineCache(std::string const& path, VkPhysicalDeviceProperties const& device,
+	std::vector<char> const& data)
+{
+	PipelineCacheHeader header = pipelineCacheHeader(device);
+	header.dataSize = data.size();
+	header.checksum = hashBytes(data.data(), data.size());
+
+	std::string tmpPath = path + ".tmp";
+	std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		std::cerr << "Failed to write pipeline cache: " << tmpPath << std::endl;
+		return false;
+	}
+
+	file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+	file.write(data.data(), data.size());
+	file.close();
+
+	if (!file || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+		std::cerr << "Failed to write pipeline cache: " << path << std::endl;
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// Levels of the tree, a lone leaf is 1
+static uint32_t bvhDepth(BVH const& bvh)
+{
+	if (bvh.nodeList.empty())
+		return 0;
+
+	std::vector<std::pair<uint32_t, uint32_t>> stack = {{0, 1}};
+	uint32_t depth = 0;
+	while (!stack.empty()) {
+		auto [index, level] = stack.back();
+		stack.pop_back();
+		depth = std::max(depth, level);
+
+		BVHNode const& node = bvh.nodeList[index];
+		if (node.isLeafBegin < 0) {
+			stack.push_back({index + 1, level + 1});
+			stack.push_back({uint32_t(node.rightOffsetEnd), level + 1});
+		}
+	}
+
+	return depth;
+}
+
+// Stack entries the render walks can need on this scene. A binary walk keeps at
+// most one entry per level, a wide one at most width - 1, and a wide tree is
+// never deeper than the binary tree it was collapsed from.
+static uint32_t renderStackBound(TwoLevelBVH const& accel)
+{
+	uint32_t bound = bvhDepth(accel.topLevel) + 1;
+	for (TraversalBVH const& tree : accel.meshTrees) {
+		uint32_t width = tree.format == BINARY_NODES ? 2 : tree.format == WIDE8_NODES ? 8 : 4;
+		bound = std::max(bound, (width - 1) * bvhDepth(*tree.bvh) + 1);
+	}
+	return bound;
+}
+
+// CAM_BUFFER in compute.comp, the camera and then the progressive frame index
+constexpr size_t CAMERA_UNIFORM_SIZE = sizeof(Camera) + 16;
+
+// PathState and ShadowRay in compute.comp, only the GPU reads them
+constexpr size_t PATH_STATE_SIZE = 80;
+constexpr size_t SHADOW_RAY_SIZE = 48;
+
 class ComputeApp {
 	VkInstance instance;
 
 	VkPhysicalDevice physDevice;
+	VkPhysicalDeviceProperties physDeviceProperties;
 	VkDevice device;
 	VkQueue queue;
+	VkQueue transferQueue; // The compute queue when the device has no transfer only family
+
+	// Declared before every buffer so it outlives them
+	MemoryManager memory;
+	StagingRing staging;
 
 	Buffer imageBuffer;
 	Buffer uniformBuffer;
@@ -332,9 +1147,31 @@ class ComputeApp {
 	// BVH buffers
 	// Buffer vertexBuffer; TODO
 	Buffer nodeBuffer;
-	Buffer refBuffer;
+	Buffer triangleBuffer;
+	Buffer topLevelNodeBuffer;
+	Buffer instanceBuffer;
 
-	Mesh mesh;
+	// Ray queries and their results, sized to the largest batch so far
+	Buffer segmentBuffer;
+	Buffer occlusionBuffer;
+	Buffer hitBuffer;
+
+	// Wavefront path state, one path per pixel. Just headers without --wavefront.
+	Buffer pathBuffer;
+	Buffer queueBuffer;
+	Buffer shadowBuffer;
+
+	// Float sum of every progressive sample, just the frame index header otherwise
+	Buffer accumulationBuffer;
+
+	// COUNTER_BUFFER, the totals and then 4 counters per pixel. Just the totals without counters.
+	Buffer counterBuffer;
+
+	Scene scene;
+	std::vector<std::vector<glm::vec3>> restPositions; // Undeformed positions of every mesh for animate()
+	Arena buildArena;
+
+	TwoLevelBVH accel;
 
 	DescriptorPool descriptorPool;
 	DescriptorSet descriptorSet;
@@ -342,16 +1179,59 @@ class ComputeApp {
 	Camera cam;
 
 	VkShaderModule shader;
+	VkPipelineCache pipelineCache;
+	std::string pipelineCachePath; // Empty to start cold every time
+	size_t pipelineCacheLoaded;    // Bytes of cache data read or last written, 0 for a cold start
 	VkPipeline pipeline;
+	VkPipeline occlusionPipeline;
+	VkPipeline closestHitPipeline;
+	VkPipeline wavefrontPipelines[5]; // WAVEFRONT_GENERATE to WAVEFRONT_RESOLVE
 	VkPipelineLayout pipelineLayout;
 
 	VkCommandPool commandPool;
 	VkCommandBuffer commandBuffer;
+	VkCommandBuffer queryCommandBuffer;
+
+	// Every submitted frame copies outData into the next of these, so the host
+	// reads and encodes a frame while the frames after it render
+	static constexpr uint32_t OUTPUT_FRAMES = 3;
+	Buffer outputBuffers[OUTPUT_FRAMES];
+	VkCommandPool outputCommandPool; // Never reset with commandPool, the copies are recorded once
+	VkCommandBuffer outputCommandBuffers[OUTPUT_FRAMES];
+	VkFence outputFences[OUTPUT_FRAMES];
+	bool outputEncoding[OUTPUT_FRAMES];
+	uint32_t submittedFrames;
+	uint32_t lastOutput; // Slot of the last submitted frame
+
+	// Stamps of a profiled commandBuffer and then a begin and end stamp of the
+	// last query dispatch. VK_NULL_HANDLE when the compute queue has no timestamps.
+	static constexpr uint32_t FRAME_TIMESTAMPS = 64;
+	VkQueryPool timestampPool;
+	uint32_t timestampBits;
+	bool recordTimestamps; // Frames in flight at once would share the stamps, so only while profiling
+	std::vector<std::string> timestampRegions; // Region i ends with stamp i + 1
+
+	std::mutex encodeMutex;
+	std::condition_variable encodeDone;
+	ThreadPool encoder; // One thread that writes the images, destroyed before the buffers it reads
 
 	VkDebugUtilsMessengerEXT debugMessenger;
 
 	bool useValidationLayers;
 	uint32_t queueFamilyIndex;
+	uint32_t transferFamilyIndex;
+
+	std::string meshPath;
+	unsigned copies;
+	std::string cachePath; // Empty without a BVH cache
+	BVHBuildOptions bvhOptions;
+	BVHNodeFormat nodeFormat;
+	WavefrontOptions wavefront;
+	ProgressiveOptions progressive;
+	TuningOptions tuningOptions;
+	RenderTuning renderTuning; // Of pipeline
+	uint32_t sceneStackBound; // renderStackBound of the scene, every pipeline's stack holds it
+	ProfileOptions profileOptions;
 
 	uint32_t imageW, imageH;
 
@@ -429,10 +1309,20 @@ class ComputeApp {
 
 	void createDeviceAndQueue()
 	{
-		// For now use the first result
+		// For now use the first result, VK_ICD_FILENAMES picks the driver
 		uint32_t physDeviceCount = 0;
 		vkEnumeratePhysicalDevices(instance, &physDeviceCount, nullptr);
-		vkEnumeratePhysicalDevices(instance, &physDeviceCount, &physDevice);
+		if (physDeviceCount == 0) {
+			std::cerr << "No Vulkan device found" << std::endl;
+			exit(-1);
+		}
+
+		std::vector<VkPhysicalDevice> physDevices(physDeviceCount);
+		vkEnumeratePhysicalDevices(instance, &physDeviceCount, physDevices.data());
+		physDevice = physDevices[0];
+
+		vkGetPhysicalDeviceProperties(physDevice, &physDeviceProperties);
+		std::cout << "Using " << physDeviceProperties.deviceName << std::endl;
 
 		uint32_t queueFamilyCount = 0;
 		vkGetPhysicalDeviceQueueFamilyProperties(physDevice, &queueFamilyCount, nullptr);
@@ -450,68 +1340,289 @@ class ComputeApp {
 			}
 		}
 
+		// Uploads prefer the copy engine of a transfer only family
+		transferFamilyIndex = queueFamilyIndex;
+		for (unsigned i = 0; i < deviceProperties.size(); ++i) {
+			VkQueueFlags flags = deviceProperties[i].queueFlags;
+			if (deviceProperties[i].queueCount > 0 && (flags & VK_QUEUE_TRANSFER_BIT) &&
+				!(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+				transferFamilyIndex = i;
+				break;
+			}
+		}
+
 		float queuePriority = 1.0f;
-		VkDeviceQueueCreateInfo deviceQueueInfo = {};
-		deviceQueueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-		deviceQueueInfo.queueFamilyIndex = queueFamilyIndex;
-		deviceQueueInfo.queueCount = 1;
-		deviceQueueInfo.pQueuePriorities = &queuePriority;
+		VkDeviceQueueCreateInfo deviceQueueInfos[2] = {};
+		for (int i = 0; i < 2; ++i) {
+			deviceQueueInfos[i].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+			deviceQueueInfos[i].queueFamilyIndex = i == 0 ? queueFamilyIndex : transferFamilyIndex;
+			deviceQueueInfos[i].queueCount = 1;
+			deviceQueueInfos[i].pQueuePriorities = &queuePriority;
+		}
 
 		VkDeviceCreateInfo deviceInfo = {};
 		deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-		deviceInfo.queueCreateInfoCount = 1;
-		deviceInfo.pQueueCreateInfos = &deviceQueueInfo;
+		deviceInfo.queueCreateInfoCount = transferFamilyIndex == queueFamilyIndex ? 1 : 2;
+		deviceInfo.pQueueCreateInfos = deviceQueueInfos;
 
 		vkCreateDevice(physDevice, &deviceInfo, nullptr, &device);
 		vkGetDeviceQueue(device, queueFamilyIndex, 0, &queue);
+		vkGetDeviceQueue(device, transferFamilyIndex, 0, &transferQueue);
+
+		std::vector<uint32_t> queueFamilies = {queueFamilyIndex};
+		if (transferFamilyIndex != queueFamilyIndex)
+			queueFamilies.push_back(transferFamilyIndex);
+
+		timestampBits = deviceProperties[queueFamilyIndex].timestampValidBits;
+
+		// A transfer only queue cannot reset its stamps
+		memory.init(device, physDevice, queueFamilies);
+		staging.init(memory, transferQueue, transferFamilyIndex,
+			transferFamilyIndex == queueFamilyIndex ? timestampBits : 0, physDeviceProperties.limits.timestampPeriod);
+	}
+
+	void buildScene()
+	{
+		auto buildStart = std::chrono::steady_clock::now();
+		accel = buildTwoLevelBVH(scene, bvhOptions, nodeFormat, buildArena);
+		sceneStackBound = renderStackBound(accel);
+		std::chrono::duration<double, std::milli> buildTime = std::chrono::steady_clock::now() - buildStart;
+
+		size_t refCount = 0, triangleCount = 0, binaryNodeCount = 0;
+		float worstCost = 0.0f;
+		for (size_t i = 0; i < scene.meshes.size(); ++i) {
+			refCount += accel.meshBVHs[i].refList.size();
+			binaryNodeCount += accel.meshBVHs[i].nodeList.size();
+			triangleCount += scene.meshes[i].triangles.size();
+			worstCost = std::max(worstCost, accel.builtCosts[i]);
+		}
+
+		size_t instancedTriangles = 0;
+		for (auto const& instance : scene.instances)
+			instancedTriangles += scene.meshes[instance.mesh].triangles.size();
+
+		ArenaStats arenaStats = buildArena.stats();
+		size_t refBytes = refCount * sizeof(BVHTriangleRef);
+		std::cout << "BVH built in " << buildTime.count() << " ms: "
+			<< binaryNodeCount << " nodes, "
+			<< refCount << " refs for " << triangleCount << " triangles in "
+			<< scene.meshes.size() << " meshes, worst SAH cost " << worstCost << std::endl;
+		std::cout << "Top level: " << accel.topLevel.nodeList.size() << " nodes over "
+			<< scene.instances.size() << " instances" << std::endl;
+		std::cout << "BVH build memory: peak " << (refBytes + arenaStats.peakBytesUsed) / 1024 << " KiB ("
+			<< refBytes / 1024 << " KiB refs, "
+			<< arenaStats.peakBytesUsed / 1024 << " KiB nodes), "
+			<< arenaStats.allocations << " node allocations, "
+			<< arenaStats.blockAllocations << " arena blocks" << std::endl;
+		std::cout << "Triangle buffer: " << accel.triangleCount * sizeof(BVHTriangle) / 1024
+			<< " KiB for " << instancedTriangles << " instanced triangles (flattened "
+			<< instancedTriangles * sizeof(BVHTriangle) / 1024 << " KiB), build refs stay on the CPU" << std::endl;
+
+		size_t nodeBytes = nodeStride() * accel.nodeCount;
+		if (nodeFormat == QUANTIZED4_NODES)
+			std::cout << "Quantized into " << accel.nodeCount << " 4-wide nodes, "
+				<< nodeBytes / 1024 << " KiB (full precision "
+				<< accel.nodeCount * sizeof(WideBVHNode<4>) / 1024 << " KiB)" << std::endl;
+		else if (nodeFormat != BINARY_NODES)
+			std::cout << "Collapsed into " << accel.nodeCount << " " << bvhOptions.width << "-wide nodes, "
+				<< nodeBytes / 1024 << " KiB (binary "
+				<< binaryNodeCount * sizeof(BVHNode) / 1024 << " KiB)" << std::endl;
+	}
+
+	// Every mesh uses the same node format
+	size_t nodeStride()
+	{
+		return accel.meshTrees.front().nodeStride();
+	}
+
+	size_t topLevelBytes()
+	{
+		return sizeof(BVHNode) * accel.topLevel.nodeList.size() + 16;
+	}
+
+	size_t instanceBytes()
+	{
+		return sizeof(BVHInstance) * accel.instanceList.size() + 16;
+	}
+
+	// Returns false if the scene no longer fits the buffers
+	bool sceneFitsBuffers()
+	{
+		return sizeof(BVHTriangle) * accel.triangleCount + 16 <= triangleBuffer.mBufferSize &&
+			nodeStride() * accel.nodeCount + 16 <= nodeBuffer.mBufferSize &&
+			topLevelBytes() <= topLevelNodeBuffer.mBufferSize &&
+			instanceBytes() <= instanceBuffer.mBufferSize;
+	}
+
+	// Only traversal reads these, so they live in device memory and get filled through staging
+	void createSceneBuffers()
+	{
+		VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+		triangleBuffer = Buffer(memory, usage, sizeof(BVHTriangle) * accel.triangleCount + 16, DEVICE_MEMORY);
+		nodeBuffer = Buffer(memory, usage, nodeStride() * accel.nodeCount + 16, DEVICE_MEMORY);
+		topLevelNodeBuffer = Buffer(memory, usage, topLevelBytes(), DEVICE_MEMORY);
+		instanceBuffer = Buffer(memory, usage, instanceBytes(), DEVICE_MEMORY);
+	}
+
+	// The 16 byte header of a scene buffer
+	void uploadCount(Buffer& buffer, uint32_t count)
+	{
+		staging.write(buffer, 0, &count, sizeof(count));
+	}
+
+	// A rebuilt or recollapsed tree can have more nodes, new buffers also need
+	// new descriptors and a new recording of the dispatch
+	void growSceneBuffers()
+	{
+		if (sceneFitsBuffers())
+			return;
+
+		vkQueueWaitIdle(queue);
+		createSceneBuffers();
+		descriptorSet.update(2, 0, 1, 0, VK_WHOLE_SIZE, triangleBuffer);
+		descriptorSet.update(3, 0, 1, 0, VK_WHOLE_SIZE, nodeBuffer);
+		descriptorSet.update(4, 0, 1, 0, VK_WHOLE_SIZE, topLevelNodeBuffer);
+		descriptorSet.update(5, 0, 1, 0, VK_WHOLE_SIZE, instanceBuffer);
+		vkResetCommandPool(device, commandPool, 0);
+		recordCommandBuffer();
+	}
+
+	// Small next to the meshes, always uploaded whole. Returns the bytes written.
+	// Like every upload it is only queued on staging until the next flush.
+	size_t uploadTopLevel()
+	{
+		uploadCount(topLevelNodeBuffer, accel.topLevel.nodeList.size());
+		staging.write(topLevelNodeBuffer, 16, accel.topLevel.nodeList.data(), topLevelBytes() - 16);
+
+		uploadCount(instanceBuffer, accel.instanceList.size());
+		staging.write(instanceBuffer, 16, accel.instanceList.data(), instanceBytes() - 16);
+
+		return topLevelBytes() + instanceBytes();
+	}
+
+	// Meshes go one after the other at their offsets in the shared buffers
+	void uploadScene()
+	{
+		uploadCount(triangleBuffer, accel.triangleCount);
+		for (size_t i = 0; i < accel.meshBVHs.size(); ++i) {
+			auto const& triangleList = accel.meshBVHs[i].triangleList;
+			staging.write(triangleBuffer, 16 + accel.triangleOffsets[i] * sizeof(BVHTriangle),
+				triangleList.data(), triangleList.size()*sizeof(BVHTriangle));
+		}
+
+		uploadCount(nodeBuffer, accel.nodeCount);
+		for (size_t i = 0; i < accel.meshTrees.size(); ++i) {
+			auto const& tree = accel.meshTrees[i];
+			staging.write(nodeBuffer, 16 + accel.nodeOffsets[i] * tree.nodeStride(),
+				tree.nodeData(), tree.nodeStride() * tree.nodeCount());
+		}
+
+		uploadTopLevel();
+		staging.flush();
+	}
+
+	// Copies only the given element ranges behind the 16 byte header, base is the
+	// element the ranges are relative to. Returns the bytes written.
+	size_t uploadRanges(Buffer& buffer, void const* elements, size_t stride,
+		std::vector<DirtyRange> const& ranges, size_t base = 0)
+	{
+		size_t bytes = 0;
+		for (auto const& range : ranges) {
+			size_t offset = range.begin * stride;
+			size_t size = (range.end - range.begin) * stride;
+			staging.write(buffer, 16 + base * stride + offset, (char const*)elements + offset, size);
+			bytes += size;
+		}
+
+		return bytes;
 	}
 
 	void createBuffers()
 	{
-		imageW = 800;
-		imageH = 600;
-		uint32_t bufferSize = sizeof(Pixel) * imageH * imageW;
+		imageW = IMAGE_WIDTH;
+		imageH = IMAGE_HEIGHT;
+		VkDeviceSize bufferSize = sizeof(Pixel) * imageH * imageW;
 		void* data;
 
-		mesh = loadMesh("suzanne.obj").value();
-		std::vector<BVHTriangleRef> refList = buildTriangleRefList(mesh.triangles, mesh.vertex_data);	
-		BVHBuildNode* buildNode = buildBVHNode(refList);
-		BVH bvh;
-		buildBVH(buildNode, bvh);
-
-		cam.lookAt(glm::vec3(1.5), glm::vec3(0.0, 0.1, 0.0));
+		// outData starts after the 16 byte header like every other array
+		imageBuffer.init(memory, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+			VK_BUFFER_USAGE_TRANSFER_DST_BIT, bufferSize + 16, DEVICE_MEMORY);
+		for (auto& outputBuffer : outputBuffers)
+			outputBuffer.init(memory, VK_BUFFER_USAGE_TRANSFER_DST_BIT, bufferSize, READBACK_MEMORY);
+		uniformBuffer.init(memory, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, CAMERA_UNIFORM_SIZE, UPLOAD_MEMORY);
+		createQueryBuffers(1);
+		createWavefrontBuffers(wavefront.bounces > 0 ? imageW * imageH : 0);
+		accumulationBuffer.init(memory, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			sizeof(glm::vec4) * std::max(progressive.enabled() ? imageW * imageH : 0u, 1u), DEVICE_MEMORY);
+		counterBuffer.init(memory, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			16 + 4 * sizeof(uint32_t) * std::max(profileOptions.counters ? imageW * imageH : 0u, 1u), READBACK_MEMORY);
+
+		uint64_t cacheKey = cachePath.empty() ? 0 : bvhCacheKey(meshPath, copies, bvhOptions, nodeFormat);
+		if (!cacheKey || !loadCachedScene(cacheKey)) {
+			scene = loadAppScene(meshPath, copies, restPositions);
+			buildScene();
+
+			AABB bounds = sceneBounds(scene);
+			cam = sceneCamera(bounds, scene.instances.size());
+
+			createSceneBuffers();
+			uploadScene();
+
+			if (cacheKey && writeBVHCache(cachePath, cacheKey, accel, bounds, sceneStackBound))
+				std::cout << "Wrote BVH cache " << cachePath << std::endl;
+		}
 
-		imageBuffer.init(device, physDevice, queueFamilyIndex, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, bufferSize);
-		uniformBuffer.init(device, physDevice, queueFamilyIndex, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, sizeof(Camera));
-		refBuffer.init(device, physDevice, queueFamilyIndex, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-			sizeof(BVHTriangleRef) * bvh.refList.size() + 16);
-		nodeBuffer.init(device, physDevice, queueFamilyIndex, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 
-			sizeof(BVHNode) * bvh.nodeList.size() + 16);
+		uint32_t imageSize[2] = {imageW, imageH};
+		staging.write(imageBuffer, 0, imageSize, sizeof(imageSize));
+		staging.flush();
 
-		imageBuffer.map(0, 32, &data);
-		*((uint32_t*)data  ) = imageW;
-		*((uint32_t*)data+1) = imageH;
-		imageBuffer.unMap();
+		setFrameIndex(0);
 
 		uniformBuffer.map(0, sizeof(Camera), &data);
 		*(Camera*)data = cam;
 		uniformBuffer.unMap();
+	}
+
+	// Copies every section of the mapped file straight into its mapped buffer,
+	// nothing is parsed or built. Leaves scene and accel empty.
+	bool loadCachedScene(uint64_t key)
+	{
+		auto loadStart = std::chrono::steady_clock::now();
+
+		MappedBVHCache cache;
+		if (!cache.open(cachePath, key, nodeFormat))
+			return false;
+
+		Buffer* buffers[CACHE_SECTION_COUNT] = {&triangleBuffer, &nodeBuffer, &topLevelNodeBuffer, &instanceBuffer};
+		size_t bytes = 0;
+		for (int i = 0; i < CACHE_SECTION_COUNT; ++i) {
+			BVHCacheSection section = (BVHCacheSection)i;
+			*buffers[i] = Buffer(memory, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+				cache.sectionSize(section) + 16, DEVICE_MEMORY);
+
+			uploadCount(*buffers[i], cache.count(section));
+			staging.write(*buffers[i], 16, cache.section(section), cache.sectionSize(section));
 
-		refBuffer.map(0, VK_WHOLE_SIZE, &data);
-		*((uint32_t*)data) = bvh.refList.size();
-		std::memcpy(((char*)data+16), bvh.refList.data(), bvh.refList.size()*sizeof(BVHTriangleRef));
-		refBuffer.unMap();
+			bytes += cache.sectionSize(section);
+		}
+		staging.flush();
+
+		cam = sceneCamera(cache.bounds(), cache.count(CACHE_INSTANCES));
+		sceneStackBound = cache.stackBound();
 
-		nodeBuffer.map(0, VK_WHOLE_SIZE, &data);
-		*((uint32_t*)data) = bvh.nodeList.size();
-		std::memcpy(((char*)data+16), bvh.nodeList.data(), bvh.nodeList.size()*sizeof(BVHNode));
-		nodeBuffer.unMap();
+		std::chrono::duration<double, std::milli> loadTime = std::chrono::steady_clock::now() - loadStart;
+		std::cout << "Loaded BVH cache " << cachePath << " in " << loadTime.count() << " ms: "
+			<< bytes / 1024 << " KiB, " << cache.count(CACHE_NODES) << " nodes, "
+			<< cache.count(CACHE_TRIANGLES) << " triangles, "
+			<< cache.count(CACHE_INSTANCES) << " instances" << std::endl;
+
+		return true;
 	}
 
 	void createDescriptors()
 	{
 		std::vector<VkDescriptorPoolSize> sizes;
-		sizes.push_back({VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3});
+		sizes.push_back({VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 13});
 		sizes.push_back({VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1});
 
 		descriptorPool = DescriptorPool(device, sizes);
@@ -521,60 +1632,182 @@ class ComputeApp {
 		bindings.push_back({1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
 		bindings.push_back({2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
 		bindings.push_back({3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
+		bindings.push_back({4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
+		bindings.push_back({5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
+		bindings.push_back({6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
+		bindings.push_back({7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
+		bindings.push_back({8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
+		bindings.push_back({9, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
+		bindings.push_back({10, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
+		bindings.push_back({11, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
+		bindings.push_back({12, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
+		bindings.push_back({13, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
 
 		descriptorSet = descriptorPool.createSet(bindings);
 
 		descriptorSet.update(0, 0, 1, 0, VK_WHOLE_SIZE, imageBuffer);
 		descriptorSet.update(1, 0, 1, 0, VK_WHOLE_SIZE, uniformBuffer);
-		descriptorSet.update(2, 0, 1, 0, VK_WHOLE_SIZE, refBuffer);
+		descriptorSet.update(2, 0, 1, 0, VK_WHOLE_SIZE, triangleBuffer);
 		descriptorSet.update(3, 0, 1, 0, VK_WHOLE_SIZE, nodeBuffer);
+		descriptorSet.update(4, 0, 1, 0, VK_WHOLE_SIZE, topLevelNodeBuffer);
+		descriptorSet.update(5, 0, 1, 0, VK_WHOLE_SIZE, instanceBuffer);
+		descriptorSet.update(6, 0, 1, 0, VK_WHOLE_SIZE, segmentBuffer);
+		descriptorSet.update(7, 0, 1, 0, VK_WHOLE_SIZE, occlusionBuffer);
+		descriptorSet.update(8, 0, 1, 0, VK_WHOLE_SIZE, hitBuffer);
+		descriptorSet.update(9, 0, 1, 0, VK_WHOLE_SIZE, pathBuffer);
+		descriptorSet.update(10, 0, 1, 0, VK_WHOLE_SIZE, queueBuffer);
+		descriptorSet.update(11, 0, 1, 0, VK_WHOLE_SIZE, shadowBuffer);
+		descriptorSet.update(12, 0, 1, 0, VK_WHOLE_SIZE, accumulationBuffer);
+		descriptorSet.update(13, 0, 1, 0, VK_WHOLE_SIZE, counterBuffer);
+	}
 
+	// Every buffer starts with the 16 byte header, capacity is in segments
+	void createQueryBuffers(size_t capacity)
+	{
+		segmentBuffer = Buffer(memory, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			sizeof(OcclusionSegment) * capacity + 16, UPLOAD_MEMORY);
+		occlusionBuffer = Buffer(memory, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			sizeof(uint32_t) * capacity + 16, READBACK_MEMORY);
+		hitBuffer = Buffer(memory, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			sizeof(RayQueryHit) * capacity + 16, READBACK_MEMORY);
 	}
 
-	void createShader()
+	// Two queues of pathCount entries after the 16 byte header, which
+	// recordWavefront() clears with vkCmdFillBuffer
+	void createWavefrontBuffers(size_t pathCount)
 	{
-		uint32_t codeSize;
-		std::vector<char> computeCode;
-		std::ifstream fs("shaders/compute.comp.spv", std::ios::binary | std::ios::ate);
+		pathBuffer = Buffer(memory, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			PATH_STATE_SIZE * std::max<size_t>(pathCount, 1), DEVICE_MEMORY);
+		queueBuffer = Buffer(memory, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			sizeof(uint32_t) * 2 * pathCount + 16, DEVICE_MEMORY);
+		shadowBuffer = Buffer(memory, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			SHADOW_RAY_SIZE * std::max<size_t>(pathCount, 1), DEVICE_MEMORY);
+	}
 
-		// This is just a complete mess
-		if (!fs.is_open()) {
-			std::cerr << "Failed to open shader file" << std::endl;
-		} else {
-			codeSize = fs.tellg();
-			fs.seekg(0);
-			computeCode.resize(codeSize);
-			fs.read(computeCode.data(), codeSize);
-		}
+	// frameIndex of CAM_BUFFER, the memory is host coherent and the queue
+	// submission makes the write visible to the next frame
+	void setFrameIndex(uint32_t frame)
+	{
+		void* data;
+		uniformBuffer.map(sizeof(Camera), sizeof(uint32_t), &data);
+		*((uint32_t*)data) = frame;
+		uniformBuffer.unMap();
+	}
 
+	void createShader()
+	{
 		VkShaderModuleCreateInfo shaderInfo = {};
 		shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-		shaderInfo.codeSize = codeSize;
-		shaderInfo.pCode = (const uint32_t*)computeCode.data();
+		shaderInfo.codeSize = sizeof(compute_comp_spirv);
+		shaderInfo.pCode = compute_comp_spirv;
 
 		vkCreateShaderModule(device, &shaderInfo, nullptr, &shader);
 	}
 
+	// Seeded from pipelineCachePath when it holds data of this device and driver
+	void createPipelineCache()
+	{
+		std::vector<char> data;
+		if (!pipelineCachePath.empty())
+			data = loadPipelineCache(pipelineCachePath, physDeviceProperties);
+		pipelineCacheLoaded = data.size();
+
+		VkPipelineCacheCreateInfo cacheInfo = {};
+		cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+		cacheInfo.initialDataSize = data.size();
+		cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+		vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache);
+	}
+
+	// Only when the pipelines built since createPipelineCache added anything
+	void storePipelineCache()
+	{
+		if (pipelineCachePath.empty())
+			return;
+
+		size_t size = 0;
+		vkGetPipelineCacheData(device, pipelineCache, &size, nullptr);
+		if (size == pipelineCacheLoaded)
+			return;
+
+		std::vector<char> data(size);
+		vkGetPipelineCacheData(device, pipelineCache, &size, data.data());
+		data.resize(size);
+
+		if (savePipelineCache(pipelineCachePath, physDeviceProperties, data))
+			pipelineCacheLoaded = size;
+	}
+
 	void createPipeline()
 	{
 		VkPipelineLayoutCreateInfo layoutInfo = {};
 		layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 		layoutInfo.setLayoutCount = 1;
 		layoutInfo.pSetLayouts = &descriptorSet.mLayout;
+
+		VkPushConstantRange pushConstants = {VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(WavefrontConstants)};
+		layoutInfo.pushConstantRangeCount = 1;
+		layoutInfo.pPushConstantRanges = &pushConstants;
+
 		vkCreatePipelineLayout(device, &layoutInfo, nullptr, &pipelineLayout);
 
+		createQueryPipelines();
+	}
+
+	void createQueryPipelines()
+	{
+		pipeline = createQueryPipeline(RENDER_QUERY, renderTuning);
+		occlusionPipeline = createQueryPipeline(OCCLUSION_QUERY, defaultTuning());
+		closestHitPipeline = createQueryPipeline(CLOSEST_HIT_QUERY, defaultTuning());
+
+		for (int i = 0; i < 5; ++i)
+			wavefrontPipelines[i] = wavefront.bounces > 0 ?
+				createQueryPipeline((QueryMode)(WAVEFRONT_GENERATE + i), defaultTuning()) : VK_NULL_HANDLE;
+	}
+
+	void destroyQueryPipelines()
+	{
+		vkDestroyPipeline(device, pipeline, nullptr);
+		vkDestroyPipeline(device, occlusionPipeline, nullptr);
+		vkDestroyPipeline(device, closestHitPipeline, nullptr);
+		for (VkPipeline wavefrontPipeline : wavefrontPipelines)
+			vkDestroyPipeline(device, wavefrontPipeline, nullptr);
+	}
+
+	// The same shader with QUERY_MODE set, both pipelines share the layout and descriptors
+	VkPipeline createQueryPipeline(QueryMode queryMode, RenderTuning const& tuning)
+	{
+		// NODE_FORMAT, QUERY_MODE, ACCUMULATE, RenderTuning and COUNTERS in
+		// compute.comp, a bool specialization constant is 4 bytes
+		int32_t specData[9] = {nodeFormat, queryMode, progressive.enabled() ? 1 : 0, int32_t(tuning.groupW),
+			int32_t(tuning.groupH), int32_t(tuning.stackSize), int32_t(tuning.tileSwizzle), int32_t(tuning.leafUnroll),
+			profileOptions.counters && queryMode == RENDER_QUERY ? 1 : 0};
+		VkSpecializationMapEntry specEntries[9];
+		for (uint32_t i = 0; i < 9; ++i)
+			specEntries[i] = {i, uint32_t(i * sizeof(int32_t)), sizeof(int32_t)};
+
+		VkSpecializationInfo specInfo = {};
+		specInfo.mapEntryCount = 9;
+		specInfo.pMapEntries = specEntries;
+		specInfo.dataSize = sizeof(specData);
+		specInfo.pData = specData;
+
 		VkPipelineShaderStageCreateInfo shaderStageInfo = {};
 		shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 		shaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
 		shaderStageInfo.pName = "main";
 		shaderStageInfo.module = shader;
+		shaderStageInfo.pSpecializationInfo = &specInfo;
 
 		VkComputePipelineCreateInfo computeInfo = {};
 		computeInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
 		computeInfo.stage = shaderStageInfo;
 		computeInfo.layout = pipelineLayout;
 
-		vkCreateComputePipelines(device, 0, 1, &computeInfo, nullptr, &pipeline);
+		VkPipeline queryPipeline;
+		vkCreateComputePipelines(device, pipelineCache, 1, &computeInfo, nullptr, &queryPipeline);
+		return queryPipeline;
 	}
 
 	void createCommandBuffer()
@@ -582,6 +1815,7 @@ class ComputeApp {
 		VkCommandPoolCreateInfo poolInfo = {};
 		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
 		poolInfo.queueFamilyIndex = queueFamilyIndex;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; // Query batches are recorded per call
 
 		vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool);
 
@@ -592,6 +1826,170 @@ class ComputeApp {
 		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
 
 		vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+		vkAllocateCommandBuffers(device, &allocInfo, &queryCommandBuffer);
+
+		poolInfo.flags = 0;
+		vkCreateCommandPool(device, &poolInfo, nullptr, &outputCommandPool);
+
+		allocInfo.commandBufferCount = OUTPUT_FRAMES;
+		allocInfo.commandPool = outputCommandPool;
+		vkAllocateCommandBuffers(device, &allocInfo, outputCommandBuffers);
+
+		// Signaled, a slot is free until its first frame
+		VkFenceCreateInfo fenceInfo = {};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+		for (uint32_t slot = 0; slot < OUTPUT_FRAMES; ++slot) {
+			vkCreateFence(device, &fenceInfo, nullptr, &outputFences[slot]);
+			outputEncoding[slot] = false;
+			recordOutputCommandBuffer(slot);
+		}
+
+		submittedFrames = 0;
+		lastOutput = 0;
+
+		if (timestampBits > 0) {
+			VkQueryPoolCreateInfo queryInfo = {};
+			queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+			queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+			queryInfo.queryCount = FRAME_TIMESTAMPS + 2;
+			vkCreateQueryPool(device, &queryInfo, nullptr, &timestampPool);
+		}
+	}
+
+	void beginTimestamps()
+	{
+		timestampRegions.clear();
+		if (!recordTimestamps || timestampPool == VK_NULL_HANDLE)
+			return;
+
+		vkCmdResetQueryPool(commandBuffer, timestampPool, 0, FRAME_TIMESTAMPS);
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampPool, 0);
+	}
+
+	// Ends region once everything recorded before it is done
+	void timestamp(std::string const& region)
+	{
+		if (!recordTimestamps || timestampPool == VK_NULL_HANDLE || timestampRegions.size() + 1 >= FRAME_TIMESTAMPS)
+			return;
+
+		timestampRegions.push_back(region);
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool,
+			timestampRegions.size());
+	}
+
+	// Seconds between each of count stamps from first and the next, waits for them
+	std::vector<double> timestampDurations(uint32_t first, uint32_t count)
+	{
+		std::vector<uint64_t> ticks(count);
+		vkGetQueryPoolResults(device, timestampPool, first, count, sizeof(uint64_t) * count, ticks.data(),
+			sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+
+		std::vector<double> durations;
+		for (uint32_t i = 1; i < count; ++i)
+			durations.push_back(timestampTicks(ticks[i - 1], ticks[i], timestampBits) *
+				physDeviceProperties.limits.timestampPeriod * 1e-9);
+		return durations;
+	}
+
+	// Submitted right after the render. Barriers apply in submission order, so
+	// the first waits for the render and the second keeps the next frame's
+	// render from writing outData or any other state before this copy is done.
+	void recordOutputCommandBuffer(uint32_t slot)
+	{
+		VkCommandBuffer output = outputCommandBuffers[slot];
+
+		VkCommandBufferBeginInfo beginInfo = {};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		vkBeginCommandBuffer(output, &beginInfo);
+
+		VkMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		vkCmdPipelineBarrier(output, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			1, &barrier, 0, nullptr, 0, nullptr);
+
+		VkBufferCopy region = {16, 0, sizeof(Pixel) * imageW * imageH};
+		vkCmdCopyBuffer(output, imageBuffer.mBuffer, outputBuffers[slot].mBuffer, 1, &region);
+
+		// The encoder thread reads the copy through the mapping after the fence
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		vkCmdPipelineBarrier(output, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+			1, &barrier, 0, nullptr, 0, nullptr);
+
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(output, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+		vkEndCommandBuffer(output);
+	}
+
+	void waitForEncoder(uint32_t slot)
+	{
+		std::unique_lock<std::mutex> lock(encodeMutex);
+		encodeDone.wait(lock, [&]() { return !outputEncoding[slot]; });
+	}
+
+	// Queues one frame and returns its output slot without waiting for it. A
+	// slot is reused once its last frame is done and written.
+	uint32_t submitFrame()
+	{
+		uint32_t slot = submittedFrames % OUTPUT_FRAMES;
+		waitForEncoder(slot);
+		vkWaitForFences(device, 1, &outputFences[slot], VK_TRUE, 100000000000);
+		vkResetFences(device, 1, &outputFences[slot]);
+
+		VkCommandBuffer commandBuffers[2] = {commandBuffer, outputCommandBuffers[slot]};
+
+		VkSubmitInfo submitInfo = {};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.pCommandBuffers = commandBuffers;
+		submitInfo.commandBufferCount = 2;
+		vkQueueSubmit(queue, 1, &submitInfo, outputFences[slot]);
+
+		submittedFrames++;
+		lastOutput = slot;
+		return slot;
+	}
+
+	void waitFrame(uint32_t slot)
+	{
+		vkWaitForFences(device, 1, &outputFences[slot], VK_TRUE, 100000000000);
+	}
+
+	// Writes the frame in slot to path on the encoder thread once it is done
+	void encodeFrame(uint32_t slot, std::string const& path)
+	{
+		{
+			std::lock_guard<std::mutex> lock(encodeMutex);
+			outputEncoding[slot] = true;
+		}
+
+		encoder.submit([this, slot, path]() {
+			waitFrame(slot);
+
+			Pixel* data;
+			outputBuffers[slot].map(0, VK_WHOLE_SIZE, (void**)(&data));
+			savePPMImage(imageW, imageH, data, path);
+			outputBuffers[slot].unMap();
+
+			{
+				std::lock_guard<std::mutex> lock(encodeMutex);
+				outputEncoding[slot] = false;
+			}
+			encodeDone.notify_all();
+		});
+	}
+
+	// Waits until every queued image is written
+	void finishFrames()
+	{
+		for (uint32_t slot = 0; slot < OUTPUT_FRAMES; ++slot)
+			waitForEncoder(slot);
 	}
 
 	void recordCommandBuffer()
@@ -605,43 +2003,148 @@ class ComputeApp {
 		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1,
 			&descriptorSet.mSet, 0, NULL);
 
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+		beginTimestamps();
+
+		if (wavefront.bounces > 0) {
+			recordWavefront();
+		} else {
+			// The frame before may still be counting
+			if (profileOptions.counters) {
+				stageBarrier();
+				vkCmdFillBuffer(commandBuffer, counterBuffer.mBuffer, 0, 16, 0);
+				stageBarrier();
+			}
 
-		vkCmdDispatch(commandBuffer, (uint32_t)std::ceil(imageW / 16.0f), 
-									(uint32_t)std::ceil(imageH / 16.0f), 1);
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+
+			vkCmdDispatch(commandBuffer, (imageW + renderTuning.groupW - 1) / renderTuning.groupW,
+				(imageH + renderTuning.groupH - 1) / renderTuning.groupH, 1);
+			timestamp("render");
+		}
 
 		vkEndCommandBuffer(commandBuffer);
 	}
 
-public:
-	ComputeApp(bool useValidationLayers) : 
-	useValidationLayers(useValidationLayers)
+	// Every stage reads what the one before wrote, including the queue counters
+	void stageBarrier()
 	{
+		VkMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+
+		VkPipelineStageFlags stages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+		vkCmdPipelineBarrier(commandBuffer, stages, stages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
 	}
 
-	void cleanUp()
+	void dispatchStage(QueryMode stage, uint32_t bounce, uint32_t groupsX, uint32_t groupsY)
 	{
-		vkDestroyCommandPool(device, commandPool, nullptr);
+		WavefrontConstants constants = {bounce, wavefront.bounces};
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, wavefrontPipelines[stage - WAVEFRONT_GENERATE]);
+		vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+		vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+
+		const char* names[5] = {"generate", "extend", "shade", "connect", "resolve"};
+		std::string region = names[stage - WAVEFRONT_GENERATE];
+		if (stage != WAVEFRONT_GENERATE && stage != WAVEFRONT_RESOLVE)
+			region += " " + std::to_string(bounce);
+		timestamp(region);
 	}
 
-	void init()
+	// Generate one path per pixel, then per bounce: extend finds the closest hit
+	// of every queued path, shade adds the sky or queues a shadow ray and the
+	// next bounce, connect traces the shadow rays. Queue sizes only exist on the
+	// GPU, so shade and connect cover every path and skip the entries past the
+	// count, while extend runs a fixed number of persistent workgroups.
+	void recordWavefront()
 	{
-		createInstance();
-		createDeviceAndQueue();
-		createBuffers();
-		createDescriptors();
-		createShader();
-		createPipeline();
-		createCommandBuffer();
+		uint32_t pathCount = imageW * imageH;
+		uint32_t pixelGroupsX = (uint32_t)std::ceil(imageW / 16.0f);
+		uint32_t pixelGroupsY = (uint32_t)std::ceil(imageH / 16.0f);
+
+		uint32_t groups = (pathCount + 255) / 256;
+		uint32_t groupsX = std::max(1u, std::min(groups, 65535u));
+		uint32_t groupsY = std::max(1u, (groups + groupsX - 1) / groupsX);
+
+		vkCmdFillBuffer(commandBuffer, queueBuffer.mBuffer, 0, 16, 0);
+		stageBarrier();
+		dispatchStage(WAVEFRONT_GENERATE, 0, pixelGroupsX, pixelGroupsY);
+
+		for (uint32_t bounce = 0; bounce < wavefront.bounces; ++bounce) {
+			// The queue shade appends to, shadowCount and extendHead
+			uint32_t next = 1 - (bounce & 1);
+			stageBarrier();
+			vkCmdFillBuffer(commandBuffer, queueBuffer.mBuffer, sizeof(uint32_t) * next, sizeof(uint32_t), 0);
+			vkCmdFillBuffer(commandBuffer, queueBuffer.mBuffer, 8, 8, 0);
+			stageBarrier();
+			dispatchStage(WAVEFRONT_EXTEND, bounce, std::max(1u, wavefront.persistentGroups), 1);
+			stageBarrier();
+			dispatchStage(WAVEFRONT_SHADE, bounce, groupsX, groupsY);
+			stageBarrier();
+			dispatchStage(WAVEFRONT_CONNECT, bounce, groupsX, groupsY);
+		}
 
-		recordCommandBuffer();
+		stageBarrier();
+		dispatchStage(WAVEFRONT_RESOLVE, 0, pixelGroupsX, pixelGroupsY);
 	}
 
-	void run()
+	// 256 segments per workgroup, wrapped into rows of at most 65535 groups
+	void recordQueryCommandBuffer(VkPipeline queryPipeline, size_t segmentCount)
+	{
+		uint32_t groups = (segmentCount + 255) / 256;
+		uint32_t groupsX = std::max(1u, std::min(groups, 65535u));
+		uint32_t groupsY = (groups + groupsX - 1) / groupsX;
+
+		VkCommandBufferBeginInfo beginInfo = {};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+		vkBeginCommandBuffer(queryCommandBuffer, &beginInfo);
+
+		vkCmdBindDescriptorSets(queryCommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1,
+			&descriptorSet.mSet, 0, NULL);
+
+		vkCmdBindPipeline(queryCommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, queryPipeline);
+
+		if (timestampPool != VK_NULL_HANDLE) {
+			vkCmdResetQueryPool(queryCommandBuffer, timestampPool, FRAME_TIMESTAMPS, 2);
+			vkCmdWriteTimestamp(queryCommandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampPool, FRAME_TIMESTAMPS);
+		}
+
+		vkCmdDispatch(queryCommandBuffer, groupsX, std::max(groupsY, 1u), 1);
+
+		if (timestampPool != VK_NULL_HANDLE)
+			vkCmdWriteTimestamp(queryCommandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool,
+				FRAME_TIMESTAMPS + 1);
+
+		vkEndCommandBuffer(queryCommandBuffer);
+	}
+
+	// Uploads the segments, runs one query pipeline over them and waits for it.
+	// Returns the seconds the dispatch took, or the queue without timestamps.
+	double runQuery(VkPipeline queryPipeline, std::vector<OcclusionSegment> const& segments)
 	{
+		if (sizeof(OcclusionSegment) * segments.size() + 16 > segmentBuffer.mBufferSize) {
+			vkQueueWaitIdle(queue);
+			createQueryBuffers(segments.size());
+			descriptorSet.update(6, 0, 1, 0, VK_WHOLE_SIZE, segmentBuffer);
+			descriptorSet.update(7, 0, 1, 0, VK_WHOLE_SIZE, occlusionBuffer);
+			descriptorSet.update(8, 0, 1, 0, VK_WHOLE_SIZE, hitBuffer);
+			vkResetCommandPool(device, commandPool, 0);
+			recordCommandBuffer();
+		}
+
+		void* data;
+		segmentBuffer.map(0, VK_WHOLE_SIZE, &data);
+		*((uint32_t*)data) = segments.size();
+		std::memcpy(((char*)data+16), segments.data(), sizeof(OcclusionSegment) * segments.size());
+		segmentBuffer.unMap();
+
+		recordQueryCommandBuffer(queryPipeline, segments.size());
+
 		VkSubmitInfo submitInfo = {};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-		submitInfo.pCommandBuffers = &commandBuffer;
+		submitInfo.pCommandBuffers = &queryCommandBuffer;
 		submitInfo.commandBufferCount = 1;
 
 		VkFenceCreateInfo fenceInfo = {};
@@ -650,44 +2153,1343 @@ public:
 		VkFence fence;
 		vkCreateFence(device, &fenceInfo, nullptr, &fence);
 
+		auto start = std::chrono::steady_clock::now();
+
 		vkQueueSubmit(queue, 1, &submitInfo, fence);
 
 		vkWaitForFences(device, 1, &fence, VK_TRUE, 100000000000);
 
+		std::chrono::duration<double> queryTime = std::chrono::steady_clock::now() - start;
+
 		vkDestroyFence(device, fence, nullptr);
+
+		if (timestampPool != VK_NULL_HANDLE)
+			return timestampDurations(FRAME_TIMESTAMPS, 2)[0];
+		return queryTime.count();
 	}
 
-	void saveResult()
+public:
+	ComputeApp(bool useValidationLayers, std::string const& meshPath, unsigned copies,
+		std::string const& cachePath, BVHBuildOptions const& bvhOptions,
+		WavefrontOptions const& wavefront = WavefrontOptions(),
+		ProgressiveOptions const& progressive = ProgressiveOptions(),
+		TuningOptions const& tuningOptions = TuningOptions(),
+		ProfileOptions const& profileOptions = ProfileOptions(),
+		std::string const& pipelineCachePath = "pipeline_cache.bin") : 
+	pipelineCachePath(pipelineCachePath),
+	pipelineCacheLoaded(0),
+	timestampPool(VK_NULL_HANDLE),
+	timestampBits(0),
+	recordTimestamps(false),
+	encoder(1),
+	useValidationLayers(useValidationLayers),
+	meshPath(meshPath),
+	copies(copies),
+	cachePath(cachePath),
+	bvhOptions(bvhOptions),
+	nodeFormat(nodeFormatForWidth(bvhOptions.width, bvhOptions.quantizeNodes)),
+	wavefront(wavefront),
+	progressive(progressive),
+	tuningOptions(tuningOptions),
+	sceneStackBound(TRAVERSAL_STACK_SIZE),
+	profileOptions(profileOptions)
 	{
-		Pixel* data;
+	}
+
+	void cleanUp()
+	{
+		finishFrames();
+		for (VkFence fence : outputFences)
+			vkDestroyFence(device, fence, nullptr);
 
-		vkMapMemory(device, imageBuffer.mDeviceMemory, 0, imageBuffer.mBufferSize, 0, (void**)(&data));
+		if (timestampPool != VK_NULL_HANDLE)
+			vkDestroyQueryPool(device, timestampPool, nullptr);
+		vkDestroyPipelineCache(device, pipelineCache, nullptr);
 
-		std::vector<Pixel> pixels(data, data + (imageW * imageH));
-		Image image(imageW, imageH, pixels);
+		vkDestroyCommandPool(device, outputCommandPool, nullptr);
+		vkDestroyCommandPool(device, commandPool, nullptr);
+	}
 
-		savePPMImage(image, "out.ppm");
+	void init()
+	{
+		auto start = std::chrono::steady_clock::now();
+		createInstance();
+		createDeviceAndQueue();
+		auto deviceReady = std::chrono::steady_clock::now();
+
+		createBuffers();
+		createDescriptors();
+		auto sceneReady = std::chrono::steady_clock::now();
+
+		createShader();
+		renderTuning = defaultTuning();
+		loadStoredTuning();
+		createPipelineCache();
+		createPipeline();
+		auto pipelinesReady = std::chrono::steady_clock::now();
 
-		vkUnmapMemory(device, imageBuffer.mDeviceMemory);
+		createCommandBuffer();
+		recordCommandBuffer();
+
+		std::chrono::duration<double, std::milli> deviceTime = deviceReady - start;
+		std::chrono::duration<double, std::milli> sceneTime = sceneReady - deviceReady;
+		std::chrono::duration<double, std::milli> pipelineTime = pipelinesReady - sceneReady;
+		std::chrono::duration<double, std::milli> startupTime = std::chrono::steady_clock::now() - start;
+		std::cout << "Started in " << startupTime.count() << " ms: device " << deviceTime.count() << " ms, scene "
+			<< sceneTime.count() << " ms, pipelines " << pipelineTime.count() << " ms "
+			<< (pipelineCacheLoaded > 0 ? "from a warm cache of " + std::to_string(pipelineCacheLoaded / 1024) + " KiB" :
+				std::string("cold")) << std::endl;
+
+		if (tuningOptions.autotune)
+			autotune();
+
+		storePipelineCache();
 	}
-};
 
-void traverse(BVHBuildNode* node)
-{
-	if (!node->isLeaf) {
-		traverse(node->left);
-		traverse(node->right);
-	} else {
-		std::cout << node->refList.size() << std::endl;
+	// The stack grows past TRAVERSAL_STACK_SIZE for scenes that need more
+	RenderTuning defaultTuning() const
+	{
+		RenderTuning tuning;
+		tuning.stackSize = std::max(TRAVERSAL_STACK_SIZE, sceneStackBound);
+		return tuning;
 	}
-}
 
-int main(int argc, char **argv)
-{
-	ComputeApp app(true);
-	app.init();
-	app.run();
-	app.saveResult();
+	bool tuningFits(RenderTuning const& tuning) const
+	{
+		VkPhysicalDeviceLimits const& limits = physDeviceProperties.limits;
+		return tuning.groupW > 0 && tuning.groupH > 0 && tuning.leafUnroll > 0 &&
+			tuning.groupW <= limits.maxComputeWorkGroupSize[0] && tuning.groupH <= limits.maxComputeWorkGroupSize[1] &&
+			tuning.groupW * tuning.groupH <= limits.maxComputeWorkGroupInvocations &&
+			tuning.stackSize >= sceneStackBound;
+	}
+
+	void loadStoredTuning()
+	{
+		RenderTuning stored;
+		if (!loadRenderTuning(tuningOptions.path, physDeviceProperties, stored))
+			return;
+
+		if (!tuningFits(stored)) {
+			std::cout << "Stored render tuning " << tuningName(stored) << " does not fit this scene, ignoring it" << std::endl;
+			return;
+		}
+
+		renderTuning = stored;
+		std::cout << "Using render tuning " << tuningName(renderTuning) << std::endl;
+	}
+
+	void useRenderTuning(RenderTuning const& tuning)
+	{
+		vkQueueWaitIdle(queue);
+		vkDestroyPipeline(device, pipeline, nullptr);
+
+		renderTuning = tuning;
+		pipeline = createQueryPipeline(RENDER_QUERY, renderTuning);
+
+		vkResetCommandPool(device, commandPool, 0);
+		recordCommandBuffer();
+	}
+
+	// Rebuilt meshes and top levels can be deeper, the pipelines are made
+	// again once their stacks no longer hold the scene
+	void growStackBound(uint32_t bound)
+	{
+		if (bound <= sceneStackBound)
+			return;
+
+		uint32_t defaultStack = defaultTuning().stackSize;
+		sceneStackBound = bound;
+		if (renderTuning.stackSize >= bound && defaultStack >= bound)
+			return;
+
+		std::cout << "Scene needs a stack of " << bound << " entries, recreating the pipelines" << std::endl;
+		vkQueueWaitIdle(queue);
+		destroyQueryPipelines();
+
+		renderTuning.stackSize = std::max(renderTuning.stackSize, bound);
+		createQueryPipelines();
+
+		vkResetCommandPool(device, commandPool, 0);
+		recordCommandBuffer();
+	}
+
+	// Fastest of a few renders with the current pipeline, in seconds
+	double timeRender(unsigned repeats)
+	{
+		double fastest = std::numeric_limits<double>::max();
+		for (unsigned i = 0; i < repeats; ++i) {
+			if (progressive.enabled())
+				setFrameIndex(0);
+
+			auto start = std::chrono::steady_clock::now();
+			waitFrame(submitFrame());
+			std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - start;
+			fastest = std::min(fastest, renderTime.count());
+		}
+		return fastest;
+	}
+
+	// Tunes one setting at a time, workgroup shape, tile swizzle, leaf unroll
+	// and then stack size, each step starting from the best of the ones
+	// before. A variant only counts when its image matches the default one.
+	void autotune()
+	{
+		constexpr unsigned repeats = 5;
+
+		RenderTuning best = defaultTuning();
+		useRenderTuning(best);
+		timeRender(1); // Warm up
+		double bestTime = timeRender(repeats);
+		std::vector<Pixel> reference = readPixels();
+		std::cout << "Autotune " << tuningName(best) << ": " << bestTime * 1000.0 << " ms" << std::endl;
+
+		auto tryTuning = [&](RenderTuning const& candidate) {
+			if (!tuningFits(candidate))
+				return;
+
+			useRenderTuning(candidate);
+			timeRender(1);
+			double time = timeRender(repeats);
+			bool matches = comparePixels(readPixels(), reference, 0.0f).differing == 0;
+
+			std::cout << "Autotune " << tuningName(candidate) << ": " << time * 1000.0 << " ms"
+				<< (matches ? "" : ", image differs") << std::endl;
+			if (matches && time < bestTime) {
+				best = candidate;
+				bestTime = time;
+			}
+		};
+
+		uint32_t const shapes[][2] = {{8, 8}, {16, 8}, {8, 16}, {32, 8}, {8, 32}, {64, 4}, {32, 16}, {32, 32}};
+		RenderTuning base = best;
+		for (auto const& shape : shapes) {
+			RenderTuning candidate = base;
+			candidate.groupW = shape[0];
+			candidate.groupH = shape[1];
+			tryTuning(candidate);
+		}
+
+		base = best;
+		for (uint32_t swizzle : {4u, 8u, 16u}) {
+			RenderTuning candidate = base;
+			candidate.tileSwizzle = swizzle;
+			tryTuning(candidate);
+		}
+
+		base = best;
+		for (uint32_t unroll : {2u, 4u}) {
+			RenderTuning candidate = base;
+			candidate.leafUnroll = unroll;
+			tryTuning(candidate);
+		}
+
+		// Smaller stacks, down to what the trees need
+		base = best;
+		uint32_t minStack = (sceneStackBound + 7) & ~7u;
+		if (minStack < base.stackSize) {
+			RenderTuning candidate = base;
+			candidate.stackSize = minStack;
+			tryTuning(candidate);
+		}
+
+		useRenderTuning(best);
+		std::cout << "Autotune picked " << tuningName(best) << ", " << bestTime * 1000.0 << " ms" << std::endl;
+		saveRenderTuning(tuningOptions.path, physDeviceProperties, best);
+	}
+
+	void run()
+	{
+		if (progressive.enabled()) {
+			runProgressive();
+			return;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+
+		waitFrame(submitFrame());
+
+		std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - start;
+		std::cout << "Rendered in " << renderTime.count() * 1000.0 << " ms, "
+			<< (imageW * imageH) / renderTime.count() / 1000000.0 << " Mrays/s" << std::endl;
+	}
+
+	// Submits the command buffer recorded in init() once per sample, only the
+	// frame index changes in between. Starts over at sample 0 on every call.
+	void runProgressive()
+	{
+		auto start = std::chrono::steady_clock::now();
+		std::chrono::duration<double> renderTime(0.0);
+
+		uint32_t samples = 0;
+		while ((progressive.samples == 0 || samples < progressive.samples) &&
+			(progressive.timeBudget <= 0.0 || renderTime.count() < progressive.timeBudget)) {
+			setFrameIndex(samples);
+
+			uint32_t slot = submitFrame();
+			waitFrame(slot);
+
+			samples++;
+			renderTime = std::chrono::steady_clock::now() - start;
+
+			// Written while the next samples render
+			if (progressive.snapshotInterval > 0 && samples % progressive.snapshotInterval == 0)
+				encodeFrame(slot, "snapshot_" + std::to_string(samples) + ".ppm");
+		}
+
+		std::cout << "Accumulated " << samples << " samples per pixel in " << renderTime.count() * 1000.0 << " ms, "
+			<< (double(imageW) * imageH * samples) / renderTime.count() / 1000000.0 << " Mrays/s" << std::endl;
+
+		finishFrames();
+	}
+
+	static std::string framePath(unsigned frame)
+	{
+		std::ostringstream path;
+		path << "frame_" << std::setw(4) << std::setfill('0') << frame << ".ppm";
+		return path.str();
+	}
+
+	// Uploads just what the refits changed, the top level is uploaded whole every frame.
+	// With saveFrames every frame is written to framePath(frame), and the refit of
+	// a frame runs while the last one renders and the one before it is written.
+	void animate(unsigned frames, bool saveFrames = false)
+	{
+		std::vector<float> amplitudes = animationAmplitudes(accel);
+		auto start = std::chrono::steady_clock::now();
+
+		for (unsigned frame = 1; frame <= frames; ++frame) {
+			SceneRefit refit = animateScene(frame, scene, restPositions, amplitudes, accel, bvhOptions,
+				nodeFormat, buildArena);
+
+			// The last frame still reads the scene buffers
+			waitFrame(lastOutput);
+			growStackBound(renderStackBound(accel));
+			double uploadStart = staging.gpuTime();
+
+			size_t totalBytes = triangleBuffer.mBufferSize + nodeBuffer.mBufferSize +
+				topLevelNodeBuffer.mBufferSize + instanceBuffer.mBufferSize;
+			size_t bytes;
+			if (refit.layoutChanged) {
+				growSceneBuffers();
+				uploadScene();
+				bytes = totalBytes;
+			} else {
+				bytes = uploadTopLevel();
+				for (size_t m = 0; m < scene.meshes.size(); ++m) {
+					bytes += uploadRanges(triangleBuffer, accel.meshBVHs[m].triangleList.data(), sizeof(BVHTriangle),
+						refit.dirtyTriangles[m], accel.triangleOffsets[m]);
+					bytes += uploadRanges(nodeBuffer, accel.meshTrees[m].nodeData(), nodeStride(),
+						refit.dirtyNodes[m], accel.nodeOffsets[m]);
+				}
+				staging.flush();
+			}
+
+			std::cout << "Uploaded " << bytes / 1024 << " KiB of " << totalBytes / 1024 << " KiB";
+			if (staging.timed())
+				std::cout << " in " << (staging.gpuTime() - uploadStart) * 1000.0 << " ms";
+			std::cout << std::endl;
+
+			if (saveFrames)
+				encodeFrame(submitFrame(), framePath(frame));
+			else
+				run();
+		}
+
+		if (saveFrames && frames > 0) {
+			finishFrames();
+			std::chrono::duration<double> animateTime = std::chrono::steady_clock::now() - start;
+			std::cout << "Animated and wrote " << frames << " frames in " << animateTime.count() * 1000.0 << " ms, "
+				<< frames / animateTime.count() << " frames/s" << std::endl;
+		}
+	}
+
+	// Renders and writes the same frame count twice, first waiting for every
+	// frame and writing it on this thread like run() and saveResult(), then
+	// through the output slots and the encoder thread
+	void benchmarkOutput(unsigned frames)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned frame = 0; frame < frames; ++frame) {
+			waitFrame(submitFrame());
+			saveResult(framePath(frame));
+		}
+		std::chrono::duration<double> serialTime = std::chrono::steady_clock::now() - start;
+
+		start = std::chrono::steady_clock::now();
+		for (unsigned frame = 0; frame < frames; ++frame)
+			encodeFrame(submitFrame(), framePath(frame));
+		finishFrames();
+		std::chrono::duration<double> pipelinedTime = std::chrono::steady_clock::now() - start;
+
+		std::cout << "Serial output: " << frames << " frames in " << serialTime.count() * 1000.0 << " ms, "
+			<< frames / serialTime.count() << " frames/s" << std::endl;
+		std::cout << "Pipelined output: " << frames << " frames in " << pipelinedTime.count() * 1000.0 << " ms, "
+			<< frames / pipelinedTime.count() << " frames/s, " << serialTime.count() / pipelinedTime.count()
+			<< "x" << std::endl;
+	}
+
+	// Any-hit queries against the scene on the GPU, one flag per segment like
+	// the CPU traceOcclusion
+	std::vector<uint8_t> traceOcclusion(std::vector<OcclusionSegment> const& segments)
+	{
+		double seconds = runQuery(occlusionPipeline, segments);
+		std::cout << "GPU occlusion: " << segments.size() << " segments in " << seconds * 1000.0 << " ms, "
+			<< segments.size() / seconds / 1000000.0 << " Msegments/s" << std::endl;
+
+		void* data;
+		std::vector<uint8_t> occludedFlags(segments.size());
+		occlusionBuffer.map(0, VK_WHOLE_SIZE, &data);
+		uint32_t const* flags = (uint32_t const*)((char*)data + 16);
+		for (size_t i = 0; i < segments.size(); ++i)
+			occludedFlags[i] = flags[i];
+		occlusionBuffer.unMap();
+
+		return occludedFlags;
+	}
+
+	// Closest hit of every ray on the GPU, like the CPU traceRays
+	std::vector<RayQueryHit> traceClosestHits(std::vector<Ray> const& rays)
+	{
+		std::vector<OcclusionSegment> segments;
+		segments.reserve(rays.size());
+		for (auto const& r : rays)
+			segments.push_back({r.o, 0.0f, r.d, std::numeric_limits<float>::max()});
+
+		double seconds = runQuery(closestHitPipeline, segments);
+		std::cout << "GPU closest hit: " << rays.size() << " rays in " << seconds * 1000.0 << " ms, "
+			<< rays.size() / seconds / 1000000.0 << " Mrays/s" << std::endl;
+
+		void* data;
+		std::vector<RayQueryHit> hits(rays.size());
+		hitBuffer.map(0, VK_WHOLE_SIZE, &data);
+		std::memcpy(hits.data(), ((char*)data+16), sizeof(RayQueryHit) * hits.size());
+		hitBuffer.unMap();
+
+		return hits;
+	}
+
+	// Empty for a scene loaded from the BVH cache
+	TwoLevelBVH const& sceneBVH() const
+	{
+		return accel;
+	}
+
+	Camera const& camera() const
+	{
+		return cam;
+	}
+
+	std::vector<Pixel> readPixels()
+	{
+		// Reading while the encoder reads the same slot is fine, but map() is not thread safe
+		waitForEncoder(lastOutput);
+		waitFrame(lastOutput);
+
+		Pixel* data;
+		outputBuffers[lastOutput].map(0, VK_WHOLE_SIZE, (void**)(&data));
+		std::vector<Pixel> pixels(data, data + (imageW * imageH));
+		outputBuffers[lastOutput].unMap();
+
+		return pixels;
+	}
+
+	void saveResult(std::string const& path = "out.ppm")
+	{
+		Image image(imageW, imageH, readPixels());
+		savePPMImage(image, path);
+	}
+
+	// COUNTER_BUFFER of the last frame: the 4 totals, then 4 counters per pixel
+	std::vector<uint32_t> readCounters()
+	{
+		vkQueueWaitIdle(queue);
+
+		uint32_t* data;
+		counterBuffer.map(0, VK_WHOLE_SIZE, (void**)(&data));
+		std::vector<uint32_t> counters(data, data + 4 + 4 * imageW * imageH);
+		counterBuffer.unMap();
+
+		return counters;
+	}
+
+	// Renders one frame with a stamp after every dispatch and writes those,
+	// the uploads so far and the frame's counters to the report
+	void profile()
+	{
+		finishFrames();
+		vkQueueWaitIdle(queue);
+
+		recordTimestamps = true;
+		vkResetCommandPool(device, commandPool, 0);
+		recordCommandBuffer();
+
+		if (progressive.enabled())
+			setFrameIndex(0);
+
+		auto start = std::chrono::steady_clock::now();
+		waitFrame(submitFrame());
+		std::chrono::duration<double> frameTime = std::chrono::steady_clock::now() - start;
+
+		std::vector<double> regionTimes;
+		if (timestampPool != VK_NULL_HANDLE)
+			regionTimes = timestampDurations(0, timestampRegions.size() + 1);
+		else
+			std::cout << "The compute queue has no timestamps, the report only has wall clock times" << std::endl;
+
+		recordTimestamps = false;
+		vkResetCommandPool(device, commandPool, 0);
+		recordCommandBuffer();
+
+		if (profileOptions.reportPath == "-") {
+			writeProfile(std::cout, frameTime.count(), regionTimes);
+			return;
+		}
+
+		std::ofstream file(profileOptions.reportPath);
+		if (!file.is_open()) {
+			std::cerr << "Failed to write profile: " << profileOptions.reportPath << std::endl;
+			return;
+		}
+		writeProfile(file, frameTime.count(), regionTimes);
+	}
+
+	void writeProfile(std::ostream& out, double frameSeconds, std::vector<double> const& regionTimes)
+	{
+		out << "{\n"
+			<< "  \"device\": \"" << physDeviceProperties.deviceName << "\",\n"
+			<< "  \"frame\": {\"wallMs\": " << frameSeconds * 1000.0 << ", \"regions\": [";
+		for (size_t i = 0; i < regionTimes.size(); ++i)
+			out << (i > 0 ? ", " : "") << "{\"name\": \"" << timestampRegions[i] << "\", \"gpuMs\": "
+				<< regionTimes[i] * 1000.0 << "}";
+		out << "]},\n"
+			<< "  \"upload\": {\"bytes\": " << staging.totalBytes() << ", \"gpuMs\": ";
+		if (staging.timed())
+			out << staging.gpuTime() * 1000.0;
+		else
+			out << "null";
+		out << "},\n"
+			<< "  \"counters\": ";
+
+		if (!profileOptions.counters) {
+			out << "null\n}" << std::endl;
+			return;
+		}
+
+		std::vector<uint32_t> counters = readCounters();
+		uint32_t rays = std::max(counters[3], 1u);
+		uint32_t maxNodes = 0, maxTriangles = 0;
+		uint64_t stackDepths = 0;
+		for (size_t i = 4; i < counters.size(); i += 4) {
+			maxNodes = std::max(maxNodes, counters[i]);
+			maxTriangles = std::max(maxTriangles, counters[i + 1]);
+			stackDepths += counters[i + 2];
+		}
+
+		out << "{\"rays\": " << counters[3]
+			<< ", \"nodesVisited\": " << counters[0]
+			<< ", \"trianglesTested\": " << counters[1]
+			<< ", \"meanNodesVisited\": " << double(counters[0]) / rays
+			<< ", \"meanTrianglesTested\": " << double(counters[1]) / rays
+			<< ", \"meanStackDepth\": " << double(stackDepths) / rays
+			<< ", \"maxNodesVisited\": " << maxNodes
+			<< ", \"maxTrianglesTested\": " << maxTriangles
+			<< ", \"maxStackDepth\": " << counters[2] << "}\n"
+			<< "}" << std::endl;
+	}
+
+	// Nodes visited per pixel from blue to red, scaled so the 99th percentile
+	// is red and a few very expensive pixels do not wash out the rest
+	void saveHeatmap(std::string const& path)
+	{
+		std::vector<uint32_t> counters = readCounters();
+
+		std::vector<uint32_t> nodes(imageW * imageH);
+		for (size_t i = 0; i < nodes.size(); ++i)
+			nodes[i] = counters[4 + 4 * i];
+
+		std::vector<uint32_t> sorted = nodes;
+		std::nth_element(sorted.begin(), sorted.begin() + sorted.size() * 99 / 100, sorted.end());
+		float scale = 1.0f / std::max(sorted[sorted.size() * 99 / 100], 1u);
+
+		std::vector<Pixel> pixels(nodes.size());
+		for (size_t i = 0; i < nodes.size(); ++i) {
+			float t = std::min(nodes[i] * scale, 1.0f);
+			pixels[i] = Pixel(std::clamp(std::min(4.0f * t - 1.5f, 4.5f - 4.0f * t), 0.0f, 1.0f),
+				std::clamp(std::min(4.0f * t - 0.5f, 3.5f - 4.0f * t), 0.0f, 1.0f),
+				std::clamp(std::min(4.0f * t + 0.5f, 2.5f - 4.0f * t), 0.0f, 1.0f), 1.0f);
+		}
+
+		savePPMImage(imageW, imageH, pixels.data(), path);
+	}
+};
+
+// Renders on the thread pool instead of a Vulkan queue. Same scene, trees and
+// camera as ComputeApp, and the same pixels compute.comp writes.
+class CpuApp {
+	Scene scene;
+	std::vector<std::vector<glm::vec3>> restPositions; // Undeformed positions of every mesh for animate()
+	Arena buildArena;
+
+	TwoLevelBVH accel;
+	Camera cam;
+	std::vector<Pixel> pixels;
+
+	std::string meshPath;
+	unsigned copies;
+	BVHBuildOptions bvhOptions;
+	BVHNodeFormat nodeFormat;
+
+	uint32_t imageW, imageH;
+
+public:
+	CpuApp(std::string const& meshPath, unsigned copies, BVHBuildOptions const& bvhOptions) :
+	meshPath(meshPath),
+	copies(copies),
+	bvhOptions(bvhOptions),
+	nodeFormat(nodeFormatForWidth(bvhOptions.width, bvhOptions.quantizeNodes)),
+	imageW(IMAGE_WIDTH),
+	imageH(IMAGE_HEIGHT)
+	{
+	}
+
+	void init()
+	{
+		scene = loadAppScene(meshPath, copies, restPositions);
+
+		auto buildStart = std::chrono::steady_clock::now();
+		accel = buildTwoLevelBVH(scene, bvhOptions, nodeFormat, buildArena);
+		std::chrono::duration<double, std::milli> buildTime = std::chrono::steady_clock::now() - buildStart;
+		std::cout << "BVH built in " << buildTime.count() << " ms: " << accel.nodeCount << " "
+			<< nodeFormatName(nodeFormat) << " nodes over " << scene.instances.size() << " instances" << std::endl;
+
+		cam = sceneCamera(sceneBounds(scene), scene.instances.size());
+		pixels.resize(imageW * imageH);
+	}
+
+	void run()
+	{
+		auto start = std::chrono::steady_clock::now();
+		renderCPU(accel, cam, imageW, imageH, pixels.data());
+
+		std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - start;
+		std::cout << "Rendered on " << defaultThreadPool().size() << " CPU threads in "
+			<< renderTime.count() * 1000.0 << " ms, "
+			<< (imageW * imageH) / renderTime.count() / 1000000.0 << " Mrays/s" << std::endl;
+	}
+
+	void animate(unsigned frames)
+	{
+		std::vector<float> amplitudes = animationAmplitudes(accel);
+
+		for (unsigned frame = 1; frame <= frames; ++frame) {
+			animateScene(frame, scene, restPositions, amplitudes, accel, bvhOptions, nodeFormat, buildArena);
+			run();
+		}
+	}
+
+	TwoLevelBVH const& sceneBVH() const
+	{
+		return accel;
+	}
+
+	Camera const& camera() const
+	{
+		return cam;
+	}
+
+	void saveResult()
+	{
+		Image image(imageW, imageH, pixels);
+		savePPMImage(image, "out.ppm");
+	}
+};
+
+enum RenderBackend {
+	GPU_BACKEND = 0,
+	CPU_BACKEND = 1,
+	COMPARE_BACKENDS = 2 // Renders on both and reports how far the images are apart
+};
+
+struct AppOptions {
+	std::string meshPath = "suzanne.obj";
+	BVHBuildOptions bvhOptions;
+	bool compareBuilders = false;
+	bool compareLayouts = false;
+	bool compareOrders = false;
+	bool benchSimd = false;
+	bool rayQueries = false; // Primary hits and shadow segments from them after the render
+	WavefrontOptions wavefront;
+	ProgressiveOptions progressive;
+	RenderBackend backend = GPU_BACKEND;
+	unsigned animateFrames = 0;
+	bool saveFrames = false;        // Every animated frame to frame_NNNN.ppm
+	unsigned benchOutputFrames = 0; // Serial against pipelined readback and encoding
+	unsigned copies = 1;
+	std::string cachePath;
+	std::string statsPath; // JSON from computeBVHStats, "-" for stdout
+	TuningOptions tuning;
+	ProfileOptions profile;
+	std::string pipelineCachePath = "pipeline_cache.bin"; // Empty starts cold
+};
+
+static bool writeStats(std::string const& path, std::vector<BVHStats> const& stats)
+{
+	if (path == "-") {
+		writeBVHStatsJSON(std::cout, stats);
+		return true;
+	}
+
+	std::ofstream file(path);
+	if (!file.is_open()) {
+		std::cerr << "Failed to write BVH stats: " << path << std::endl;
+		return false;
+	}
+
+	writeBVHStatsJSON(file, stats);
+	return true;
+}
+
+// The camera rays compute.comp traces from cam, for CPU measurements
+static std::vector<Ray> cameraRays(Camera const& cam)
+{
+	std::vector<Ray> rays;
+	rays.reserve(IMAGE_WIDTH * IMAGE_HEIGHT);
+	for (uint32_t y = 0; y < IMAGE_HEIGHT; ++y)
+		for (uint32_t x = 0; x < IMAGE_WIDTH; ++x)
+			rays.push_back(cameraRay(cam, x, y, IMAGE_WIDTH, IMAGE_HEIGHT));
+	return rays;
+}
+
+// Builds the mesh, converts it to every node format and measures each tree
+static std::vector<BVHStats> measureBVH(Mesh const& mesh, BVHBuildOptions const& buildOptions,
+	std::vector<BVHNodeFormat> const& nodeFormats, std::vector<Ray> const& rays, Arena& arena,
+	TraversalOrder order = NEAREST_FIRST)
+{
+	// One tree for every format, so its leaves must fit a quantized node when one is measured
+	bool quantized = std::find(nodeFormats.begin(), nodeFormats.end(), QUANTIZED4_NODES) != nodeFormats.end();
+	BVHBuildOptions options = quantized ? quantizedBuildOptions(buildOptions) : buildOptions;
+
+	auto buildStart = std::chrono::steady_clock::now();
+	BVH bvh;
+	bvh.refList = buildTriangleRefList(mesh.triangles, mesh.vertex_data);
+	arena.reset();
+	BVHBuildNode* buildNode = buildBVHNode(bvh.refList, mesh, options, arena);
+	buildBVH(buildNode, bvh);
+	bvh.triangleList = buildTriangleList(bvh.refList, mesh.triangles, mesh.vertex_data);
+	if (options.nodeLayout == CACHE_OBLIVIOUS_LAYOUT)
+		orderBVHChildren(bvh);
+	std::chrono::duration<double, std::milli> bvhBuildTime = std::chrono::steady_clock::now() - buildStart;
+
+	std::vector<BVHStats> results;
+	for (auto nodeFormat : nodeFormats) {
+		auto convertStart = std::chrono::steady_clock::now();
+		TraversalBVH tree = makeTraversalBVH(bvh, nodeFormat, options.nodeLayout);
+		std::chrono::duration<double, std::milli> buildTime =
+			bvhBuildTime + (std::chrono::steady_clock::now() - convertStart);
+
+		results.push_back(computeBVHStats(tree, options));
+		results.back().buildMs = buildTime.count();
+		traceBVHStats(tree, rays, results.back(), order);
+	}
+
+	return results;
+}
+
+// Builds the mesh with every builder and traces the camera rays on the CPU,
+// with --quantize both 4-wide encodings are traced for every builder
+int compareBuilders(AppOptions const& options)
+{
+	auto mesh = loadMesh(options.meshPath);
+	if (!mesh)
+		return -1;
+
+	struct Candidate {
+		const char* name;
+		BVHBuildOptions options;
+	};
+
+	std::vector<Candidate> candidates;
+	candidates.push_back({"median", options.bvhOptions});
+	candidates.back().options.builder = MEDIAN_BUILDER;
+	candidates.push_back({"sah", options.bvhOptions});
+	candidates.back().options.builder = SAH_BUILDER;
+	candidates.push_back({"lbvh", options.bvhOptions});
+	candidates.back().options.builder = LBVH_BUILDER;
+	candidates.back().options.treeletOptimize = false;
+	candidates.push_back({"lbvh+treelets", options.bvhOptions});
+	candidates.back().options.builder = LBVH_BUILDER;
+	candidates.back().options.treeletOptimize = true;
+	candidates.push_back({"sbvh", options.bvhOptions});
+	candidates.back().options.builder = SBVH_BUILDER;
+
+	std::vector<Ray> rays = cameraRays(sceneCamera());
+	Arena arena;
+
+	std::vector<BVHNodeFormat> nodeFormats;
+	if (options.bvhOptions.quantizeNodes) {
+		nodeFormats.push_back(WIDE4_NODES);
+		nodeFormats.push_back(QUANTIZED4_NODES);
+	} else {
+		nodeFormats.push_back(nodeFormatForWidth(options.bvhOptions.width));
+	}
+
+	std::cout << "builder, nodes, build ms, refs, node count, node KiB, trace ms, Mrays/s, nodes/ray, "
+		"triangles/ray" << std::endl;
+
+	std::vector<BVHStats> allStats;
+	for (auto const& candidate : candidates) {
+		for (auto& stats : measureBVH(*mesh, candidate.options, nodeFormats, rays, arena)) {
+			stats.builder = candidate.name;
+			std::cout << candidate.name << ", "
+				<< stats.nodeFormat << ", "
+				<< stats.buildMs << ", "
+				<< stats.refCount << ", "
+				<< stats.traversalNodeCount << ", "
+				<< stats.traversalNodeBytes / 1024.0 << ", "
+				<< stats.rays.traceMs << ", "
+				<< stats.rays.rayCount / stats.rays.traceMs / 1000.0 << ", "
+				<< stats.rays.meanNodesVisited << ", "
+				<< stats.rays.meanTriangleTests << std::endl;
+			allStats.push_back(stats);
+		}
+	}
+
+	if (!options.statsPath.empty() && !writeStats(options.statsPath, allStats))
+		return -1;
+
+	return 0;
+}
+
+// Traces the camera rays through every node format in both layouts, the
+// locality columns are per ray and per node fetch
+int compareLayouts(AppOptions const& options)
+{
+	auto mesh = loadMesh(options.meshPath);
+	if (!mesh)
+		return -1;
+
+	std::vector<Ray> rays = cameraRays(sceneCamera());
+	Arena arena;
+
+	std::vector<BVHNodeFormat> nodeFormats = {BINARY_NODES, WIDE4_NODES, WIDE8_NODES, QUANTIZED4_NODES};
+	std::vector<BVHNodeLayout> layouts = {DEPTH_FIRST_LAYOUT, CACHE_OBLIVIOUS_LAYOUT};
+
+	std::cout << "nodes, layout, trace ms, Mrays/s, nodes/ray, page jumps/ray, jump bytes/fetch" << std::endl;
+
+	std::vector<BVHStats> allStats;
+	for (auto layout : layouts) {
+		BVHBuildOptions layoutOptions = options.bvhOptions;
+		layoutOptions.nodeLayout = layout;
+
+		for (auto const& stats : measureBVH(*mesh, layoutOptions, nodeFormats, rays, arena)) {
+			std::cout << stats.nodeFormat << ", "
+				<< stats.nodeLayout << ", "
+				<< stats.rays.traceMs << ", "
+				<< stats.rays.rayCount / stats.rays.traceMs / 1000.0 << ", "
+				<< stats.rays.meanNodesVisited << ", "
+				<< stats.rays.meanPageJumps << ", "
+				<< stats.rays.meanNodeJumpBytes << std::endl;
+			allStats.push_back(stats);
+		}
+	}
+
+	if (!options.statsPath.empty() && !writeStats(options.statsPath, allStats))
+		return -1;
+
+	return 0;
+}
+
+// Traversal work per camera ray of every node format, walked in the fixed order
+// of the render and nearest first with culling. Both find the same hits.
+int compareOrders(AppOptions const& options)
+{
+	auto mesh = loadMesh(options.meshPath);
+	if (!mesh)
+		return -1;
+
+	std::vector<Ray> rays = cameraRays(sceneCamera());
+	Arena arena;
+
+	std::vector<BVHNodeFormat> nodeFormats = {BINARY_NODES, WIDE4_NODES, WIDE8_NODES, QUANTIZED4_NODES};
+	std::vector<TraversalOrder> orders = {FIXED_ORDER, NEAREST_FIRST};
+
+	std::cout << "nodes, order, hits, trace ms, Mrays/s, nodes/ray, boxes/ray, triangles/ray, max triangles"
+		<< std::endl;
+
+	std::vector<BVHStats> allStats;
+	for (auto order : orders) {
+		for (auto const& stats : measureBVH(*mesh, options.bvhOptions, nodeFormats, rays, arena, order)) {
+			std::cout << stats.nodeFormat << ", "
+				<< stats.rays.traversalOrder << ", "
+				<< stats.rays.hitCount << ", "
+				<< stats.rays.traceMs << ", "
+				<< stats.rays.rayCount / stats.rays.traceMs / 1000.0 << ", "
+				<< stats.rays.meanNodesVisited << ", "
+				<< stats.rays.meanBoxTests << ", "
+				<< stats.rays.meanTriangleTests << ", "
+				<< stats.rays.maxTriangleTests << std::endl;
+			allStats.push_back(stats);
+		}
+	}
+
+	if (!options.statsPath.empty() && !writeStats(options.statsPath, allStats))
+		return -1;
+
+	return 0;
+}
+
+// Quality and traversal statistics of the tree the current settings build
+int reportStats(AppOptions const& options)
+{
+	auto mesh = loadMesh(options.meshPath);
+	if (!mesh)
+		return -1;
+
+	Arena arena;
+	std::vector<BVHNodeFormat> nodeFormats = {
+		nodeFormatForWidth(options.bvhOptions.width, options.bvhOptions.quantizeNodes)};
+	auto stats = measureBVH(*mesh, options.bvhOptions, nodeFormats, cameraRays(sceneCamera()), arena);
+
+	return writeStats(options.statsPath, stats) ? 0 : -1;
+}
+
+static uint64_t foldMask(uint64_t fold, uint32_t mask)
+{
+	return fold * 31 + mask;
+}
+
+// Intersections per second of every kernel set the CPU supports: camera rays
+// against the leaves of the mesh BVH, against the children of its 8-wide nodes
+// and in packets against its binary node boxes. Every set has to reproduce
+// what the scalar kernels found.
+int benchmarkSimd(AppOptions const& options)
+{
+	auto mesh = loadMesh(options.meshPath);
+	if (!mesh)
+		return -1;
+
+	Arena arena;
+	BVH bvh;
+	bvh.refList = buildTriangleRefList(mesh->triangles, mesh->vertex_data);
+	BVHBuildNode* buildNode = buildBVHNode(bvh.refList, *mesh, options.bvhOptions, arena);
+	buildBVH(buildNode, bvh);
+	bvh.triangleList = buildTriangleList(bvh.refList, mesh->triangles, mesh->vertex_data);
+
+	WideBVH<8> wide = collapseBVH<8>(bvh);
+	SoATriangles triangles = makeSoATriangles(bvh.triangleList);
+
+	std::vector<std::pair<uint32_t, uint32_t>> leaves;
+	std::vector<AABB> boxes;
+	for (auto const& node : bvh.nodeList) {
+		if (node.isLeafBegin >= 0) {
+			leaves.push_back({node.isLeafBegin, node.rightOffsetEnd});
+		} else {
+			boxes.push_back(node.leftBounds);
+			boxes.push_back(node.rightBounds);
+		}
+	}
+
+	// Roughly 2^25 triangle tests per kernel set, whatever the mesh size
+	std::vector<Ray> cameraRayList = cameraRays(sceneCamera());
+	size_t rayCount = std::clamp<size_t>((size_t(1) << 25) / std::max<size_t>(triangles.count, 1), 256,
+		cameraRayList.size());
+	size_t rayStride = cameraRayList.size() / rayCount;
+
+	std::vector<Ray> rays;
+	for (size_t i = 0; i < rayCount; ++i)
+		rays.push_back(cameraRayList[i * rayStride]);
+
+	std::vector<RayPacket> packets;
+	for (size_t i = 0; i < rays.size(); i += SIMD_MAX_LANES)
+		packets.push_back(makeRayPacket(&rays[i], std::min<size_t>(SIMD_MAX_LANES, rays.size() - i)));
+
+	std::cout << "isa, lanes, Mtriangles/s, Mboxes/s, Mpacket boxes/s, mismatches" << std::endl;
+
+	std::vector<RayHit> referenceHits;
+	std::vector<uint64_t> referenceBoxes, referencePackets;
+	int result = 0;
+
+	for (int isa = SCALAR_ISA; isa < SIMD_ISA_COUNT; ++isa) {
+		if (!simdSupported(SimdISA(isa))) {
+			std::cout << simdISAName(SimdISA(isa)) << ", unsupported" << std::endl;
+			continue;
+		}
+		SimdKernels const& kernels = simdKernels(SimdISA(isa));
+
+		std::vector<RayHit> hits(rays.size());
+		auto triangleStart = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < rays.size(); ++i) {
+			hits[i] = {std::numeric_limits<float>::max(), 0};
+			for (auto const& leaf : leaves)
+				kernels.intersectTriangles(triangles, leaf.first, leaf.second, rays[i], hits[i]);
+		}
+		std::chrono::duration<double> triangleTime = std::chrono::steady_clock::now() - triangleStart;
+
+		std::vector<uint64_t> boxFolds(rays.size(), 0);
+		auto boxStart = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < rays.size(); ++i) {
+			glm::vec3 inv = 1.0f / rays[i].d;
+			for (auto const& node : wide.nodeList)
+				boxFolds[i] = foldMask(boxFolds[i], kernels.intersectBoxes(nodeBoxes(node), rays[i], inv));
+		}
+		std::chrono::duration<double> boxTime = std::chrono::steady_clock::now() - boxStart;
+
+		std::vector<uint64_t> packetFolds(packets.size(), 0);
+		auto packetStart = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < packets.size(); ++i)
+			for (auto const& box : boxes)
+				packetFolds[i] = foldMask(packetFolds[i], kernels.intersectPacket(box, packets[i]));
+		std::chrono::duration<double> packetTime = std::chrono::steady_clock::now() - packetStart;
+
+		if (isa == SCALAR_ISA) {
+			referenceHits = hits;
+			referenceBoxes = boxFolds;
+			referencePackets = packetFolds;
+		}
+
+		size_t mismatches = 0;
+		for (size_t i = 0; i < rays.size(); ++i)
+			if (hits[i].t != referenceHits[i].t || hits[i].index != referenceHits[i].index ||
+				boxFolds[i] != referenceBoxes[i])
+				mismatches++;
+		for (size_t i = 0; i < packets.size(); ++i)
+			if (packetFolds[i] != referencePackets[i])
+				mismatches++;
+
+		double triangleTests = double(rays.size()) * triangles.count;
+		double boxTests = double(rays.size()) * wide.nodeList.size() * 8;
+		double packetTests = double(rays.size()) * boxes.size();
+
+		std::cout << kernels.name << ", "
+			<< kernels.lanes << ", "
+			<< triangleTests / triangleTime.count() / 1000000.0 << ", "
+			<< boxTests / boxTime.count() / 1000000.0 << ", "
+			<< packetTests / packetTime.count() / 1000000.0 << ", "
+			<< mismatches << std::endl;
+
+		if (mismatches > 0)
+			result = 1;
+	}
+
+	std::cout << "Runtime dispatch picks " << simdKernels().name << std::endl;
+
+	return result;
+}
+
+// Times the CPU closest hit path on the rays and checks the GPU hits against
+// it when there are any
+static size_t compareClosestHits(TwoLevelBVH const& accel, std::vector<Ray> const& rays,
+	std::vector<RayQueryHit>& cpuHits, std::vector<RayQueryHit> const& gpuHits)
+{
+	cpuHits.resize(rays.size());
+
+	auto start = std::chrono::steady_clock::now();
+	traceRays(accel, rays, cpuHits);
+	std::chrono::duration<double> queryTime = std::chrono::steady_clock::now() - start;
+
+	size_t hitCount = std::count_if(cpuHits.begin(), cpuHits.end(),
+		[](RayQueryHit const& hit) { return hit.primitive != RAY_QUERY_MISS; });
+	std::cout << "CPU closest hit: " << rays.size() << " rays in " << queryTime.count() * 1000.0 << " ms, "
+		<< rays.size() / queryTime.count() / 1000000.0 << " Mrays/s, " << hitCount << " hits" << std::endl;
+
+	if (gpuHits.empty())
+		return 0;
+
+	size_t mismatches = 0;
+	for (size_t i = 0; i < rays.size(); ++i)
+		if (gpuHits[i].primitive != cpuHits[i].primitive || gpuHits[i].instance != cpuHits[i].instance ||
+			std::abs(gpuHits[i].t - cpuHits[i].t) > 1e-4f * cpuHits[i].t)
+			mismatches++;
+
+	std::cout << "CPU against GPU: " << mismatches << " of " << rays.size() << " hits differ" << std::endl;
+	return mismatches;
+}
+
+// Hard shadow segments toward a distant light from every primary hit, nudged
+// off the surface by tmin
+static std::vector<OcclusionSegment> shadowSegments(std::vector<Ray> const& rays,
+	std::vector<RayQueryHit> const& hits)
+{
+	glm::vec3 light = glm::normalize(glm::vec3(0.3f, 1.0f, 0.2f));
+	std::vector<OcclusionSegment> segments;
+	for (size_t i = 0; i < rays.size(); ++i)
+		if (hits[i].primitive != RAY_QUERY_MISS)
+			segments.push_back({rays[i].o + rays[i].d * hits[i].t, 0.001f, light,
+				std::numeric_limits<float>::max()});
+
+	return segments;
+}
+
+// Times the CPU any-hit path on the shadow segments and checks the GPU flags
+// against it when there are any
+static size_t compareOcclusion(TwoLevelBVH const& accel, std::vector<OcclusionSegment> const& segments,
+	std::vector<uint8_t> const& gpuFlags)
+{
+	std::vector<uint8_t> cpuFlags(segments.size());
+
+	auto start = std::chrono::steady_clock::now();
+	traceOcclusion(accel, segments, cpuFlags);
+	std::chrono::duration<double> queryTime = std::chrono::steady_clock::now() - start;
+
+	size_t occludedCount = std::count(cpuFlags.begin(), cpuFlags.end(), 1);
+	std::cout << "CPU occlusion: " << segments.size() << " segments in " << queryTime.count() * 1000.0 << " ms, "
+		<< segments.size() / queryTime.count() / 1000000.0 << " Msegments/s, "
+		<< occludedCount << " occluded" << std::endl;
+
+	if (gpuFlags.empty())
+		return 0;
+
+	size_t mismatches = 0;
+	for (size_t i = 0; i < segments.size(); ++i)
+		if (gpuFlags[i] != cpuFlags[i])
+			mismatches++;
+
+	std::cout << "CPU against GPU: " << mismatches << " of " << segments.size() << " segments differ" << std::endl;
+	return mismatches;
+}
+
+bool parseArguments(int argc, char **argv, AppOptions& options)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--mesh" && hasValue) {
+			options.meshPath = argv[++i];
+		} else if (arg == "--builder" && hasValue) {
+			std::string builder = argv[++i];
+			if (builder == "median") {
+				options.bvhOptions.builder = MEDIAN_BUILDER;
+			} else if (builder == "sah") {
+				options.bvhOptions.builder = SAH_BUILDER;
+			} else if (builder == "lbvh") {
+				options.bvhOptions.builder = LBVH_BUILDER;
+			} else if (builder == "sbvh") {
+				options.bvhOptions.builder = SBVH_BUILDER;
+			} else {
+				std::cerr << "Unknown BVH builder: " << builder << std::endl;
+				return false;
+			}
+		} else if (arg == "--sah-bins" && hasValue) {
+			options.bvhOptions.sahBinCount = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--traversal-cost" && hasValue) {
+			options.bvhOptions.traversalCost = std::strtof(argv[++i], nullptr);
+		} else if (arg == "--intersection-cost" && hasValue) {
+			options.bvhOptions.intersectionCost = std::strtof(argv[++i], nullptr);
+		} else if (arg == "--split-budget" && hasValue) {
+			options.bvhOptions.spatialSplitBudget = std::strtof(argv[++i], nullptr);
+		} else if (arg == "--split-alpha" && hasValue) {
+			options.bvhOptions.spatialSplitAlpha = std::strtof(argv[++i], nullptr);
+		} else if (arg == "--max-leaf-size" && hasValue) {
+			options.bvhOptions.maxLeafSize = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--width" && hasValue) {
+			options.bvhOptions.width = std::strtoul(argv[++i], nullptr, 10);
+			if (options.bvhOptions.width != 2 && options.bvhOptions.width != 4 &&
+				options.bvhOptions.width != 8) {
+				std::cerr << "BVH width must be 2, 4 or 8" << std::endl;
+				return false;
+			}
+		} else if (arg == "--quantize") {
+			options.bvhOptions.quantizeNodes = true;
+		} else if (arg == "--treelets") {
+			options.bvhOptions.treeletOptimize = true;
+		} else if (arg == "--animate" && hasValue) {
+			options.animateFrames = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--save-frames") {
+			options.saveFrames = true;
+		} else if (arg == "--bench-output" && hasValue) {
+			options.benchOutputFrames = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--refit-rebuild-ratio" && hasValue) {
+			options.bvhOptions.refitRebuildRatio = std::strtof(argv[++i], nullptr);
+		} else if (arg == "--copies" && hasValue) {
+			options.copies = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+		} else if (arg == "--bvh-cache" && hasValue) {
+			options.cachePath = argv[++i];
+		} else if (arg == "--stats" && hasValue) {
+			options.statsPath = argv[++i];
+		} else if (arg == "--layout" && hasValue) {
+			std::string layout = argv[++i];
+			if (layout == "depth-first") {
+				options.bvhOptions.nodeLayout = DEPTH_FIRST_LAYOUT;
+			} else if (layout == "cache-oblivious") {
+				options.bvhOptions.nodeLayout = CACHE_OBLIVIOUS_LAYOUT;
+			} else {
+				std::cerr << "Unknown node layout: " << layout << std::endl;
+				return false;
+			}
+		} else if (arg == "--backend" && hasValue) {
+			std::string backend = argv[++i];
+			if (backend == "gpu") {
+				options.backend = GPU_BACKEND;
+			} else if (backend == "cpu") {
+				options.backend = CPU_BACKEND;
+			} else if (backend == "compare") {
+				options.backend = COMPARE_BACKENDS;
+			} else {
+				std::cerr << "Unknown render backend: " << backend << std::endl;
+				return false;
+			}
+		} else if (arg == "--wavefront" && hasValue) {
+			options.wavefront.bounces = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--persistent-groups" && hasValue) {
+			options.wavefront.persistentGroups = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--samples" && hasValue) {
+			options.progressive.samples = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--time-budget" && hasValue) {
+			options.progressive.timeBudget = std::strtod(argv[++i], nullptr);
+		} else if (arg == "--snapshot-every" && hasValue) {
+			options.progressive.snapshotInterval = std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--pipeline-cache" && hasValue) {
+			options.pipelineCachePath = argv[++i];
+		} else if (arg == "--no-pipeline-cache") {
+			options.pipelineCachePath.clear();
+		} else if (arg == "--counters") {
+			options.profile.counters = true;
+		} else if (arg == "--profile" && hasValue) {
+			options.profile.reportPath = argv[++i];
+		} else if (arg == "--heatmap" && hasValue) {
+			options.profile.heatmapPath = argv[++i];
+			options.profile.counters = true;
+		} else if (arg == "--autotune") {
+			options.tuning.autotune = true;
+		} else if (arg == "--tuning-file" && hasValue) {
+			options.tuning.path = argv[++i];
+		} else if (arg == "--ray-queries") {
+			options.rayQueries = true;
+		} else if (arg == "--bench-simd") {
+			options.benchSimd = true;
+		} else if (arg == "--compare-orders") {
+			options.compareOrders = true;
+		} else if (arg == "--compare-layouts") {
+			options.compareLayouts = true;
+		} else if (arg == "--compare-builders") {
+			options.compareBuilders = true;
+		} else {
+			std::cerr << "Unknown argument: " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (options.bvhOptions.quantizeNodes && options.bvhOptions.width != 4) {
+		std::cout << "Quantized nodes are 4-wide, using --width 4" << std::endl;
+		options.bvhOptions.width = 4;
+	}
+
+	if (options.wavefront.bounces > 0 && options.backend != GPU_BACKEND) {
+		std::cout << "Only the GPU backend path traces, ignoring --wavefront" << std::endl;
+		options.wavefront.bounces = 0;
+	}
+
+	if (options.backend == CPU_BACKEND && (options.profile.counters || !options.profile.reportPath.empty())) {
+		std::cout << "Only the GPU backends are profiled, ignoring --profile, --counters and --heatmap" << std::endl;
+		options.profile = ProfileOptions();
+	}
+
+	if (options.profile.counters && options.wavefront.bounces > 0) {
+		std::cout << "Only the render walks count their work, ignoring --counters and --heatmap" << std::endl;
+		options.profile.counters = false;
+		options.profile.heatmapPath.clear();
+	}
+
+	if (options.tuning.autotune && (options.backend == CPU_BACKEND || options.wavefront.bounces > 0)) {
+		std::cout << "Only the GPU render pipeline is tuned, ignoring --autotune" << std::endl;
+		options.tuning.autotune = false;
+	}
+
+	if (options.progressive.enabled() && options.backend != GPU_BACKEND) {
+		std::cout << "Only the GPU backend accumulates samples, ignoring --samples and --time-budget" << std::endl;
+		options.progressive = ProgressiveOptions();
+	}
+
+	if ((options.saveFrames || options.benchOutputFrames > 0) && options.backend == CPU_BACKEND) {
+		std::cout << "Only the GPU backends read frames back, ignoring --save-frames and --bench-output" << std::endl;
+		options.saveFrames = false;
+		options.benchOutputFrames = 0;
+	}
+
+	// A cached scene only exists on the GPU, refits, CPU rendering and the CPU
+	// side of --ray-queries need the CPU trees
+	if (!options.cachePath.empty() && (options.animateFrames > 0 || options.backend != GPU_BACKEND ||
+		options.rayQueries)) {
+		std::cout << "The BVH cache only feeds static GPU renders, ignoring --bvh-cache" << std::endl;
+		options.cachePath.clear();
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	AppOptions options;
+	if (!parseArguments(argc, argv, options))
+		return -1;
+
+	if (options.compareBuilders)
+		return compareBuilders(options);
+
+	if (options.compareLayouts)
+		return compareLayouts(options);
+
+	if (options.compareOrders)
+		return compareOrders(options);
+
+	if (options.benchSimd)
+		return benchmarkSimd(options);
+
+	if (!options.statsPath.empty())
+		return reportStats(options);
+
+	if (options.backend == CPU_BACKEND) {
+		CpuApp app(options.meshPath, options.copies, options.bvhOptions);
+		app.init();
+		app.run();
+		app.animate(options.animateFrames);
+		app.saveResult();
+
+		if (options.rayQueries) {
+			std::vector<Ray> rays = cameraRays(app.camera());
+			std::vector<RayQueryHit> hits;
+			compareClosestHits(app.sceneBVH(), rays, hits, {});
+			compareOcclusion(app.sceneBVH(), shadowSegments(rays, hits), {});
+		}
+		return 0;
+	}
+
+	ComputeApp app(true, options.meshPath, options.copies, options.cachePath, options.bvhOptions,
+		options.wavefront, options.progressive, options.tuning, options.profile, options.pipelineCachePath);
+	app.init();
+	app.run();
+	app.animate(options.animateFrames, options.saveFrames);
+	if (options.benchOutputFrames > 0)
+		app.benchmarkOutput(options.benchOutputFrames);
+	app.saveResult();
+
+	if (!options.profile.reportPath.empty())
+		app.profile();
+	if (!options.profile.heatmapPath.empty())
+		app.saveHeatmap(options.profile.heatmapPath);
+
+	if (options.backend == COMPARE_BACKENDS) {
+		std::vector<Pixel> cpuPixels(IMAGE_WIDTH * IMAGE_HEIGHT);
+		renderCPU(app.sceneBVH(), app.camera(), IMAGE_WIDTH, IMAGE_HEIGHT, cpuPixels.data());
+
+		PixelDifference difference = comparePixels(app.readPixels(), cpuPixels, 1e-4f);
+		std::cout << "CPU against GPU: " << difference.differing << " of " << cpuPixels.size()
+			<< " pixels differ, max channel difference " << difference.maxDifference << std::endl;
+		if (difference.differing > 0)
+			return 1;
+	}
+
+	if (options.rayQueries) {
+		std::vector<Ray> rays = cameraRays(app.camera());
+		std::vector<RayQueryHit> hits;
+		size_t mismatches = compareClosestHits(app.sceneBVH(), rays, hits, app.traceClosestHits(rays));
+
+		std::vector<OcclusionSegment> segments = shadowSegments(rays, hits);
+		mismatches += compareOcclusion(app.sceneBVH(), segments, app.traceOcclusion(segments));
+		if (mismatches > 0)
+			return 1;
+	}
 	
   	return 0;
 }
\ No newline at end of file
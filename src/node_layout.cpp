@@ -0,0 +1,161 @@
+#include <node_layout.hpp>
+
+// Nodes in every subtree, children always come after their parent
+static std::vector<uint32_t> subtreeSizes(BVH const& bvh)
+{
+  std::vector<uint32_t> sizes(bvh.nodeList.size(), 1);
+  for (size_t i = bvh.nodeList.size(); i-- > 0;) {
+    BVHNode const& node = bvh.nodeList[i];
+    if (node.isLeafBegin < 0)
+      sizes[i] = 1 + sizes[i + 1] + sizes[node.rightOffsetEnd];
+  }
+  return sizes;
+}
+
+static uint32_t emitOrdered(BVH const& bvh, std::vector<uint32_t> const& sizes, uint32_t index,
+  std::vector<BVHNode>& nodeList)
+{
+  BVHNode node = bvh.nodeList[index];
+  uint32_t newIndex = nodeList.size();
+  nodeList.push_back(node);
+
+  if (node.isLeafBegin >= 0)
+    return newIndex;
+
+  uint32_t first = index + 1;
+  uint32_t second = node.rightOffsetEnd;
+  if (sizes[second] < sizes[first]) {
+    std::swap(first, second);
+    std::swap(nodeList[newIndex].leftBounds, nodeList[newIndex].rightBounds);
+  }
+
+  emitOrdered(bvh, sizes, first, nodeList);
+  uint32_t right = emitOrdered(bvh, sizes, second, nodeList);
+  nodeList[newIndex].rightOffsetEnd = right;
+
+  return newIndex;
+}
+
+void orderBVHChildren(BVH& bvh)
+{
+  if (bvh.nodeList.empty())
+    return;
+
+  std::vector<uint32_t> sizes = subtreeSizes(bvh);
+  std::vector<BVHNode> nodeList;
+  nodeList.reserve(bvh.nodeList.size());
+  emitOrdered(bvh, sizes, 0, nodeList);
+
+  bvh.nodeList = std::move(nodeList);
+}
+
+// Works on any node with child[] and count[] as in WideBVHNode
+template <typename Node, unsigned N>
+struct VEBLayout {
+  std::vector<Node> const& nodes;
+  std::vector<uint32_t> heights;
+  std::vector<uint32_t> order;
+
+  static bool isInner(Node const& node, unsigned i)
+  {
+    return node.child[i] >= 0 && node.count[i] == 0;
+  }
+
+  explicit VEBLayout(std::vector<Node> const& nodes) : nodes(nodes), heights(nodes.size(), 0)
+  {
+    order.reserve(nodes.size());
+    computeHeight(0);
+  }
+
+  uint32_t computeHeight(uint32_t index)
+  {
+    uint32_t height = 0;
+    for (unsigned i = 0; i < N; ++i)
+      if (isInner(nodes[index], i))
+        height = std::max(height, computeHeight(nodes[index].child[i]));
+
+    heights[index] = height + 1;
+    return heights[index];
+  }
+
+  // Inner nodes exactly depth levels below index, left to right
+  void collectFrontier(uint32_t index, uint32_t depth, std::vector<uint32_t>& frontier)
+  {
+    if (depth == 0) {
+      frontier.push_back(index);
+      return;
+    }
+
+    for (unsigned i = 0; i < N; ++i)
+      if (isInner(nodes[index], i))
+        collectFrontier(nodes[index].child[i], depth - 1, frontier);
+  }
+
+  // Emits the first levels levels of the subtree at index
+  void layout(uint32_t index, uint32_t levels)
+  {
+    levels = std::min(levels, heights[index]);
+    if (levels == 1) {
+      order.push_back(index);
+      return;
+    }
+
+    uint32_t top = levels / 2;
+    layout(index, top);
+
+    std::vector<uint32_t> frontier;
+    collectFrontier(index, top, frontier);
+    for (uint32_t child : frontier)
+      layout(child, levels - top);
+  }
+};
+
+template <typename Node, unsigned N>
+static void permuteVEB(std::vector<Node>& nodes)
+{
+  if (nodes.empty())
+    return;
+
+  VEBLayout<Node, N> veb(nodes);
+  veb.layout(0, veb.heights[0]);
+
+  std::vector<uint32_t> newIndex(nodes.size());
+  for (uint32_t i = 0; i < veb.order.size(); ++i)
+    newIndex[veb.order[i]] = i;
+
+  std::vector<Node> permuted;
+  permuted.reserve(nodes.size());
+  for (uint32_t old : veb.order) {
+    permuted.push_back(nodes[old]);
+    Node& node = permuted.back();
+    for (unsigned i = 0; i < N; ++i)
+      if (VEBLayout<Node, N>::isInner(node, i))
+        node.child[i] = newIndex[node.child[i]];
+  }
+
+  nodes = std::move(permuted);
+}
+
+template <unsigned N>
+void layoutVEB(WideBVH<N>& wide)
+{
+  permuteVEB<WideBVHNode<N>, N>(wide.nodeList);
+}
+
+template void layoutVEB<4>(WideBVH<4>& wide);
+template void layoutVEB<8>(WideBVH<8>& wide);
+
+void layoutVEB(QuantizedBVH& quantized)
+{
+  permuteVEB<QuantizedBVHNode, 4>(quantized.nodeList);
+}
+
+const char* nodeLayoutName(BVHNodeLayout layout)
+{
+  switch (layout) {
+  case CACHE_OBLIVIOUS_LAYOUT:
+    return "cache-oblivious";
+  default:
+    return "depth-first";
+  }
+}
@@ -0,0 +1,123 @@
+#include <quantized_bvh.hpp>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// Normal float range only, so the scale can be built from its exponent bits
+constexpr int MIN_QUANTIZED_EXPONENT = -126;
+constexpr int MAX_QUANTIZED_EXPONENT = 127;
+
+float quantizedScale(int8_t exponent)
+{
+  uint32_t bits = uint32_t(exponent + 127) << 23;
+  float scale;
+  std::memcpy(&scale, &bits, sizeof(float));
+  return scale;
+}
+
+float dequantize(float origin, float scale, uint8_t q)
+{
+  return origin + float(q) * scale;
+}
+
+// Smallest power of two step covering [min, max] in 255 steps
+static int8_t quantizedExponent(float min, float max)
+{
+  float extent = max - min;
+  int exponent = MIN_QUANTIZED_EXPONENT;
+  if (extent > 0.0f)
+    exponent = std::max(exponent, int(std::ceil(std::log2(extent / 255.0f))));
+
+  // log2 may round down, the top of the grid has to reach max
+  while (exponent < MAX_QUANTIZED_EXPONENT &&
+    dequantize(min, quantizedScale(exponent), 255) < max)
+    exponent++;
+
+  return exponent;
+}
+
+static uint8_t quantizeMin(float value, float origin, float scale)
+{
+  int q = int(std::floor((value - origin) / scale));
+  q = std::min(std::max(q, 0), 255);
+  while (q > 0 && dequantize(origin, scale, q) > value)
+    q--;
+  return q;
+}
+
+static uint8_t quantizeMax(float value, float origin, float scale)
+{
+  int q = int(std::ceil((value - origin) / scale));
+  q = std::min(std::max(q, 0), 255);
+  while (q < 255 && dequantize(origin, scale, q) < value)
+    q++;
+  return q;
+}
+
+static QuantizedBVHNode quantizeNode(WideBVHNode<4> const& node)
+{
+  QuantizedBVHNode quantized;
+  std::memset(&quantized, 0, sizeof(QuantizedBVHNode));
+
+  AABB bounds = emptyAABB();
+  for (unsigned i = 0; i < 4; ++i) {
+    quantized.child[i] = node.child[i];
+    if (node.child[i] < 0)
+      continue;
+
+    AABB child = {glm::vec3(node.maxX[i], node.maxY[i], node.maxZ[i]),
+      glm::vec3(node.minX[i], node.minY[i], node.minZ[i])};
+    bounds = mergeAABB(bounds, child);
+
+    // Truncating would silently drop triangles of the leaf
+    if (node.count[i] > QUANTIZED_MAX_LEAF_SIZE) {
+      std::cerr << "Leaf of " << node.count[i] << " refs does not fit a quantized node" << std::endl;
+      exit(-1);
+    }
+    quantized.count[i] = uint16_t(node.count[i]);
+  }
+
+  // Every slot empty, only happens for the root of an empty mesh
+  if (bounds.min.x > bounds.max.x)
+    return quantized;
+
+  float const* minPlanes[3] = {node.minX, node.minY, node.minZ};
+  float const* maxPlanes[3] = {node.maxX, node.maxY, node.maxZ};
+  uint8_t* qminPlanes[3] = {quantized.qminX, quantized.qminY, quantized.qminZ};
+  uint8_t* qmaxPlanes[3] = {quantized.qmaxX, quantized.qmaxY, quantized.qmaxZ};
+
+  for (unsigned axis = 0; axis < 3; ++axis) {
+    quantized.origin[axis] = bounds.min[axis];
+    quantized.exponent[axis] = quantizedExponent(bounds.min[axis], bounds.max[axis]);
+    float scale = quantizedScale(quantized.exponent[axis]);
+
+    for (unsigned i = 0; i < 4; ++i) {
+      if (node.child[i] < 0)
+        continue;
+
+      qminPlanes[axis][i] = quantizeMin(minPlanes[axis][i], quantized.origin[axis], scale);
+      qmaxPlanes[axis][i] = quantizeMax(maxPlanes[axis][i], quantized.origin[axis], scale);
+    }
+  }
+
+  return quantized;
+}
+
+BVHBuildOptions quantizedBuildOptions(BVHBuildOptions const& options)
+{
+  BVHBuildOptions quantized = options;
+  quantized.maxLeafSize = std::min(options.maxLeafSize, QUANTIZED_MAX_LEAF_SIZE);
+  return quantized;
+}
+
+QuantizedBVH quantizeBVH(WideBVH<4> const& wide)
+{
+  // Same node order as the wide tree, so child indices carry over unchanged
+  QuantizedBVH quantized;
+  quantized.nodeList.reserve(wide.nodeList.size());
+  for (auto const& node : wide.nodeList)
+    quantized.nodeList.push_back(quantizeNode(node));
+
+  return quantized;
+}
@@ -0,0 +1,113 @@
+#include <ray_query.hpp>
+
+// Direction octant, then 15 origin bits and 5 direction bits per axis
+template <typename Query>
+static uint64_t coherenceKey(Query const& q, glm::vec3 const& originMin, glm::vec3 const& originScale)
+{
+	glm::vec3 d = glm::normalize(q.d);
+	uint64_t octant = (d.x < 0.0f ? 4 : 0) | (d.y < 0.0f ? 2 : 0) | (d.z < 0.0f ? 1 : 0);
+	uint64_t origin = mortonCode((q.o - originMin) * originScale) >> 18;
+	uint64_t direction = mortonCode(d * 0.5f + glm::vec3(0.5f)) >> 48;
+
+	return octant << 60 | origin << 15 | direction;
+}
+
+// Anything with an origin o and a direction d
+template <typename Query>
+static std::vector<uint32_t> coherentOrder(Span<Query const> rays, ThreadPool* pool)
+{
+	constexpr size_t grain = 16384;
+
+	AABB originBounds = emptyAABB();
+	for (auto const& r : rays) {
+		originBounds.max = glm::max(r.o, originBounds.max);
+		originBounds.min = glm::min(r.o, originBounds.min);
+	}
+
+	glm::vec3 extent = originBounds.max - originBounds.min;
+	glm::vec3 scale = glm::vec3(1.0f) / glm::max(extent, glm::vec3(EPSILON));
+
+	std::vector<uint64_t> keys(rays.size);
+	std::vector<uint32_t> order(rays.size);
+	auto computeKeys = [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			keys[i] = coherenceKey(rays[i], originBounds.min, scale);
+			order[i] = i;
+		}
+	};
+
+	if (pool)
+		parallelFor(*pool, 0, rays.size, grain, computeKeys);
+	else
+		computeKeys(0, rays.size);
+
+	radixSortMorton(keys, order, pool, grain);
+
+	return order;
+}
+
+std::vector<uint32_t> coherentRayOrder(Span<Ray const> rays, ThreadPool* pool)
+{
+	return coherentOrder(rays, pool);
+}
+
+std::vector<uint32_t> coherentRayOrder(Span<OcclusionSegment const> segments, ThreadPool* pool)
+{
+	return coherentOrder(segments, pool);
+}
+
+RayQueryHit traceRay(TwoLevelBVH const& accel, Ray const& r)
+{
+	RayHit hit;
+	uint32_t instance;
+	if (!traceRay(accel, r, hit, instance))
+		return {std::numeric_limits<float>::max(), RAY_QUERY_MISS, RAY_QUERY_MISS, 0.0f, 0.0f};
+
+	return {hit.t, hit.index, instance, hit.u, hit.v};
+}
+
+void traceRays(TwoLevelBVH const& accel, Span<Ray const> rays, Span<RayQueryHit> hits,
+	RayQueryOptions const& options, ThreadPool& pool)
+{
+	size_t count = std::min(rays.size, hits.size);
+
+	if (count < options.sortThreshold) {
+		parallelFor(pool, 0, count, options.grain, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i)
+				hits[i] = traceRay(accel, rays[i]);
+		});
+		return;
+	}
+
+	// Hits still land at the index of their ray, only the trace order changes
+	std::vector<uint32_t> order = coherentRayOrder(Span<Ray const>(rays.data, count), &pool);
+	parallelFor(pool, 0, count, options.grain, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+			hits[order[i]] = traceRay(accel, rays[order[i]]);
+	});
+}
+
+bool occluded(TwoLevelBVH const& accel, OcclusionSegment const& segment)
+{
+	return occluded(accel, Ray(segment.o, segment.d), segment.tmin, segment.tmax);
+}
+
+void traceOcclusion(TwoLevelBVH const& accel, Span<OcclusionSegment const> segments, Span<uint8_t> occludedFlags,
+	RayQueryOptions const& options, ThreadPool& pool)
+{
+	size_t count = std::min(segments.size, occludedFlags.size);
+
+	if (count < options.sortThreshold) {
+		parallelFor(pool, 0, count, options.grain, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i)
+				occludedFlags[i] = occluded(accel, segments[i]);
+		});
+		return;
+	}
+
+	std::vector<uint32_t> order = coherentRayOrder(Span<OcclusionSegment const>(segments.data, count), &pool);
+	parallelFor(pool, 0, count, options.grain, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+			occludedFlags[order[i]] = occluded(accel, segments[order[i]]);
+	});
+}
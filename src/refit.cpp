@@ -0,0 +1,173 @@
+#include <refit.hpp>
+
+#include <cstring>
+
+// Shared state of one refit, nodes are only written by the task refitting them
+struct BVHRefitContext {
+  BVH& bvh;
+  ThreadPool* pool;
+  unsigned parallelCutoff;
+  std::vector<uint8_t>& nodeDirty;
+};
+
+static bool sameAABB(AABB const& a, AABB const& b)
+{
+  return a.min == b.min && a.max == b.max;
+}
+
+static AABB leafBounds(BVH const& bvh, BVHNode const& node)
+{
+  AABB bounds = emptyAABB();
+  for (int32_t i = node.isLeafBegin; i < node.rightOffsetEnd; ++i)
+    bounds = mergeAABB(bounds, bvh.refList[i].bounds);
+  return bounds;
+}
+
+// Subtrees are contiguous in DFS order, the left one spans [index + 1, rightOffsetEnd)
+static AABB refitNode(BVHRefitContext& ctx, uint32_t index)
+{
+  BVHNode& node = ctx.bvh.nodeList[index];
+  if (node.isLeafBegin >= 0)
+    return leafBounds(ctx.bvh, node);
+
+  uint32_t left = index + 1;
+  uint32_t right = node.rightOffsetEnd;
+
+  AABB leftBounds, rightBounds;
+  if (ctx.pool && right - left >= ctx.parallelCutoff) {
+    TaskGroup group(*ctx.pool);
+    group.run([&]() { leftBounds = refitNode(ctx, left); });
+    rightBounds = refitNode(ctx, right);
+    group.wait();
+  } else {
+    leftBounds = refitNode(ctx, left);
+    rightBounds = refitNode(ctx, right);
+  }
+
+  if (!sameAABB(node.leftBounds, leftBounds) || !sameAABB(node.rightBounds, rightBounds)) {
+    node.leftBounds = leftBounds;
+    node.rightBounds = rightBounds;
+    ctx.nodeDirty[index] = 1;
+  }
+
+  return mergeAABB(leftBounds, rightBounds);
+}
+
+static std::vector<DirtyRange> flagRanges(std::vector<uint8_t> const& dirty, size_t granularity,
+  size_t count)
+{
+  std::vector<DirtyRange> ranges;
+  for (size_t i = 0; i < dirty.size(); ++i) {
+    if (!dirty[i])
+      continue;
+
+    size_t begin = i * granularity;
+    size_t end = std::min((i + 1) * granularity, count);
+    if (!ranges.empty() && ranges.back().end == begin)
+      ranges.back().end = end;
+    else
+      ranges.push_back({begin, end});
+  }
+
+  return ranges;
+}
+
+float bvhSAHCost(BVH const& bvh, BVHBuildOptions const& options)
+{
+  if (bvh.nodeList.empty())
+    return 0.0f;
+
+  BVHNode const& root = bvh.nodeList[0];
+  if (root.isLeafBegin >= 0)
+    return options.intersectionCost * (root.rightOffsetEnd - root.isLeafBegin);
+
+  float rootArea = surfaceArea(mergeAABB(root.leftBounds, root.rightBounds));
+  if (rootArea <= 0.0f)
+    return 0.0f;
+
+  // Leaves keep no bounds of their own, they are charged through their parent
+  float cost = 0.0f;
+  for (auto const& node : bvh.nodeList) {
+    if (node.isLeafBegin >= 0)
+      continue;
+
+    cost += options.traversalCost * surfaceArea(mergeAABB(node.leftBounds, node.rightBounds));
+
+    BVHNode const* children[2] = {&node + 1, &bvh.nodeList[node.rightOffsetEnd]};
+    AABB const* childBounds[2] = {&node.leftBounds, &node.rightBounds};
+    for (int i = 0; i < 2; ++i)
+      if (children[i]->isLeafBegin >= 0)
+        cost += options.intersectionCost * surfaceArea(*childBounds[i]) *
+          (children[i]->rightOffsetEnd - children[i]->isLeafBegin);
+  }
+
+  return cost / rootArea;
+}
+
+BVHRefitResult refitBVH(BVH& bvh, std::vector<TriangleRef> const& triangles,
+  std::vector<Vertex> const& vertex_data, BVHBuildOptions const& options, float builtCost)
+{
+  ThreadPool* pool = options.parallel ? &defaultThreadPool() : nullptr;
+  size_t count = bvh.refList.size();
+
+  // Triangles first, the node pass reads the refreshed ref bounds
+  std::vector<uint8_t> triangleDirty((count + DIRTY_RANGE_GRANULARITY - 1) / DIRTY_RANGE_GRANULARITY, 0);
+  auto refitTriangles = [&](size_t begin, size_t end) {
+    bool dirty = false;
+    for (size_t i = begin; i < end; ++i) {
+      unsigned index = bvh.refList[i].index;
+      bvh.refList[i] = BVHTriangleRef(triangles[index], vertex_data, index);
+
+      BVHTriangle triangle(triangles[index], vertex_data, index);
+      if (std::memcmp(&triangle, &bvh.triangleList[i], sizeof(BVHTriangle)) != 0) {
+        bvh.triangleList[i] = triangle;
+        dirty = true;
+      }
+    }
+
+    if (dirty)
+      triangleDirty[begin / DIRTY_RANGE_GRANULARITY] = 1;
+  };
+
+  if (pool)
+    parallelFor(*pool, 0, count, DIRTY_RANGE_GRANULARITY, refitTriangles);
+  else
+    for (size_t begin = 0; begin < count; begin += DIRTY_RANGE_GRANULARITY)
+      refitTriangles(begin, std::min(begin + DIRTY_RANGE_GRANULARITY, count));
+
+  std::vector<uint8_t> nodeDirty(bvh.nodeList.size(), 0);
+  BVHRefitContext ctx = {bvh, pool, options.parallelCutoff, nodeDirty};
+  if (!bvh.nodeList.empty())
+    refitNode(ctx, 0);
+
+  // Node flags are per node, widen them to granules before merging
+  std::vector<uint8_t> nodeGranules((bvh.nodeList.size() + DIRTY_RANGE_GRANULARITY - 1) /
+    DIRTY_RANGE_GRANULARITY, 0);
+  for (size_t i = 0; i < nodeDirty.size(); ++i)
+    if (nodeDirty[i])
+      nodeGranules[i / DIRTY_RANGE_GRANULARITY] = 1;
+
+  BVHRefitResult result;
+  result.dirtyTriangles = flagRanges(triangleDirty, DIRTY_RANGE_GRANULARITY, count);
+  result.dirtyNodes = flagRanges(nodeGranules, DIRTY_RANGE_GRANULARITY, bvh.nodeList.size());
+  result.sahCost = bvhSAHCost(bvh, options);
+  result.costRatio = builtCost > 0.0f ? result.sahCost / builtCost : 1.0f;
+  result.needsRebuild = result.costRatio > options.refitRebuildRatio;
+
+  return result;
+}
+
+std::vector<DirtyRange> diffRanges(void const* before, void const* after, size_t count, size_t stride)
+{
+  char const* a = static_cast<char const*>(before);
+  char const* b = static_cast<char const*>(after);
+
+  std::vector<uint8_t> dirty((count + DIRTY_RANGE_GRANULARITY - 1) / DIRTY_RANGE_GRANULARITY, 0);
+  for (size_t i = 0; i < dirty.size(); ++i) {
+    size_t begin = i * DIRTY_RANGE_GRANULARITY;
+    size_t end = std::min(begin + DIRTY_RANGE_GRANULARITY, count);
+    dirty[i] = std::memcmp(a + begin * stride, b + begin * stride, (end - begin) * stride) != 0;
+  }
+
+  return flagRanges(dirty, DIRTY_RANGE_GRANULARITY, count);
+}
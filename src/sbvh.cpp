@@ -0,0 +1,553 @@
+#include <bvh.hpp>
+
+#include <atomic>
+#include <mutex>
+
+constexpr unsigned MAX_SBVH_BINS = 64;
+
+// Shared state of one spatial split build. Nodes own their refs while they are
+// split, leaves hand them to leafRefs and gatherLeafRefs puts them in DFS order.
+struct SBVHContext {
+  Mesh const& mesh;
+  BVHBuildOptions const& options;
+  ThreadPool* pool;
+  TaskGroup* group;
+  Arena& arena;
+
+  float rootArea;
+  size_t refLimit;
+  std::atomic<size_t> refCount;
+
+  std::mutex leafMutex;
+  std::vector<BVHTriangleRef> leafRefs;
+
+  SBVHContext(Mesh const& mesh, BVHBuildOptions const& options, ThreadPool* pool, TaskGroup* group,
+    Arena& arena) :
+    mesh(mesh), options(options), pool(pool), group(group), arena(arena),
+    rootArea(0.0f), refLimit(0), refCount(0)
+  {
+  }
+};
+
+struct SBVHSplit {
+  bool valid;
+  bool spatial;
+  int axis;
+  float cost;
+
+  // Object splits partition by centroid bin, spatial splits clip at position
+  unsigned bin;
+  float centroidMin;
+  float binScale;
+  float position;
+
+  AABB leftBounds;
+  AABB rightBounds;
+  uint32_t leftCount;
+  uint32_t rightCount;
+};
+
+static unsigned sbvhBinCount(BVHBuildOptions const& options)
+{
+  return glm::clamp(options.sahBinCount, 2u, MAX_SBVH_BINS);
+}
+
+static bool validAABB(AABB const& bounds)
+{
+  return bounds.min.x <= bounds.max.x && bounds.min.y <= bounds.max.y && bounds.min.z <= bounds.max.z;
+}
+
+static AABB growAABB(AABB const& bounds, glm::vec3 p)
+{
+  return {glm::max(bounds.max, p), glm::min(bounds.min, p)};
+}
+
+static AABB intersectAABB(AABB const& a, AABB const& b)
+{
+  return {glm::min(a.max, b.max), glm::max(a.min, b.min)};
+}
+
+static float splitCost(BVHBuildOptions const& options, float area, AABB const& leftBounds,
+  uint32_t leftCount, AABB const& rightBounds, uint32_t rightCount)
+{
+  return options.traversalCost + options.intersectionCost *
+    (surfaceArea(leftBounds) * leftCount + surfaceArea(rightBounds) * rightCount) / area;
+}
+
+// Clips the triangle of ref against the plane, both halves stay inside ref.bounds.
+// A half the triangle does not reach comes back with inverted bounds.
+static void splitReference(Mesh const& mesh, BVHTriangleRef const& ref, int axis, float plane,
+  BVHTriangleRef& left, BVHTriangleRef& right)
+{
+  TriangleRef const& tri = mesh.triangles[ref.index];
+  glm::vec3 v[3] = {mesh.vertex_data[tri.v0].pos, mesh.vertex_data[tri.v1].pos,
+    mesh.vertex_data[tri.v2].pos};
+
+  AABB leftBounds = emptyAABB();
+  AABB rightBounds = emptyAABB();
+  for (int i = 0; i < 3; ++i) {
+    glm::vec3 a = v[i];
+    glm::vec3 b = v[(i + 1) % 3];
+
+    if (a[axis] <= plane)
+      leftBounds = growAABB(leftBounds, a);
+    if (a[axis] >= plane)
+      rightBounds = growAABB(rightBounds, a);
+
+    if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+      glm::vec3 p = glm::mix(a, b, (plane - a[axis]) / (b[axis] - a[axis]));
+      p[axis] = plane;
+      leftBounds = growAABB(leftBounds, p);
+      rightBounds = growAABB(rightBounds, p);
+    }
+  }
+
+  // Same padding as whole triangles, flat pieces would be missed by the slab test
+  leftBounds.min -= glm::vec3(EPSILON);
+  leftBounds.max += glm::vec3(EPSILON);
+  rightBounds.min -= glm::vec3(EPSILON);
+  rightBounds.max += glm::vec3(EPSILON);
+
+  left = ref;
+  left.bounds = intersectAABB(leftBounds, ref.bounds);
+  left.bounds.max[axis] = std::min(left.bounds.max[axis], plane);
+
+  right = ref;
+  right.bounds = intersectAABB(rightBounds, ref.bounds);
+  right.bounds.min[axis] = std::max(right.bounds.min[axis], plane);
+}
+
+// Binned SAH over centroids, the same split the SAH builder takes
+static SBVHSplit findObjectSplit(SBVHContext const& ctx, std::vector<BVHTriangleRef> const& refs,
+  AABB const& bounds)
+{
+  BVHBuildOptions const& options = ctx.options;
+  unsigned binCount = sbvhBinCount(options);
+  uint32_t count = refs.size();
+
+  SBVHSplit best = {};
+  best.cost = std::numeric_limits<float>::max();
+
+  float area = surfaceArea(bounds);
+  if (area <= 0.0f)
+    return best;
+
+  AABB centroidBounds = emptyAABB();
+  for (auto const& ref : refs)
+    centroidBounds = growAABB(centroidBounds, centroid(ref.bounds));
+
+  AABB binBounds[MAX_SBVH_BINS];
+  uint32_t binCounts[MAX_SBVH_BINS];
+  AABB rightBounds[MAX_SBVH_BINS];
+  uint32_t rightCounts[MAX_SBVH_BINS];
+
+  for (int axis = X_AXIS; axis <= Z_AXIS; ++axis) {
+    float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+    if (extent <= 0.0f)
+      continue;
+
+    float binScale = binCount / extent;
+    for (unsigned b = 0; b < binCount; ++b) {
+      binBounds[b] = emptyAABB();
+      binCounts[b] = 0;
+    }
+
+    for (auto const& ref : refs) {
+      float c = centroid(ref.bounds)[axis];
+      unsigned b = std::min(static_cast<unsigned>((c - centroidBounds.min[axis]) * binScale), binCount - 1);
+      binBounds[b] = mergeAABB(binBounds[b], ref.bounds);
+      binCounts[b]++;
+    }
+
+    AABB acc = emptyAABB();
+    uint32_t accCount = 0;
+    for (unsigned b = binCount - 1; b > 0; --b) {
+      acc = mergeAABB(acc, binBounds[b]);
+      accCount += binCounts[b];
+      rightBounds[b] = acc;
+      rightCounts[b] = accCount;
+    }
+
+    acc = emptyAABB();
+    accCount = 0;
+    for (unsigned b = 1; b < binCount; ++b) {
+      acc = mergeAABB(acc, binBounds[b - 1]);
+      accCount += binCounts[b - 1];
+      if (accCount == 0 || accCount == count)
+        continue;
+
+      float cost = splitCost(options, area, acc, accCount, rightBounds[b], rightCounts[b]);
+      if (cost < best.cost) {
+        best.valid = true;
+        best.spatial = false;
+        best.axis = axis;
+        best.cost = cost;
+        best.bin = b;
+        best.centroidMin = centroidBounds.min[axis];
+        best.binScale = binScale;
+        best.leftBounds = acc;
+        best.rightBounds = rightBounds[b];
+        best.leftCount = accCount;
+        best.rightCount = rightCounts[b];
+      }
+    }
+  }
+
+  return best;
+}
+
+// Bins clipped pieces of every ref along the node bounds. A ref enters in the
+// bin of its min and exits in the bin of its max, planes in between duplicate it.
+static SBVHSplit findSpatialSplitOnAxis(SBVHContext const& ctx, std::vector<BVHTriangleRef> const& refs,
+  AABB const& bounds, int axis)
+{
+  BVHBuildOptions const& options = ctx.options;
+  unsigned binCount = sbvhBinCount(options);
+  uint32_t count = refs.size();
+
+  SBVHSplit best = {};
+  best.cost = std::numeric_limits<float>::max();
+
+  float area = surfaceArea(bounds);
+  float origin = bounds.min[axis];
+  float binWidth = (bounds.max[axis] - origin) / binCount;
+  if (area <= 0.0f || binWidth <= 0.0f)
+    return best;
+
+  AABB binBounds[MAX_SBVH_BINS];
+  uint32_t enter[MAX_SBVH_BINS];
+  uint32_t exit[MAX_SBVH_BINS];
+  AABB rightBounds[MAX_SBVH_BINS];
+  uint32_t rightCounts[MAX_SBVH_BINS];
+
+  auto binOf = [&](float x) -> unsigned {
+    int b = static_cast<int>((x - origin) / binWidth);
+    return glm::clamp(b, 0, static_cast<int>(binCount) - 1);
+  };
+
+  for (unsigned b = 0; b < binCount; ++b) {
+    binBounds[b] = emptyAABB();
+    enter[b] = 0;
+    exit[b] = 0;
+  }
+
+  for (auto const& ref : refs) {
+    unsigned first = binOf(ref.bounds.min[axis]);
+    unsigned last = binOf(ref.bounds.max[axis]);
+    enter[first]++;
+    exit[last]++;
+
+    BVHTriangleRef piece = ref;
+    for (unsigned b = first; b < last; ++b) {
+      BVHTriangleRef left, right;
+      splitReference(ctx.mesh, piece, axis, origin + binWidth * (b + 1), left, right);
+      if (validAABB(left.bounds))
+        binBounds[b] = mergeAABB(binBounds[b], left.bounds);
+      piece = right;
+    }
+    if (validAABB(piece.bounds))
+      binBounds[last] = mergeAABB(binBounds[last], piece.bounds);
+  }
+
+  AABB acc = emptyAABB();
+  uint32_t accCount = 0;
+  for (unsigned b = binCount - 1; b > 0; --b) {
+    acc = mergeAABB(acc, binBounds[b]);
+    accCount += exit[b];
+    rightBounds[b] = acc;
+    rightCounts[b] = accCount;
+  }
+
+  acc = emptyAABB();
+  accCount = 0;
+  for (unsigned b = 1; b < binCount; ++b) {
+    acc = mergeAABB(acc, binBounds[b - 1]);
+    accCount += enter[b - 1];
+
+    // Both sides have to shrink, or the same refs would be split forever
+    if (accCount == 0 || rightCounts[b] == 0 || accCount >= count || rightCounts[b] >= count)
+      continue;
+
+    float cost = splitCost(options, area, acc, accCount, rightBounds[b], rightCounts[b]);
+    if (cost < best.cost) {
+      best.valid = true;
+      best.spatial = true;
+      best.axis = axis;
+      best.cost = cost;
+      best.position = origin + binWidth * b;
+      best.leftBounds = acc;
+      best.rightBounds = rightBounds[b];
+      best.leftCount = accCount;
+      best.rightCount = rightCounts[b];
+    }
+  }
+
+  return best;
+}
+
+// Clipping dominates the build, large nodes bin the three axes as separate tasks
+static SBVHSplit findSpatialSplit(SBVHContext const& ctx, std::vector<BVHTriangleRef> const& refs,
+  AABB const& bounds)
+{
+  SBVHSplit splits[3];
+  if (ctx.pool && refs.size() >= ctx.options.parallelBinningCutoff) {
+    parallelFor(*ctx.pool, X_AXIS, Z_AXIS + 1, 1, [&](size_t axis, size_t) {
+      splits[axis] = findSpatialSplitOnAxis(ctx, refs, bounds, axis);
+    });
+  } else {
+    for (int axis = X_AXIS; axis <= Z_AXIS; ++axis)
+      splits[axis] = findSpatialSplitOnAxis(ctx, refs, bounds, axis);
+  }
+
+  SBVHSplit best = splits[X_AXIS];
+  for (int axis = Y_AXIS; axis <= Z_AXIS; ++axis)
+    if (splits[axis].valid && (!best.valid || splits[axis].cost < best.cost))
+      best = splits[axis];
+
+  return best;
+}
+
+// Refs crossing the plane are split, unless moving the whole ref to one side
+// is cheaper (reference unsplitting). Returns false if a side ended up empty.
+static bool partitionSpatial(SBVHContext const& ctx, std::vector<BVHTriangleRef> const& refs,
+  SBVHSplit const& split, std::vector<BVHTriangleRef>& leftRefs, std::vector<BVHTriangleRef>& rightRefs)
+{
+  int axis = split.axis;
+  float plane = split.position;
+
+  AABB leftBounds = split.leftBounds;
+  AABB rightBounds = split.rightBounds;
+  float leftCount = split.leftCount;
+  float rightCount = split.rightCount;
+
+  leftRefs.reserve(split.leftCount);
+  rightRefs.reserve(split.rightCount);
+
+  for (auto const& ref : refs) {
+    if (ref.bounds.max[axis] <= plane) {
+      leftRefs.push_back(ref);
+      continue;
+    }
+    if (ref.bounds.min[axis] >= plane) {
+      rightRefs.push_back(ref);
+      continue;
+    }
+
+    BVHTriangleRef left, right;
+    splitReference(ctx.mesh, ref, axis, plane, left, right);
+
+    if (!validAABB(right.bounds)) {
+      leftRefs.push_back(left);
+      continue;
+    }
+    if (!validAABB(left.bounds)) {
+      rightRefs.push_back(right);
+      continue;
+    }
+
+    float leftArea = surfaceArea(leftBounds);
+    float rightArea = surfaceArea(rightBounds);
+    float splitCost = leftArea * leftCount + rightArea * rightCount;
+    float leftOnlyCost = surfaceArea(mergeAABB(leftBounds, ref.bounds)) * leftCount +
+      rightArea * (rightCount - 1);
+    float rightOnlyCost = leftArea * (leftCount - 1) +
+      surfaceArea(mergeAABB(rightBounds, ref.bounds)) * rightCount;
+
+    if (leftOnlyCost < splitCost && leftOnlyCost <= rightOnlyCost) {
+      leftRefs.push_back(ref);
+      leftBounds = mergeAABB(leftBounds, ref.bounds);
+      rightCount--;
+    } else if (rightOnlyCost < splitCost) {
+      rightRefs.push_back(ref);
+      rightBounds = mergeAABB(rightBounds, ref.bounds);
+      leftCount--;
+    } else {
+      leftRefs.push_back(left);
+      rightRefs.push_back(right);
+    }
+  }
+
+  return !leftRefs.empty() && !rightRefs.empty() &&
+    leftRefs.size() < refs.size() && rightRefs.size() < refs.size();
+}
+
+static void partitionObject(std::vector<BVHTriangleRef> const& refs, SBVHSplit const& split,
+  unsigned binCount, std::vector<BVHTriangleRef>& leftRefs, std::vector<BVHTriangleRef>& rightRefs)
+{
+  leftRefs.reserve(split.leftCount);
+  rightRefs.reserve(split.rightCount);
+
+  for (auto const& ref : refs) {
+    float c = centroid(ref.bounds)[split.axis];
+    unsigned b = std::min(static_cast<unsigned>((c - split.centroidMin) * split.binScale), binCount - 1);
+    if (b < split.bin)
+      leftRefs.push_back(ref);
+    else
+      rightRefs.push_back(ref);
+  }
+}
+
+// Reserves duplicates from the budget, all or nothing
+static bool reserveRefs(SBVHContext& ctx, size_t extra)
+{
+  size_t current = ctx.refCount.load();
+  do {
+    if (current + extra > ctx.refLimit)
+      return false;
+  } while (!ctx.refCount.compare_exchange_weak(current, current + extra));
+
+  return true;
+}
+
+static AABB refsBounds(std::vector<BVHTriangleRef> const& refs)
+{
+  AABB bounds = emptyAABB();
+  for (auto const& ref : refs)
+    bounds = mergeAABB(bounds, ref.bounds);
+  return bounds;
+}
+
+static void buildSBVHRange(SBVHContext& ctx, BVHBuildNode* node, std::vector<BVHTriangleRef>& refs,
+  AABB const& bounds)
+{
+  BVHBuildOptions const& options = ctx.options;
+  uint32_t count = refs.size();
+
+  SBVHSplit split = {};
+  if (count > 1) {
+    split = findObjectSplit(ctx, refs, bounds);
+
+    // Spatial splits only pay off where the object split children overlap a lot
+    float overlap = split.valid ?
+      surfaceArea(intersectAABB(split.leftBounds, split.rightBounds)) : std::numeric_limits<float>::max();
+    if (overlap > options.spatialSplitAlpha * ctx.rootArea && ctx.refCount.load() < ctx.refLimit) {
+      SBVHSplit spatial = findSpatialSplit(ctx, refs, bounds);
+      if (spatial.valid && spatial.cost < split.cost)
+        split = spatial;
+    }
+  }
+
+  float leafCost = options.intersectionCost * count;
+  bool makeLeaf = count <= 1 ||
+    (count <= options.maxLeafSize && (!split.valid || leafCost <= split.cost));
+
+  std::vector<BVHTriangleRef> leftRefs, rightRefs;
+  if (!makeLeaf && split.valid && split.spatial) {
+    size_t reserved = split.leftCount + split.rightCount - count;
+    bool reservedOk = reserveRefs(ctx, reserved);
+    if (!reservedOk || !partitionSpatial(ctx, refs, split, leftRefs, rightRefs)) {
+      if (reservedOk)
+        ctx.refCount.fetch_sub(reserved);
+      leftRefs.clear();
+      rightRefs.clear();
+      split = findObjectSplit(ctx, refs, bounds);
+    } else {
+      // Unsplitting may have saved some of the reserved duplicates
+      size_t used = leftRefs.size() + rightRefs.size() - count;
+      if (used < reserved)
+        ctx.refCount.fetch_sub(reserved - used);
+      else
+        ctx.refCount.fetch_add(used - reserved);
+    }
+  }
+
+  if (makeLeaf) {
+    node->isLeaf = true;
+    node->leftBounds = bounds;
+
+    std::lock_guard<std::mutex> lock(ctx.leafMutex);
+    node->refBegin = ctx.leafRefs.size();
+    ctx.leafRefs.insert(ctx.leafRefs.end(), refs.begin(), refs.end());
+    node->refEnd = ctx.leafRefs.size();
+
+    return;
+  }
+
+  if (leftRefs.empty()) {
+    if (split.valid && !split.spatial) {
+      partitionObject(refs, split, sbvhBinCount(options), leftRefs, rightRefs);
+    } else {
+      // Median split when nothing else separates the refs
+      int axis = 0;
+      glm::vec3 extent = bounds.max - bounds.min;
+      if (extent.y > extent[axis]) axis = 1;
+      if (extent.z > extent[axis]) axis = 2;
+
+      std::nth_element(refs.begin(), refs.begin() + count / 2, refs.end(),
+        [&](BVHTriangleRef const& ref0, BVHTriangleRef const& ref1) -> bool {
+          return centroid(ref0.bounds)[axis] < centroid(ref1.bounds)[axis];
+        });
+      leftRefs.assign(refs.begin(), refs.begin() + count / 2);
+      rightRefs.assign(refs.begin() + count / 2, refs.end());
+    }
+  }
+
+  // The children own their refs from here on
+  std::vector<BVHTriangleRef>().swap(refs);
+
+  node->isLeaf = false;
+  node->leftBounds = refsBounds(leftRefs);
+  node->rightBounds = refsBounds(rightRefs);
+
+  node->left = ctx.arena.create<BVHBuildNode>(2);
+  node->right = node->left + 1;
+
+  BVHBuildNode* left = node->left;
+  AABB leftBounds = node->leftBounds;
+  if (ctx.pool && count >= options.parallelCutoff) {
+    ctx.group->run([&ctx, left, leftRefs = std::move(leftRefs), leftBounds]() mutable {
+      buildSBVHRange(ctx, left, leftRefs, leftBounds);
+    });
+  } else {
+    buildSBVHRange(ctx, left, leftRefs, leftBounds);
+  }
+
+  buildSBVHRange(ctx, node->right, rightRefs, node->rightBounds);
+}
+
+// Leaves finish in any order, refList gets their refs in DFS order
+static void gatherLeafRefs(BVHBuildNode* node, std::vector<BVHTriangleRef> const& leafRefs,
+  std::vector<BVHTriangleRef>& refList)
+{
+  if (!node->isLeaf) {
+    gatherLeafRefs(node->left, leafRefs, refList);
+    gatherLeafRefs(node->right, leafRefs, refList);
+    return;
+  }
+
+  uint32_t begin = refList.size();
+  refList.insert(refList.end(), leafRefs.begin() + node->refBegin, leafRefs.begin() + node->refEnd);
+  node->refBegin = begin;
+  node->refEnd = refList.size();
+}
+
+BVHBuildNode* buildBVHNodeSBVH(std::vector<BVHTriangleRef>& refList, Mesh const& mesh,
+  BVHBuildOptions const& options, Arena& arena)
+{
+  ThreadPool* pool = options.parallel ? &defaultThreadPool() : nullptr;
+  std::optional<TaskGroup> group;
+  if (pool)
+    group.emplace(*pool);
+
+  SBVHContext ctx(mesh, options, pool, group ? &*group : nullptr, arena);
+
+  AABB bounds = refsBounds(refList);
+  size_t budget = static_cast<size_t>(refList.size() * std::max(options.spatialSplitBudget, 0.0f));
+  ctx.rootArea = surfaceArea(bounds);
+  ctx.refLimit = refList.size() + budget;
+  ctx.refCount = refList.size();
+  ctx.leafRefs.reserve(ctx.refLimit);
+
+  auto root = arena.create<BVHBuildNode>();
+  std::vector<BVHTriangleRef> refs;
+  refs.swap(refList);
+  buildSBVHRange(ctx, root, refs, bounds);
+
+  if (group)
+    group->wait();
+
+  refList.reserve(ctx.leafRefs.size());
+  gatherLeafRefs(root, ctx.leafRefs, refList);
+
+  return root;
+}
@@ -0,0 +1,368 @@
+#include <scene.hpp>
+#include <refit.hpp>
+
+static glm::mat4 toGLM(aiMatrix4x4 const& m)
+{
+	// Assimp is row major, glm column major
+	glm::mat4 result;
+	for (int row = 0; row < 4; ++row)
+		for (int col = 0; col < 4; ++col)
+			result[col][row] = m[row][col];
+	return result;
+}
+
+static void addNodeInstances(aiNode const* node, glm::mat4 const& parent, Scene& scene)
+{
+	glm::mat4 transform = parent * toGLM(node->mTransformation);
+
+	for (unsigned i = 0; i < node->mNumMeshes; ++i)
+		scene.instances.emplace_back(transform, node->mMeshes[i]);
+
+	for (unsigned i = 0; i < node->mNumChildren; ++i)
+		addNodeInstances(node->mChildren[i], transform, scene);
+}
+
+std::optional<Scene> loadScene(std::string const& path)
+{
+	Assimp::Importer importer;
+	const aiScene* aScene = importer.ReadFile(path, aiProcess_Triangulate |
+		aiProcess_FlipUVs |
+		aiProcess_GenNormals);
+
+	if (!aScene || aScene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !aScene->mRootNode) {
+		std::cerr << "Failed to open scene: " + path + "; " + importer.GetErrorString() + "\n";
+		return {};
+	}
+
+	Scene scene;
+	for (unsigned i = 0; i < aScene->mNumMeshes; ++i)
+		scene.meshes.push_back(meshFromAssimp(aScene->mMeshes[i]));
+
+	addNodeInstances(aScene->mRootNode, glm::mat4(1.0f), scene);
+
+	if (scene.instances.empty()) {
+		std::cerr << "Scene has no mesh instances: " + path + "\n";
+		return {};
+	}
+
+	return scene;
+}
+
+Scene singleMeshScene(Mesh const& mesh)
+{
+	Scene scene;
+	scene.meshes.push_back(mesh);
+	scene.instances.emplace_back(glm::mat4(1.0f), 0);
+	return scene;
+}
+
+AABB meshBounds(Mesh const& mesh)
+{
+	AABB bounds = emptyAABB();
+	for (auto const& vertex : mesh.vertex_data) {
+		bounds.min = glm::min(bounds.min, vertex.pos);
+		bounds.max = glm::max(bounds.max, vertex.pos);
+	}
+	return bounds;
+}
+
+AABB transformAABB(AABB const& bounds, glm::mat4 const& transform)
+{
+	AABB result = emptyAABB();
+	for (int corner = 0; corner < 8; ++corner) {
+		glm::vec3 p((corner & 1) ? bounds.max.x : bounds.min.x,
+			(corner & 2) ? bounds.max.y : bounds.min.y,
+			(corner & 4) ? bounds.max.z : bounds.min.z);
+		glm::vec3 world = glm::vec3(transform * glm::vec4(p, 1.0f));
+
+		result.min = glm::min(result.min, world);
+		result.max = glm::max(result.max, world);
+	}
+	return result;
+}
+
+AABB sceneBounds(Scene const& scene)
+{
+	std::vector<AABB> bounds;
+	for (auto const& mesh : scene.meshes)
+		bounds.push_back(meshBounds(mesh));
+
+	AABB result = emptyAABB();
+	for (auto const& instance : scene.instances)
+		result = mergeAABB(result, transformAABB(bounds[instance.mesh], instance.transform));
+	return result;
+}
+
+static BVH buildMeshBVH(Mesh const& mesh, BVHBuildOptions const& options, Arena& arena)
+{
+	BVH bvh;
+	bvh.refList = buildTriangleRefList(mesh.triangles, mesh.vertex_data);
+	arena.reset();
+	BVHBuildNode* buildNode = buildBVHNode(bvh.refList, mesh, options, arena);
+	buildBVH(buildNode, bvh);
+	bvh.triangleList = buildTriangleList(bvh.refList, mesh.triangles, mesh.vertex_data);
+	if (options.nodeLayout == CACHE_OBLIVIOUS_LAYOUT)
+		orderBVHChildren(bvh);
+	return bvh;
+}
+
+TwoLevelBVH buildTwoLevelBVH(Scene const& scene, BVHBuildOptions const& options, BVHNodeFormat format,
+	Arena& arena)
+{
+	TwoLevelBVH accel;
+	accel.format = format;
+
+	// Quantized leaves must fit their 16 bit counts
+	BVHBuildOptions meshOptions = format == QUANTIZED4_NODES ? quantizedBuildOptions(options) : options;
+
+	// Filled before any tree is made, the trees keep pointers into it
+	for (auto const& mesh : scene.meshes) {
+		accel.meshBVHs.push_back(buildMeshBVH(mesh, meshOptions, arena));
+		accel.builtCosts.push_back(bvhSAHCost(accel.meshBVHs.back(), meshOptions));
+	}
+
+	for (auto const& bvh : accel.meshBVHs)
+		accel.meshTrees.push_back(makeTraversalBVH(bvh, format, options.nodeLayout));
+
+	buildTopLevelBVH(accel, scene, options, arena);
+
+	return accel;
+}
+
+void rebuildMeshBVH(TwoLevelBVH& accel, Scene const& scene, uint32_t mesh, BVHBuildOptions const& options,
+	Arena& arena)
+{
+	BVHBuildOptions meshOptions = accel.format == QUANTIZED4_NODES ? quantizedBuildOptions(options) : options;
+	accel.meshBVHs[mesh] = buildMeshBVH(scene.meshes[mesh], meshOptions, arena);
+	accel.builtCosts[mesh] = bvhSAHCost(accel.meshBVHs[mesh], meshOptions);
+	accel.meshTrees[mesh] = makeTraversalBVH(accel.meshBVHs[mesh], accel.format, options.nodeLayout);
+}
+
+static glm::vec4 matrixRow(glm::mat4 const& m, int row)
+{
+	return glm::vec4(m[0][row], m[1][row], m[2][row], m[3][row]);
+}
+
+void buildTopLevelBVH(TwoLevelBVH& accel, Scene const& scene, BVHBuildOptions const& options, Arena& arena)
+{
+	accel.nodeOffsets.clear();
+	accel.triangleOffsets.clear();
+	accel.nodeCount = 0;
+	accel.triangleCount = 0;
+
+	std::vector<AABB> bounds;
+	for (size_t i = 0; i < accel.meshBVHs.size(); ++i) {
+		accel.nodeOffsets.push_back(accel.nodeCount);
+		accel.triangleOffsets.push_back(accel.triangleCount);
+		accel.nodeCount += accel.meshTrees[i].nodeCount();
+		accel.triangleCount += accel.meshBVHs[i].triangleList.size();
+
+		bounds.push_back(refListBounds(accel.meshBVHs[i].refList));
+	}
+
+	// The instances take the place of triangles, index is the instance
+	BVH& topLevel = accel.topLevel;
+	topLevel = BVH();
+	topLevel.refList.resize(scene.instances.size());
+	for (size_t i = 0; i < scene.instances.size(); ++i) {
+		MeshInstance const& instance = scene.instances[i];
+		topLevel.refList[i].bounds = transformAABB(bounds[instance.mesh], instance.transform);
+		topLevel.refList[i].index = i;
+	}
+
+	// Instances are expensive to enter, always worth the SAH
+	BVHBuildOptions topOptions = options;
+	topOptions.maxLeafSize = 2;
+	arena.reset();
+	BVHBuildNode* buildNode = buildBVHNodeSAH(topLevel.refList, topOptions, arena);
+	buildBVH(buildNode, topLevel);
+
+	accel.instanceList.resize(topLevel.refList.size());
+	for (size_t i = 0; i < topLevel.refList.size(); ++i) {
+		uint32_t index = topLevel.refList[i].index;
+		MeshInstance const& instance = scene.instances[index];
+		glm::mat4 worldToMesh = glm::inverse(instance.transform);
+
+		BVHInstance& record = accel.instanceList[i];
+		for (int row = 0; row < 3; ++row)
+			record.worldToMesh[row] = matrixRow(worldToMesh, row);
+		record.nodeOffset = accel.nodeOffsets[instance.mesh];
+		record.triangleOffset = accel.triangleOffsets[instance.mesh];
+		record.mesh = instance.mesh;
+		record.index = index;
+	}
+}
+
+Ray instanceRay(BVHInstance const& instance, Ray const& r)
+{
+	glm::vec4 o(r.o, 1.0f);
+	glm::vec4 d(r.d, 0.0f);
+	return {glm::vec3(glm::dot(instance.worldToMesh[0], o), glm::dot(instance.worldToMesh[1], o),
+			glm::dot(instance.worldToMesh[2], o)),
+		glm::vec3(glm::dot(instance.worldToMesh[0], d), glm::dot(instance.worldToMesh[1], d),
+			glm::dot(instance.worldToMesh[2], d))};
+}
+
+// Traces the instances of a top level leaf, hits have to be nearer than hit.t
+static bool traceLeafInstances(TwoLevelBVH const& accel, BVHNode const& leaf, Ray const& r, RayHit& hit,
+	uint32_t& hitInstance, TraversalStats& stats, TraversalOrder order)
+{
+	bool found = false;
+	for (int32_t i = leaf.isLeafBegin; i < leaf.rightOffsetEnd; ++i) {
+		BVHInstance const& instance = accel.instanceList[i];
+		RayHit instanceHit;
+		if (traceRay(accel.meshTrees[instance.mesh], instanceRay(instance, r), hit.t, instanceHit, &stats, order)) {
+			hit = instanceHit;
+			hitInstance = instance.index;
+			found = true;
+		}
+	}
+	return found;
+}
+
+bool traceRay(TwoLevelBVH const& accel, Ray const& r, RayHit& hit, uint32_t& hitInstance,
+	TraversalStats* stats, TraversalOrder order)
+{
+	TraversalStats local;
+	bool found = false;
+	hit.t = std::numeric_limits<float>::max();
+
+	BVH const& topLevel = accel.topLevel;
+	if (topLevel.nodeList.empty())
+		return false;
+
+	glm::vec3 inv = 1.0f / r.d;
+
+	// The binary walks of traverse.cpp, leaves trace their instances
+	TraversalStack<uint32_t> indexStack;
+	TraversalStack<float> entryStack;
+	int stackIndex = 0;
+	indexStack[0] = 0;
+
+	uint32_t index = 0;
+	if (order == FIXED_ORDER) {
+		while (stackIndex != -1) {
+			BVHNode const& node = topLevel.nodeList[index];
+			local.nodesVisited++;
+
+			if (node.isLeafBegin >= 0) {
+				if (traceLeafInstances(accel, node, r, hit, hitInstance, local, order))
+					found = true;
+
+				index = indexStack[stackIndex--];
+			} else {
+				bool r1 = intersectBox(node.leftBounds, r, inv);
+				bool r2 = intersectBox(node.rightBounds, r, inv);
+				local.boxTests += 2;
+
+				if (!r1 && !r2) {
+					index = indexStack[stackIndex--];
+				} else if (r1) {
+					if (r2) indexStack[++stackIndex] = node.rightOffsetEnd;
+					index++;
+				} else {
+					index = node.rightOffsetEnd;
+				}
+			}
+		}
+	} else {
+		stackIndex = -1;
+		for (;;) {
+			BVHNode const& node = topLevel.nodeList[index];
+			local.nodesVisited++;
+
+			if (node.isLeafBegin >= 0) {
+				if (traceLeafInstances(accel, node, r, hit, hitInstance, local, order))
+					found = true;
+			} else {
+				float left = intersectBoxEntry(node.leftBounds, r, inv, hit.t);
+				float right = intersectBoxEntry(node.rightBounds, r, inv, hit.t);
+				local.boxTests += 2;
+
+				if (left < hit.t && right < hit.t) {
+					bool rightFirst = right < left;
+					indexStack[++stackIndex] = rightFirst ? index + 1 : node.rightOffsetEnd;
+					entryStack[stackIndex] = rightFirst ? left : right;
+					index = rightFirst ? node.rightOffsetEnd : index + 1;
+					continue;
+				} else if (left < hit.t) {
+					index++;
+					continue;
+				} else if (right < hit.t) {
+					index = node.rightOffsetEnd;
+					continue;
+				}
+			}
+
+			while (stackIndex >= 0 && entryStack[stackIndex] >= hit.t)
+				stackIndex--;
+			if (stackIndex < 0)
+				break;
+			index = indexStack[stackIndex--];
+		}
+	}
+
+	if (stats) {
+		stats->nodesVisited += local.nodesVisited;
+		stats->boxTests += local.boxTests;
+		stats->triangleTests += local.triangleTests;
+		stats->nodeJumpBytes += local.nodeJumpBytes;
+		stats->pageJumps += local.pageJumps;
+	}
+
+	return found;
+}
+
+bool occluded(TwoLevelBVH const& accel, Ray const& r, float tmin, float tmax, TraversalStats* stats)
+{
+	TraversalStats local;
+	bool hit = false;
+
+	BVH const& topLevel = accel.topLevel;
+	if (topLevel.nodeList.empty())
+		return false;
+
+	glm::vec3 inv = 1.0f / r.d;
+
+	TraversalStack<uint32_t> indexStack;
+	int stackIndex = 0;
+	indexStack[0] = 0;
+
+	uint32_t index = 0;
+	while (stackIndex != -1 && !hit) {
+		BVHNode const& node = topLevel.nodeList[index];
+		local.nodesVisited++;
+
+		if (node.isLeafBegin >= 0) {
+			for (int32_t i = node.isLeafBegin; i < node.rightOffsetEnd && !hit; ++i) {
+				BVHInstance const& instance = accel.instanceList[i];
+				hit = occluded(accel.meshTrees[instance.mesh], instanceRay(instance, r), tmin, tmax, &local);
+			}
+
+			index = indexStack[stackIndex--];
+		} else {
+			bool r1 = intersectSegment(node.leftBounds, r, inv, tmin, tmax);
+			bool r2 = intersectSegment(node.rightBounds, r, inv, tmin, tmax);
+			local.boxTests += 2;
+
+			if (!r1 && !r2) {
+				index = indexStack[stackIndex--];
+			} else if (r1) {
+				if (r2) indexStack[++stackIndex] = node.rightOffsetEnd;
+				index++;
+			} else {
+				index = node.rightOffsetEnd;
+			}
+		}
+	}
+
+	if (stats) {
+		stats->nodesVisited += local.nodesVisited;
+		stats->boxTests += local.boxTests;
+		stats->triangleTests += local.triangleTests;
+		stats->nodeJumpBytes += local.nodeJumpBytes;
+		stats->pageJumps += local.pageJumps;
+	}
+
+	return hit;
+}
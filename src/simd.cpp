@@ -0,0 +1,556 @@
+#include <simd.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VRT_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// AVX-512F brings FMA along, contracting mul and add would round differently than the scalar code
+#define VRT_TARGET_AVX2 __attribute__((target("avx2")))
+#define VRT_TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+
+SoATriangles makeSoATriangles(std::vector<BVHTriangle> const& triangleList)
+{
+	SoATriangles triangles;
+	triangles.count = triangleList.size();
+
+	size_t padded = triangleList.size() + SIMD_MAX_LANES;
+	for (auto* component : {&triangles.v0x, &triangles.v0y, &triangles.v0z,
+		&triangles.e1x, &triangles.e1y, &triangles.e1z,
+		&triangles.e2x, &triangles.e2y, &triangles.e2z})
+		component->assign(padded, 0.0f);
+	triangles.index.assign(padded, 0);
+
+	for (size_t i = 0; i < triangleList.size(); ++i) {
+		BVHTriangle const& tri = triangleList[i];
+		triangles.v0x[i] = tri.v0.x;
+		triangles.v0y[i] = tri.v0.y;
+		triangles.v0z[i] = tri.v0.z;
+		triangles.e1x[i] = tri.e1.x;
+		triangles.e1y[i] = tri.e1.y;
+		triangles.e1z[i] = tri.e1.z;
+		triangles.e2x[i] = tri.e2.x;
+		triangles.e2y[i] = tri.e2.y;
+		triangles.e2z[i] = tri.e2.z;
+		triangles.index[i] = tri.index;
+	}
+
+	return triangles;
+}
+
+SoABoxes nodeBoxes(QuantizedBVHNode const& node, DequantizedBoxes& decoded)
+{
+	glm::vec3 origin(node.origin[0], node.origin[1], node.origin[2]);
+	glm::vec3 scale(quantizedScale(node.exponent[0]), quantizedScale(node.exponent[1]),
+		quantizedScale(node.exponent[2]));
+
+	for (unsigned i = 0; i < 4; ++i) {
+		decoded.minX[i] = dequantize(origin.x, scale.x, node.qminX[i]);
+		decoded.minY[i] = dequantize(origin.y, scale.y, node.qminY[i]);
+		decoded.minZ[i] = dequantize(origin.z, scale.z, node.qminZ[i]);
+		decoded.maxX[i] = dequantize(origin.x, scale.x, node.qmaxX[i]);
+		decoded.maxY[i] = dequantize(origin.y, scale.y, node.qmaxY[i]);
+		decoded.maxZ[i] = dequantize(origin.z, scale.z, node.qmaxZ[i]);
+	}
+
+	return {decoded.minX, decoded.minY, decoded.minZ, decoded.maxX, decoded.maxY, decoded.maxZ, 4};
+}
+
+RayPacket makeRayPacket(Ray const* rays, uint32_t count)
+{
+	RayPacket packet = {};
+	packet.count = std::min(count, SIMD_MAX_LANES);
+
+	for (uint32_t i = 0; i < packet.count; ++i) {
+		glm::vec3 inv = 1.0f / rays[i].d;
+		packet.ox[i] = rays[i].o.x;
+		packet.oy[i] = rays[i].o.y;
+		packet.oz[i] = rays[i].o.z;
+		packet.invX[i] = inv.x;
+		packet.invY[i] = inv.y;
+		packet.invZ[i] = inv.z;
+		packet.tmax[i] = std::numeric_limits<float>::max();
+	}
+
+	return packet;
+}
+
+static uint32_t laneMask(uint32_t count)
+{
+	return count >= 32 ? ~0u : (1u << count) - 1;
+}
+
+// Takes the hit lanes in order, so ties go to the first triangle like the scalar loop
+static bool closestLane(uint32_t lanes, float const* t, float const* u, float const* v, uint32_t base,
+	SoATriangles const& triangles, RayHit& hit)
+{
+	bool found = false;
+	for (; lanes; lanes &= lanes - 1) {
+		uint32_t lane = __builtin_ctz(lanes);
+		if (t[lane] < hit.t) {
+			hit = {t[lane], triangles.index[base + lane], u[lane], v[lane]};
+			found = true;
+		}
+	}
+	return found;
+}
+
+static bool intersectTrianglesScalar(SoATriangles const& triangles, uint32_t begin, uint32_t end, Ray const& r,
+	RayHit& hit)
+{
+	bool found = false;
+	for (uint32_t i = begin; i < end; ++i) {
+		BVHTriangle tri;
+		tri.v0 = glm::vec3(triangles.v0x[i], triangles.v0y[i], triangles.v0z[i]);
+		tri.e1 = glm::vec3(triangles.e1x[i], triangles.e1y[i], triangles.e1z[i]);
+		tri.e2 = glm::vec3(triangles.e2x[i], triangles.e2y[i], triangles.e2z[i]);
+		tri.index = triangles.index[i];
+
+		if (intersectBVHTriangle(tri, r, hit))
+			found = true;
+	}
+	return found;
+}
+
+static uint32_t intersectBoxesScalar(SoABoxes const& boxes, Ray const& r, glm::vec3 const& inv)
+{
+	uint32_t hits = 0;
+	for (uint32_t i = 0; i < boxes.count; ++i)
+		if (intersectSlabs(boxes.minX[i], boxes.minY[i], boxes.minZ[i],
+			boxes.maxX[i], boxes.maxY[i], boxes.maxZ[i], r, inv))
+			hits |= 1u << i;
+	return hits;
+}
+
+static uint32_t intersectPacketScalar(AABB const& box, RayPacket const& packet)
+{
+	uint32_t hits = 0;
+	for (uint32_t i = 0; i < packet.count; ++i) {
+		Ray r;
+		r.o = glm::vec3(packet.ox[i], packet.oy[i], packet.oz[i]);
+		glm::vec3 inv(packet.invX[i], packet.invY[i], packet.invZ[i]);
+
+		glm::vec3 t0 = (box.min - r.o) * inv;
+		glm::vec3 t1 = (box.max - r.o) * inv;
+
+		glm::vec3 vmin = glm::min(t0, t1);
+		glm::vec3 vmax = glm::max(t0, t1);
+
+		float tmin = std::max(vmin.x, std::max(vmin.y, vmin.z));
+		float tmax = std::min(vmax.x, std::min(vmax.y, vmax.z));
+
+		if (tmin < tmax && tmin < packet.tmax[i])
+			hits |= 1u << i;
+	}
+	return hits;
+}
+
+#ifdef VRT_SIMD_X86
+
+// The vector kernels follow the scalar code operation by operation. std::min(a, b)
+// is min_ps(b, a) and std::max(a, b) is max_ps(b, a), which keeps NaN lanes
+// (origin on a slab plane of an axis parallel ray) deciding the same way.
+
+// Boxes past count are read from a zeroed copy instead of past the arrays
+static float const* boxLanes(float const* values, uint32_t base, uint32_t count, uint32_t lanes, float* scratch)
+{
+	if (base + lanes <= count)
+		return values + base;
+
+	for (uint32_t i = 0; i < lanes; ++i)
+		scratch[i] = base + i < count ? values[base + i] : 0.0f;
+	return scratch;
+}
+
+static bool intersectTrianglesSSE(SoATriangles const& triangles, uint32_t begin, uint32_t end, Ray const& r,
+	RayHit& hit)
+{
+	__m128 ox = _mm_set1_ps(r.o.x), oy = _mm_set1_ps(r.o.y), oz = _mm_set1_ps(r.o.z);
+	__m128 dx = _mm_set1_ps(r.d.x), dy = _mm_set1_ps(r.d.y), dz = _mm_set1_ps(r.d.z);
+	__m128 epsilon = _mm_set1_ps(EPSILON);
+	__m128 one = _mm_set1_ps(1.0f);
+
+	bool found = false;
+	for (uint32_t base = begin; base < end; base += 4) {
+		__m128 v0x = _mm_loadu_ps(&triangles.v0x[base]);
+		__m128 v0y = _mm_loadu_ps(&triangles.v0y[base]);
+		__m128 v0z = _mm_loadu_ps(&triangles.v0z[base]);
+		__m128 e1x = _mm_loadu_ps(&triangles.e1x[base]);
+		__m128 e1y = _mm_loadu_ps(&triangles.e1y[base]);
+		__m128 e1z = _mm_loadu_ps(&triangles.e1z[base]);
+		__m128 e2x = _mm_loadu_ps(&triangles.e2x[base]);
+		__m128 e2y = _mm_loadu_ps(&triangles.e2y[base]);
+		__m128 e2z = _mm_loadu_ps(&triangles.e2z[base]);
+
+		// pvec = cross(d, e2), tvec = o - v0, qvec = cross(tvec, e1)
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+		__m128 tx = _mm_sub_ps(ox, v0x);
+		__m128 ty = _mm_sub_ps(oy, v0y);
+		__m128 tz = _mm_sub_ps(oz, v0z);
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(e1y, tz));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(e1z, tx));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(e1x, ty));
+
+		__m128 det = _mm_div_ps(one, _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, e1x), _mm_mul_ps(py, e1y)),
+			_mm_mul_ps(pz, e1z)));
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)),
+			_mm_mul_ps(tz, pz)), det);
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+			_mm_mul_ps(dz, qz)), det);
+		__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+			_mm_mul_ps(e2z, qz)), det);
+
+		__m128 valid = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(t, epsilon), _mm_cmpge_ps(u, epsilon)),
+			_mm_and_ps(_mm_cmpge_ps(v, epsilon), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+		valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(hit.t)));
+
+		uint32_t lanes = _mm_movemask_ps(valid) & laneMask(end - base);
+		if (lanes) {
+			alignas(16) float ts[4], us[4], vs[4];
+			_mm_store_ps(ts, t);
+			_mm_store_ps(us, u);
+			_mm_store_ps(vs, v);
+			found |= closestLane(lanes, ts, us, vs, base, triangles, hit);
+		}
+	}
+
+	return found;
+}
+
+static uint32_t intersectBoxesSSE(SoABoxes const& boxes, Ray const& r, glm::vec3 const& inv)
+{
+	__m128 ox = _mm_set1_ps(r.o.x), oy = _mm_set1_ps(r.o.y), oz = _mm_set1_ps(r.o.z);
+	__m128 ix = _mm_set1_ps(inv.x), iy = _mm_set1_ps(inv.y), iz = _mm_set1_ps(inv.z);
+	alignas(16) float scratch[6][4];
+
+	uint32_t hits = 0;
+	for (uint32_t base = 0; base < boxes.count; base += 4) {
+		__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(boxLanes(boxes.minX, base, boxes.count, 4, scratch[0])), ox), ix);
+		__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(boxLanes(boxes.minY, base, boxes.count, 4, scratch[1])), oy), iy);
+		__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(boxLanes(boxes.minZ, base, boxes.count, 4, scratch[2])), oz), iz);
+		__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(boxLanes(boxes.maxX, base, boxes.count, 4, scratch[3])), ox), ix);
+		__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(boxLanes(boxes.maxY, base, boxes.count, 4, scratch[4])), oy), iy);
+		__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(boxLanes(boxes.maxZ, base, boxes.count, 4, scratch[5])), oz), iz);
+
+		__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1z, t0z), _mm_min_ps(t1y, t0y)), _mm_min_ps(t1x, t0x));
+		__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1z, t0z), _mm_max_ps(t1y, t0y)), _mm_max_ps(t1x, t0x));
+
+		hits |= uint32_t(_mm_movemask_ps(_mm_cmplt_ps(tmin, tmax))) << base;
+	}
+
+	return hits & laneMask(boxes.count);
+}
+
+static uint32_t intersectPacketSSE(AABB const& box, RayPacket const& packet)
+{
+	__m128 minX = _mm_set1_ps(box.min.x), minY = _mm_set1_ps(box.min.y), minZ = _mm_set1_ps(box.min.z);
+	__m128 maxX = _mm_set1_ps(box.max.x), maxY = _mm_set1_ps(box.max.y), maxZ = _mm_set1_ps(box.max.z);
+
+	uint32_t hits = 0;
+	for (uint32_t base = 0; base < packet.count; base += 4) {
+		__m128 ox = _mm_load_ps(&packet.ox[base]), oy = _mm_load_ps(&packet.oy[base]), oz = _mm_load_ps(&packet.oz[base]);
+		__m128 ix = _mm_load_ps(&packet.invX[base]), iy = _mm_load_ps(&packet.invY[base]), iz = _mm_load_ps(&packet.invZ[base]);
+
+		__m128 t0x = _mm_mul_ps(_mm_sub_ps(minX, ox), ix);
+		__m128 t0y = _mm_mul_ps(_mm_sub_ps(minY, oy), iy);
+		__m128 t0z = _mm_mul_ps(_mm_sub_ps(minZ, oz), iz);
+		__m128 t1x = _mm_mul_ps(_mm_sub_ps(maxX, ox), ix);
+		__m128 t1y = _mm_mul_ps(_mm_sub_ps(maxY, oy), iy);
+		__m128 t1z = _mm_mul_ps(_mm_sub_ps(maxZ, oz), iz);
+
+		__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1z, t0z), _mm_min_ps(t1y, t0y)), _mm_min_ps(t1x, t0x));
+		__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1z, t0z), _mm_max_ps(t1y, t0y)), _mm_max_ps(t1x, t0x));
+
+		__m128 hit = _mm_and_ps(_mm_cmplt_ps(tmin, tmax), _mm_cmplt_ps(tmin, _mm_load_ps(&packet.tmax[base])));
+		hits |= uint32_t(_mm_movemask_ps(hit)) << base;
+	}
+
+	return hits & laneMask(packet.count);
+}
+
+VRT_TARGET_AVX2
+static bool intersectTrianglesAVX2(SoATriangles const& triangles, uint32_t begin, uint32_t end, Ray const& r,
+	RayHit& hit)
+{
+	__m256 ox = _mm256_set1_ps(r.o.x), oy = _mm256_set1_ps(r.o.y), oz = _mm256_set1_ps(r.o.z);
+	__m256 dx = _mm256_set1_ps(r.d.x), dy = _mm256_set1_ps(r.d.y), dz = _mm256_set1_ps(r.d.z);
+	__m256 epsilon = _mm256_set1_ps(EPSILON);
+	__m256 one = _mm256_set1_ps(1.0f);
+
+	bool found = false;
+	for (uint32_t base = begin; base < end; base += 8) {
+		__m256 v0x = _mm256_loadu_ps(&triangles.v0x[base]);
+		__m256 v0y = _mm256_loadu_ps(&triangles.v0y[base]);
+		__m256 v0z = _mm256_loadu_ps(&triangles.v0z[base]);
+		__m256 e1x = _mm256_loadu_ps(&triangles.e1x[base]);
+		__m256 e1y = _mm256_loadu_ps(&triangles.e1y[base]);
+		__m256 e1z = _mm256_loadu_ps(&triangles.e1z[base]);
+		__m256 e2x = _mm256_loadu_ps(&triangles.e2x[base]);
+		__m256 e2y = _mm256_loadu_ps(&triangles.e2y[base]);
+		__m256 e2z = _mm256_loadu_ps(&triangles.e2z[base]);
+
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+		__m256 tx = _mm256_sub_ps(ox, v0x);
+		__m256 ty = _mm256_sub_ps(oy, v0y);
+		__m256 tz = _mm256_sub_ps(oz, v0z);
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(e1y, tz));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(e1z, tx));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(e1x, ty));
+
+		__m256 det = _mm256_div_ps(one, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, e1x), _mm256_mul_ps(py, e1y)),
+			_mm256_mul_ps(pz, e1z)));
+		__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+			_mm256_mul_ps(tz, pz)), det);
+		__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+			_mm256_mul_ps(dz, qz)), det);
+		__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+			_mm256_mul_ps(e2z, qz)), det);
+
+		__m256 valid = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(t, epsilon, _CMP_GE_OQ), _mm256_cmp_ps(u, epsilon, _CMP_GE_OQ)),
+			_mm256_and_ps(_mm256_cmp_ps(v, epsilon, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(hit.t), _CMP_LT_OQ));
+
+		uint32_t lanes = _mm256_movemask_ps(valid) & laneMask(end - base);
+		if (lanes) {
+			alignas(32) float ts[8], us[8], vs[8];
+			_mm256_store_ps(ts, t);
+			_mm256_store_ps(us, u);
+			_mm256_store_ps(vs, v);
+			found |= closestLane(lanes, ts, us, vs, base, triangles, hit);
+		}
+	}
+
+	return found;
+}
+
+VRT_TARGET_AVX2
+static uint32_t intersectBoxesAVX2(SoABoxes const& boxes, Ray const& r, glm::vec3 const& inv)
+{
+	__m256 ox = _mm256_set1_ps(r.o.x), oy = _mm256_set1_ps(r.o.y), oz = _mm256_set1_ps(r.o.z);
+	__m256 ix = _mm256_set1_ps(inv.x), iy = _mm256_set1_ps(inv.y), iz = _mm256_set1_ps(inv.z);
+	alignas(32) float scratch[6][8];
+
+	uint32_t hits = 0;
+	for (uint32_t base = 0; base < boxes.count; base += 8) {
+		__m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(boxLanes(boxes.minX, base, boxes.count, 8, scratch[0])), ox), ix);
+		__m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(boxLanes(boxes.minY, base, boxes.count, 8, scratch[1])), oy), iy);
+		__m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(boxLanes(boxes.minZ, base, boxes.count, 8, scratch[2])), oz), iz);
+		__m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(boxLanes(boxes.maxX, base, boxes.count, 8, scratch[3])), ox), ix);
+		__m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(boxLanes(boxes.maxY, base, boxes.count, 8, scratch[4])), oy), iy);
+		__m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(boxLanes(boxes.maxZ, base, boxes.count, 8, scratch[5])), oz), iz);
+
+		__m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t1z, t0z), _mm256_min_ps(t1y, t0y)), _mm256_min_ps(t1x, t0x));
+		__m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t1z, t0z), _mm256_max_ps(t1y, t0y)), _mm256_max_ps(t1x, t0x));
+
+		hits |= uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LT_OQ))) << base;
+	}
+
+	return hits & laneMask(boxes.count);
+}
+
+VRT_TARGET_AVX2
+static uint32_t intersectPacketAVX2(AABB const& box, RayPacket const& packet)
+{
+	__m256 minX = _mm256_set1_ps(box.min.x), minY = _mm256_set1_ps(box.min.y), minZ = _mm256_set1_ps(box.min.z);
+	__m256 maxX = _mm256_set1_ps(box.max.x), maxY = _mm256_set1_ps(box.max.y), maxZ = _mm256_set1_ps(box.max.z);
+
+	uint32_t hits = 0;
+	for (uint32_t base = 0; base < packet.count; base += 8) {
+		__m256 ox = _mm256_load_ps(&packet.ox[base]), oy = _mm256_load_ps(&packet.oy[base]), oz = _mm256_load_ps(&packet.oz[base]);
+		__m256 ix = _mm256_load_ps(&packet.invX[base]), iy = _mm256_load_ps(&packet.invY[base]), iz = _mm256_load_ps(&packet.invZ[base]);
+
+		__m256 t0x = _mm256_mul_ps(_mm256_sub_ps(minX, ox), ix);
+		__m256 t0y = _mm256_mul_ps(_mm256_sub_ps(minY, oy), iy);
+		__m256 t0z = _mm256_mul_ps(_mm256_sub_ps(minZ, oz), iz);
+		__m256 t1x = _mm256_mul_ps(_mm256_sub_ps(maxX, ox), ix);
+		__m256 t1y = _mm256_mul_ps(_mm256_sub_ps(maxY, oy), iy);
+		__m256 t1z = _mm256_mul_ps(_mm256_sub_ps(maxZ, oz), iz);
+
+		__m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t1z, t0z), _mm256_min_ps(t1y, t0y)), _mm256_min_ps(t1x, t0x));
+		__m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t1z, t0z), _mm256_max_ps(t1y, t0y)), _mm256_max_ps(t1x, t0x));
+
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LT_OQ),
+			_mm256_cmp_ps(tmin, _mm256_load_ps(&packet.tmax[base]), _CMP_LT_OQ));
+		hits |= uint32_t(_mm256_movemask_ps(hit)) << base;
+	}
+
+	return hits & laneMask(packet.count);
+}
+
+VRT_TARGET_AVX512
+static bool intersectTrianglesAVX512(SoATriangles const& triangles, uint32_t begin, uint32_t end, Ray const& r,
+	RayHit& hit)
+{
+	__m512 ox = _mm512_set1_ps(r.o.x), oy = _mm512_set1_ps(r.o.y), oz = _mm512_set1_ps(r.o.z);
+	__m512 dx = _mm512_set1_ps(r.d.x), dy = _mm512_set1_ps(r.d.y), dz = _mm512_set1_ps(r.d.z);
+	__m512 epsilon = _mm512_set1_ps(EPSILON);
+	__m512 one = _mm512_set1_ps(1.0f);
+
+	bool found = false;
+	for (uint32_t base = begin; base < end; base += 16) {
+		__m512 v0x = _mm512_loadu_ps(&triangles.v0x[base]);
+		__m512 v0y = _mm512_loadu_ps(&triangles.v0y[base]);
+		__m512 v0z = _mm512_loadu_ps(&triangles.v0z[base]);
+		__m512 e1x = _mm512_loadu_ps(&triangles.e1x[base]);
+		__m512 e1y = _mm512_loadu_ps(&triangles.e1y[base]);
+		__m512 e1z = _mm512_loadu_ps(&triangles.e1z[base]);
+		__m512 e2x = _mm512_loadu_ps(&triangles.e2x[base]);
+		__m512 e2y = _mm512_loadu_ps(&triangles.e2y[base]);
+		__m512 e2z = _mm512_loadu_ps(&triangles.e2z[base]);
+
+		__m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(e2y, dz));
+		__m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(e2z, dx));
+		__m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(e2x, dy));
+		__m512 tx = _mm512_sub_ps(ox, v0x);
+		__m512 ty = _mm512_sub_ps(oy, v0y);
+		__m512 tz = _mm512_sub_ps(oz, v0z);
+		__m512 qx = _mm512_sub_ps(_mm512_mul_ps(ty, e1z), _mm512_mul_ps(e1y, tz));
+		__m512 qy = _mm512_sub_ps(_mm512_mul_ps(tz, e1x), _mm512_mul_ps(e1z, tx));
+		__m512 qz = _mm512_sub_ps(_mm512_mul_ps(tx, e1y), _mm512_mul_ps(e1x, ty));
+
+		__m512 det = _mm512_div_ps(one, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(px, e1x), _mm512_mul_ps(py, e1y)),
+			_mm512_mul_ps(pz, e1z)));
+		__m512 u = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(tx, px), _mm512_mul_ps(ty, py)),
+			_mm512_mul_ps(tz, pz)), det);
+		__m512 v = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)),
+			_mm512_mul_ps(dz, qz)), det);
+		__m512 t = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)),
+			_mm512_mul_ps(e2z, qz)), det);
+
+		__mmask16 valid = _mm512_cmp_ps_mask(t, epsilon, _CMP_GE_OQ) & _mm512_cmp_ps_mask(u, epsilon, _CMP_GE_OQ) &
+			_mm512_cmp_ps_mask(v, epsilon, _CMP_GE_OQ) & _mm512_cmp_ps_mask(_mm512_add_ps(u, v), one, _CMP_LE_OQ) &
+			_mm512_cmp_ps_mask(t, _mm512_set1_ps(hit.t), _CMP_LT_OQ);
+
+		uint32_t lanes = valid & laneMask(end - base);
+		if (lanes) {
+			alignas(64) float ts[16], us[16], vs[16];
+			_mm512_store_ps(ts, t);
+			_mm512_store_ps(us, u);
+			_mm512_store_ps(vs, v);
+			found |= closestLane(lanes, ts, us, vs, base, triangles, hit);
+		}
+	}
+
+	return found;
+}
+
+VRT_TARGET_AVX512
+static uint32_t intersectBoxesAVX512(SoABoxes const& boxes, Ray const& r, glm::vec3 const& inv)
+{
+	__m512 ox = _mm512_set1_ps(r.o.x), oy = _mm512_set1_ps(r.o.y), oz = _mm512_set1_ps(r.o.z);
+	__m512 ix = _mm512_set1_ps(inv.x), iy = _mm512_set1_ps(inv.y), iz = _mm512_set1_ps(inv.z);
+
+	uint32_t hits = 0;
+	for (uint32_t base = 0; base < boxes.count; base += 16) {
+		// Masked loads never touch the boxes past count
+		__mmask16 load = laneMask(boxes.count - base);
+		__m512 t0x = _mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(load, boxes.minX + base), ox), ix);
+		__m512 t0y = _mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(load, boxes.minY + base), oy), iy);
+		__m512 t0z = _mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(load, boxes.minZ + base), oz), iz);
+		__m512 t1x = _mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(load, boxes.maxX + base), ox), ix);
+		__m512 t1y = _mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(load, boxes.maxY + base), oy), iy);
+		__m512 t1z = _mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(load, boxes.maxZ + base), oz), iz);
+
+		__m512 tmin = _mm512_max_ps(_mm512_max_ps(_mm512_min_ps(t1z, t0z), _mm512_min_ps(t1y, t0y)), _mm512_min_ps(t1x, t0x));
+		__m512 tmax = _mm512_min_ps(_mm512_min_ps(_mm512_max_ps(t1z, t0z), _mm512_max_ps(t1y, t0y)), _mm512_max_ps(t1x, t0x));
+
+		hits |= uint32_t(_mm512_mask_cmp_ps_mask(load, tmin, tmax, _CMP_LT_OQ)) << base;
+	}
+
+	return hits & laneMask(boxes.count);
+}
+
+VRT_TARGET_AVX512
+static uint32_t intersectPacketAVX512(AABB const& box, RayPacket const& packet)
+{
+	__m512 minX = _mm512_set1_ps(box.min.x), minY = _mm512_set1_ps(box.min.y), minZ = _mm512_set1_ps(box.min.z);
+	__m512 maxX = _mm512_set1_ps(box.max.x), maxY = _mm512_set1_ps(box.max.y), maxZ = _mm512_set1_ps(box.max.z);
+
+	__m512 ox = _mm512_load_ps(packet.ox), oy = _mm512_load_ps(packet.oy), oz = _mm512_load_ps(packet.oz);
+	__m512 ix = _mm512_load_ps(packet.invX), iy = _mm512_load_ps(packet.invY), iz = _mm512_load_ps(packet.invZ);
+
+	__m512 t0x = _mm512_mul_ps(_mm512_sub_ps(minX, ox), ix);
+	__m512 t0y = _mm512_mul_ps(_mm512_sub_ps(minY, oy), iy);
+	__m512 t0z = _mm512_mul_ps(_mm512_sub_ps(minZ, oz), iz);
+	__m512 t1x = _mm512_mul_ps(_mm512_sub_ps(maxX, ox), ix);
+	__m512 t1y = _mm512_mul_ps(_mm512_sub_ps(maxY, oy), iy);
+	__m512 t1z = _mm512_mul_ps(_mm512_sub_ps(maxZ, oz), iz);
+
+	__m512 tmin = _mm512_max_ps(_mm512_max_ps(_mm512_min_ps(t1z, t0z), _mm512_min_ps(t1y, t0y)), _mm512_min_ps(t1x, t0x));
+	__m512 tmax = _mm512_min_ps(_mm512_min_ps(_mm512_max_ps(t1z, t0z), _mm512_max_ps(t1y, t0y)), _mm512_max_ps(t1x, t0x));
+
+	__mmask16 hit = _mm512_cmp_ps_mask(tmin, tmax, _CMP_LT_OQ) &
+		_mm512_cmp_ps_mask(tmin, _mm512_load_ps(packet.tmax), _CMP_LT_OQ);
+
+	return hit & laneMask(packet.count);
+}
+
+static const SimdKernels KERNELS[SIMD_ISA_COUNT] = {
+	{SCALAR_ISA, "scalar", 1, intersectTrianglesScalar, intersectBoxesScalar, intersectPacketScalar},
+	{SSE_ISA, "sse", 4, intersectTrianglesSSE, intersectBoxesSSE, intersectPacketSSE},
+	{AVX2_ISA, "avx2", 8, intersectTrianglesAVX2, intersectBoxesAVX2, intersectPacketAVX2},
+	{AVX512_ISA, "avx512", 16, intersectTrianglesAVX512, intersectBoxesAVX512, intersectPacketAVX512}
+};
+
+bool simdSupported(SimdISA isa)
+{
+	switch (isa) {
+	case AVX512_ISA:
+		return __builtin_cpu_supports("avx512f");
+	case AVX2_ISA:
+		return __builtin_cpu_supports("avx2");
+	default:
+		return true;
+	}
+}
+
+#else
+
+// Only the scalar kernels elsewhere, the table keeps the ISA names
+static const SimdKernels KERNELS[SIMD_ISA_COUNT] = {
+	{SCALAR_ISA, "scalar", 1, intersectTrianglesScalar, intersectBoxesScalar, intersectPacketScalar},
+	{SSE_ISA, "sse", 1, intersectTrianglesScalar, intersectBoxesScalar, intersectPacketScalar},
+	{AVX2_ISA, "avx2", 1, intersectTrianglesScalar, intersectBoxesScalar, intersectPacketScalar},
+	{AVX512_ISA, "avx512", 1, intersectTrianglesScalar, intersectBoxesScalar, intersectPacketScalar}
+};
+
+bool simdSupported(SimdISA isa)
+{
+	return isa == SCALAR_ISA;
+}
+
+#endif
+
+SimdKernels const& simdKernels(SimdISA isa)
+{
+	return KERNELS[isa];
+}
+
+SimdKernels const& simdKernels()
+{
+	static SimdKernels const& best = []() -> SimdKernels const& {
+		for (int isa = SIMD_ISA_COUNT - 1; isa > SCALAR_ISA; --isa)
+			if (simdSupported(SimdISA(isa)))
+				return KERNELS[isa];
+		return KERNELS[SCALAR_ISA];
+	}();
+	return best;
+}
+
+SimdKernels const& simdBoxKernels(uint32_t count)
+{
+	for (int isa = SCALAR_ISA + 1; isa < SIMD_ISA_COUNT; ++isa)
+		if (simdSupported(SimdISA(isa)) && KERNELS[isa].lanes >= count)
+			return KERNELS[isa];
+	return simdKernels();
+}
+
+const char* simdISAName(SimdISA isa)
+{
+	return KERNELS[isa].name;
+}
@@ -0,0 +1,134 @@
+#include <thread_pool.hpp>
+
+static thread_local ThreadPool* tCurrentPool = nullptr;
+static thread_local unsigned tWorkerIndex = 0;
+
+ThreadPool::ThreadPool(unsigned threadCount) :
+	mQueuedTasks(0), mNextQueue(0), mStop(false)
+{
+	threadCount = std::max(threadCount, 1u);
+
+	for (unsigned i = 0; i < threadCount; ++i)
+		mQueues.emplace_back(new WorkerQueue);
+
+	for (unsigned i = 0; i < threadCount; ++i)
+		mThreads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mStop = true;
+	}
+	mWake.notify_all();
+
+	for (auto& thread : mThreads)
+		thread.join();
+}
+
+unsigned ThreadPool::size() const
+{
+	return mThreads.size();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	// Workers keep their own tasks local, outside threads spread them around
+	unsigned index = tCurrentPool == this ? tWorkerIndex :
+		mNextQueue.fetch_add(1, std::memory_order_relaxed) % mQueues.size();
+
+	{
+		std::lock_guard<std::mutex> lock(mQueues[index]->mutex);
+		mQueues[index]->tasks.push_back(std::move(task));
+	}
+
+	mQueuedTasks.fetch_add(1);
+	{
+		// Taking the lock orders this against a worker about to sleep
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+	}
+	mWake.notify_one();
+}
+
+bool ThreadPool::popTask(unsigned index, std::function<void()>& task)
+{
+	{
+		auto& own = *mQueues[index];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			mQueuedTasks.fetch_sub(1);
+			return true;
+		}
+	}
+
+	for (unsigned i = 1; i < mQueues.size(); ++i) {
+		auto& victim = *mQueues[(index + i) % mQueues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			mQueuedTasks.fetch_sub(1);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool ThreadPool::runPendingTask()
+{
+	unsigned index = tCurrentPool == this ? tWorkerIndex :
+		mNextQueue.load(std::memory_order_relaxed) % mQueues.size();
+
+	std::function<void()> task;
+	if (!popTask(index, task))
+		return false;
+
+	task();
+	return true;
+}
+
+void ThreadPool::workerLoop(unsigned index)
+{
+	tCurrentPool = this;
+	tWorkerIndex = index;
+
+	std::function<void()> task;
+	for (;;) {
+		if (popTask(index, task)) {
+			task();
+			task = nullptr;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(mSleepMutex);
+		mWake.wait(lock, [this]() { return mStop || mQueuedTasks.load() > 0; });
+		if (mStop)
+			return;
+	}
+}
+
+ThreadPool& defaultThreadPool()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+void TaskGroup::run(std::function<void()> task)
+{
+	mPending.fetch_add(1);
+	mPool.submit([this, task = std::move(task)]() {
+		task();
+		mPending.fetch_sub(1);
+	});
+}
+
+void TaskGroup::wait()
+{
+	while (mPending.load() > 0)
+		if (!mPool.runPendingTask())
+			std::this_thread::yield();
+}
@@ -0,0 +1,742 @@
+#include <traverse.hpp>
+#include <simd.hpp>
+
+bool intersectBox(AABB const& b, Ray const& r)
+{
+	return intersectBox(b, r, 1.0f / r.d);
+}
+
+bool intersectBox(AABB const& b, Ray const& r, glm::vec3 const& inv)
+{
+	glm::vec3 t0 = (b.min - r.o) * inv;
+	glm::vec3 t1 = (b.max - r.o) * inv;
+
+	glm::vec3 vmin = glm::min(t0, t1);
+	glm::vec3 vmax = glm::max(t0, t1);
+
+	float tmin = std::max(vmin.x, std::max(vmin.y, vmin.z));
+	float tmax = std::min(vmax.x, std::min(vmax.y, vmax.z));
+
+	return tmin < tmax;
+}
+
+float intersectBVHTriangle(BVHTriangle const& tri, Ray const& r)
+{
+	glm::vec3 pvec = glm::cross(r.d, tri.e2);
+	glm::vec3 tvec = r.o - tri.v0;
+	glm::vec3 qvec = glm::cross(tvec, tri.e1);
+
+	float det = 1.0f / glm::dot(pvec, tri.e1);
+	float u = glm::dot(tvec, pvec) * det;
+	float v = glm::dot(r.d, qvec) * det;
+	float t = glm::dot(tri.e2, qvec) * det;
+
+	if (t < EPSILON || u < EPSILON || v < EPSILON || (u + v > 1.0f))
+		return -1.0f;
+
+	return t;
+}
+
+bool intersectBVHTriangle(BVHTriangle const& tri, Ray const& r, RayHit& hit)
+{
+	glm::vec3 pvec = glm::cross(r.d, tri.e2);
+	glm::vec3 tvec = r.o - tri.v0;
+	glm::vec3 qvec = glm::cross(tvec, tri.e1);
+
+	float det = 1.0f / glm::dot(pvec, tri.e1);
+	float u = glm::dot(tvec, pvec) * det;
+	float v = glm::dot(r.d, qvec) * det;
+	float t = glm::dot(tri.e2, qvec) * det;
+
+	if (t < EPSILON || u < EPSILON || v < EPSILON || (u + v > 1.0f) || t >= hit.t)
+		return false;
+
+	hit = {t, tri.index, u, v};
+	return true;
+}
+
+// Adds the distance from the previous node fetch, previous becomes index
+static void countNodeFetch(TraversalStats& stats, uint32_t& previous, uint32_t index, size_t stride)
+{
+	uint64_t from = uint64_t(previous) * stride;
+	uint64_t to = uint64_t(index) * stride;
+	stats.nodeJumpBytes += from < to ? to - from : from - to;
+	if (from / TRAVERSAL_PAGE_BYTES != to / TRAVERSAL_PAGE_BYTES)
+		stats.pageJumps++;
+	previous = index;
+}
+
+static void addStats(TraversalStats* stats, TraversalStats const& local)
+{
+	if (!stats)
+		return;
+
+	stats->nodesVisited += local.nodesVisited;
+	stats->boxTests += local.boxTests;
+	stats->triangleTests += local.triangleTests;
+	stats->nodeJumpBytes += local.nodeJumpBytes;
+	stats->pageJumps += local.pageJumps;
+}
+
+// Old walks: the same visiting order as compute.comp, left or first child first
+// and every overlapped child is visited. Every trace* below expects a non empty
+// tree and only takes hits nearer than hit.t.
+static bool traceFixed(BVH const& bvh, Ray const& r, RayHit& hit, TraversalStats& stats)
+{
+	bool found = false;
+	glm::vec3 inv = 1.0f / r.d;
+
+	TraversalStack<uint32_t> indexStack;
+	int stackIndex = 0;
+	indexStack[0] = 0;
+
+	uint32_t index = 0;
+	uint32_t previous = 0;
+	while (stackIndex != -1) {
+		BVHNode const& node = bvh.nodeList[index];
+		stats.nodesVisited++;
+		countNodeFetch(stats, previous, index, sizeof(BVHNode));
+
+		if (node.isLeafBegin >= 0) {
+			for (int32_t i = node.isLeafBegin; i < node.rightOffsetEnd; ++i) {
+				stats.triangleTests++;
+				if (intersectBVHTriangle(bvh.triangleList[i], r, hit))
+					found = true;
+			}
+
+			index = indexStack[stackIndex--];
+		} else {
+			bool r1 = intersectBox(node.leftBounds, r, inv);
+			bool r2 = intersectBox(node.rightBounds, r, inv);
+			stats.boxTests += 2;
+
+			if (!r1 && !r2) {
+				index = indexStack[stackIndex--];
+			} else if (r1) {
+				if (r2) indexStack[++stackIndex] = node.rightOffsetEnd;
+				index++;
+			} else {
+				index = node.rightOffsetEnd;
+			}
+		}
+	}
+
+	return found;
+}
+
+bool intersectSlabs(float minX, float minY, float minZ, float maxX, float maxY, float maxZ,
+	Ray const& r, glm::vec3 const& inv)
+{
+	float t0x = (minX - r.o.x) * inv.x;
+	float t1x = (maxX - r.o.x) * inv.x;
+	float t0y = (minY - r.o.y) * inv.y;
+	float t1y = (maxY - r.o.y) * inv.y;
+	float t0z = (minZ - r.o.z) * inv.z;
+	float t1z = (maxZ - r.o.z) * inv.z;
+
+	float tmin = std::max(std::min(t0x, t1x), std::max(std::min(t0y, t1y), std::min(t0z, t1z)));
+	float tmax = std::min(std::max(t0x, t1x), std::min(std::max(t0y, t1y), std::max(t0z, t1z)));
+	return tmin < tmax;
+}
+
+// Leaves are intersected right away, inner children are pushed
+static void visitWideChild(int32_t child, uint32_t count, std::vector<BVHTriangle> const& triangleList,
+	Ray const& r, RayHit& hit, bool& found, TraversalStack<uint32_t>& stack, int& stackSize, TraversalStats& stats)
+{
+	if (child < 0)
+		return;
+
+	if (count == 0) {
+		stack[stackSize++] = child;
+		return;
+	}
+
+	uint32_t end = child + count;
+	for (uint32_t j = child; j < end; ++j) {
+		stats.triangleTests++;
+		if (intersectBVHTriangle(triangleList[j], r, hit))
+			found = true;
+	}
+}
+
+template <unsigned N>
+static bool traceFixed(WideBVH<N> const& bvh, std::vector<BVHTriangle> const& triangleList, Ray const& r,
+	RayHit& hit, TraversalStats& stats)
+{
+	bool found = false;
+	glm::vec3 inv = 1.0f / r.d;
+	SimdKernels const& kernels = simdBoxKernels(N);
+
+	// Leaves are intersected right away, only inner children go on the stack
+	TraversalStack<uint32_t> stack;
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	uint32_t previous = 0;
+	while (stackSize > 0) {
+		uint32_t index = stack[--stackSize];
+		WideBVHNode<N> const& node = bvh.nodeList[index];
+		stats.nodesVisited++;
+		countNodeFetch(stats, previous, index, sizeof(WideBVHNode<N>));
+		stats.boxTests += N;
+
+		// Every child box in one vector test over the SoA bounds
+		uint32_t childHits = kernels.intersectBoxes(nodeBoxes(node), r, inv);
+
+		for (unsigned i = 0; i < N; ++i)
+			if (childHits & (1u << i))
+				visitWideChild(node.child[i], node.count[i], triangleList, r, hit, found, stack, stackSize, stats);
+	}
+
+	return found;
+}
+
+static bool traceFixed(QuantizedBVH const& bvh, std::vector<BVHTriangle> const& triangleList, Ray const& r,
+	RayHit& hit, TraversalStats& stats)
+{
+	bool found = false;
+	glm::vec3 inv = 1.0f / r.d;
+	SimdKernels const& kernels = simdBoxKernels(4);
+
+	TraversalStack<uint32_t> stack;
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	uint32_t previous = 0;
+	while (stackSize > 0) {
+		uint32_t index = stack[--stackSize];
+		QuantizedBVHNode const& node = bvh.nodeList[index];
+		stats.nodesVisited++;
+		countNodeFetch(stats, previous, index, sizeof(QuantizedBVHNode));
+		stats.boxTests += 4;
+
+		DequantizedBoxes decoded;
+		uint32_t childHits = kernels.intersectBoxes(nodeBoxes(node, decoded), r, inv);
+
+		for (unsigned i = 0; i < 4; ++i)
+			if (childHits & (1u << i))
+				visitWideChild(node.child[i], node.count[i], triangleList, r, hit, found, stack, stackSize, stats);
+	}
+
+	return found;
+}
+
+// Entry distance clamped to the ray origin, the max float for a miss or an
+// entry at or beyond tmax
+static float slabEntry(float minX, float minY, float minZ, float maxX, float maxY, float maxZ,
+	Ray const& r, glm::vec3 const& inv, float tmax)
+{
+	float t0x = (minX - r.o.x) * inv.x;
+	float t1x = (maxX - r.o.x) * inv.x;
+	float t0y = (minY - r.o.y) * inv.y;
+	float t1y = (maxY - r.o.y) * inv.y;
+	float t0z = (minZ - r.o.z) * inv.z;
+	float t1z = (maxZ - r.o.z) * inv.z;
+
+	float tnear = std::max(std::max(std::min(t0x, t1x), std::max(std::min(t0y, t1y), std::min(t0z, t1z))), 0.0f);
+	float tfar = std::min(std::max(t0x, t1x), std::min(std::max(t0y, t1y), std::max(t0z, t1z)));
+	return tnear <= tfar && tnear < tmax ? tnear : std::numeric_limits<float>::max();
+}
+
+float intersectBoxEntry(AABB const& b, Ray const& r, glm::vec3 const& inv, float tmax)
+{
+	return slabEntry(b.min.x, b.min.y, b.min.z, b.max.x, b.max.y, b.max.z, r, inv, tmax);
+}
+
+// Nearest first walks: the farther child waits on the stack with its entry
+// distance and is dropped when a nearer hit turns up meanwhile
+static bool traceNearest(BVH const& bvh, Ray const& r, RayHit& hit, TraversalStats& stats)
+{
+	bool found = false;
+	glm::vec3 inv = 1.0f / r.d;
+
+	TraversalStack<uint32_t> stack;
+	TraversalStack<float> stackEntry;
+	int stackSize = 0;
+
+	uint32_t index = 0;
+	uint32_t previous = 0;
+	for (;;) {
+		BVHNode const& node = bvh.nodeList[index];
+		stats.nodesVisited++;
+		countNodeFetch(stats, previous, index, sizeof(BVHNode));
+
+		if (node.isLeafBegin >= 0) {
+			for (int32_t i = node.isLeafBegin; i < node.rightOffsetEnd; ++i) {
+				stats.triangleTests++;
+				if (intersectBVHTriangle(bvh.triangleList[i], r, hit))
+					found = true;
+			}
+		} else {
+			float left = intersectBoxEntry(node.leftBounds, r, inv, hit.t);
+			float right = intersectBoxEntry(node.rightBounds, r, inv, hit.t);
+			stats.boxTests += 2;
+
+			if (left < hit.t && right < hit.t) {
+				bool rightFirst = right < left;
+				stack[stackSize] = rightFirst ? index + 1 : node.rightOffsetEnd;
+				stackEntry[stackSize++] = rightFirst ? left : right;
+				index = rightFirst ? node.rightOffsetEnd : index + 1;
+				continue;
+			} else if (left < hit.t) {
+				index++;
+				continue;
+			} else if (right < hit.t) {
+				index = node.rightOffsetEnd;
+				continue;
+			}
+		}
+
+		while (stackSize > 0 && stackEntry[stackSize - 1] >= hit.t)
+			stackSize--;
+		if (stackSize == 0)
+			break;
+		index = stack[--stackSize];
+	}
+
+	return found;
+}
+
+template <unsigned N>
+static void childEntries(WideBVHNode<N> const& node, Ray const& r, glm::vec3 const& inv, float tmax, float* entry)
+{
+	for (unsigned i = 0; i < N; ++i)
+		entry[i] = slabEntry(node.minX[i], node.minY[i], node.minZ[i],
+			node.maxX[i], node.maxY[i], node.maxZ[i], r, inv, tmax);
+}
+
+static void childEntries(QuantizedBVHNode const& node, Ray const& r, glm::vec3 const& inv, float tmax,
+	float* entry)
+{
+	glm::vec3 origin(node.origin[0], node.origin[1], node.origin[2]);
+	glm::vec3 scale(quantizedScale(node.exponent[0]), quantizedScale(node.exponent[1]),
+		quantizedScale(node.exponent[2]));
+
+	for (unsigned i = 0; i < 4; ++i)
+		entry[i] = slabEntry(
+			dequantize(origin.x, scale.x, node.qminX[i]),
+			dequantize(origin.y, scale.y, node.qminY[i]),
+			dequantize(origin.z, scale.z, node.qminZ[i]),
+			dequantize(origin.x, scale.x, node.qmaxX[i]),
+			dequantize(origin.y, scale.y, node.qmaxY[i]),
+			dequantize(origin.z, scale.z, node.qmaxZ[i]), r, inv, tmax);
+}
+
+// Children hit before hit.t are sorted by entry, leaves are intersected nearest
+// first and inner children pushed farthest first so the nearest pops next
+template <typename Node, unsigned N>
+static bool traceNearest(std::vector<Node> const& nodeList, std::vector<BVHTriangle> const& triangleList,
+	Ray const& r, RayHit& hit, TraversalStats& stats)
+{
+	bool found = false;
+	glm::vec3 inv = 1.0f / r.d;
+
+	TraversalStack<uint32_t> stack;
+	TraversalStack<float> stackEntry;
+	int stackSize = 0;
+	stack[stackSize] = 0;
+	stackEntry[stackSize++] = 0.0f;
+
+	uint32_t previous = 0;
+	while (stackSize > 0) {
+		--stackSize;
+		if (stackEntry[stackSize] >= hit.t)
+			continue;
+
+		uint32_t index = stack[stackSize];
+		Node const& node = nodeList[index];
+		stats.nodesVisited++;
+		countNodeFetch(stats, previous, index, sizeof(Node));
+		stats.boxTests += N;
+
+		float entry[N];
+		childEntries(node, r, inv, hit.t, entry);
+
+		unsigned order[N];
+		unsigned hitCount = 0;
+		for (unsigned i = 0; i < N; ++i) {
+			if (node.child[i] < 0 || entry[i] >= hit.t)
+				continue;
+
+			unsigned j = hitCount++;
+			for (; j > 0 && entry[order[j - 1]] > entry[i]; --j)
+				order[j] = order[j - 1];
+			order[j] = i;
+		}
+
+		for (unsigned k = 0; k < hitCount; ++k) {
+			unsigned i = order[k];
+			if (node.count[i] == 0 || entry[i] >= hit.t)
+				continue;
+
+			uint32_t end = node.child[i] + node.count[i];
+			for (uint32_t j = node.child[i]; j < end; ++j) {
+				stats.triangleTests++;
+				if (intersectBVHTriangle(triangleList[j], r, hit))
+					found = true;
+			}
+		}
+
+		for (unsigned k = hitCount; k-- > 0;) {
+			unsigned i = order[k];
+			if (node.count[i] == 0 && entry[i] < hit.t) {
+				stack[stackSize] = node.child[i];
+				stackEntry[stackSize++] = entry[i];
+			}
+		}
+	}
+
+	return found;
+}
+
+bool traceRay(BVH const& bvh, Ray const& r, RayHit& hit, TraversalStats* stats, TraversalOrder order)
+{
+	hit.t = std::numeric_limits<float>::max();
+	if (bvh.nodeList.empty())
+		return false;
+
+	TraversalStats local;
+	bool found = order == FIXED_ORDER ? traceFixed(bvh, r, hit, local) : traceNearest(bvh, r, hit, local);
+	addStats(stats, local);
+
+	return found;
+}
+
+template <unsigned N>
+bool traceRay(WideBVH<N> const& bvh, std::vector<BVHTriangle> const& triangleList, Ray const& r,
+	RayHit& hit, TraversalStats* stats, TraversalOrder order)
+{
+	hit.t = std::numeric_limits<float>::max();
+	if (bvh.nodeList.empty())
+		return false;
+
+	TraversalStats local;
+	bool found = order == FIXED_ORDER ? traceFixed(bvh, triangleList, r, hit, local) :
+		traceNearest<WideBVHNode<N>, N>(bvh.nodeList, triangleList, r, hit, local);
+	addStats(stats, local);
+
+	return found;
+}
+
+template bool traceRay<4>(WideBVH<4> const&, std::vector<BVHTriangle> const&, Ray const&,
+	RayHit&, TraversalStats*, TraversalOrder);
+template bool traceRay<8>(WideBVH<8> const&, std::vector<BVHTriangle> const&, Ray const&,
+	RayHit&, TraversalStats*, TraversalOrder);
+
+bool traceRay(QuantizedBVH const& bvh, std::vector<BVHTriangle> const& triangleList, Ray const& r,
+	RayHit& hit, TraversalStats* stats, TraversalOrder order)
+{
+	hit.t = std::numeric_limits<float>::max();
+	if (bvh.nodeList.empty())
+		return false;
+
+	TraversalStats local;
+	bool found = order == FIXED_ORDER ? traceFixed(bvh, triangleList, r, hit, local) :
+		traceNearest<QuantizedBVHNode, 4>(bvh.nodeList, triangleList, r, hit, local);
+	addStats(stats, local);
+
+	return found;
+}
+
+// Slab test clipped to the segment
+static bool segmentHitsSlabs(float minX, float minY, float minZ, float maxX, float maxY, float maxZ,
+	Ray const& r, glm::vec3 const& inv, float tmin, float tmax)
+{
+	float t0x = (minX - r.o.x) * inv.x;
+	float t1x = (maxX - r.o.x) * inv.x;
+	float t0y = (minY - r.o.y) * inv.y;
+	float t1y = (maxY - r.o.y) * inv.y;
+	float t0z = (minZ - r.o.z) * inv.z;
+	float t1z = (maxZ - r.o.z) * inv.z;
+
+	float tnear = std::max(std::min(t0x, t1x), std::max(std::min(t0y, t1y), std::min(t0z, t1z)));
+	float tfar = std::min(std::max(t0x, t1x), std::min(std::max(t0y, t1y), std::max(t0z, t1z)));
+	return std::max(tnear, tmin) < std::min(tfar, tmax);
+}
+
+bool intersectSegment(AABB const& b, Ray const& r, glm::vec3 const& inv, float tmin, float tmax)
+{
+	return segmentHitsSlabs(b.min.x, b.min.y, b.min.z, b.max.x, b.max.y, b.max.z, r, inv, tmin, tmax);
+}
+
+static bool segmentHitsTriangles(std::vector<BVHTriangle> const& triangleList, uint32_t begin, uint32_t end,
+	Ray const& r, float tmin, float tmax, TraversalStats& stats)
+{
+	for (uint32_t i = begin; i < end; ++i) {
+		stats.triangleTests++;
+		float t = intersectBVHTriangle(triangleList[i], r);
+		if (t > 0.0f && t >= tmin && t <= tmax)
+			return true;
+	}
+	return false;
+}
+
+bool occluded(BVH const& bvh, Ray const& r, float tmin, float tmax, TraversalStats* stats)
+{
+	TraversalStats local;
+	bool hit = false;
+
+	if (bvh.nodeList.empty())
+		return false;
+
+	glm::vec3 inv = 1.0f / r.d;
+
+	TraversalStack<uint32_t> indexStack;
+	int stackIndex = 0;
+	indexStack[0] = 0;
+
+	uint32_t index = 0;
+	uint32_t previous = 0;
+	while (stackIndex != -1 && !hit) {
+		BVHNode const& node = bvh.nodeList[index];
+		local.nodesVisited++;
+		countNodeFetch(local, previous, index, sizeof(BVHNode));
+
+		if (node.isLeafBegin >= 0) {
+			hit = segmentHitsTriangles(bvh.triangleList, node.isLeafBegin, node.rightOffsetEnd, r, tmin, tmax, local);
+			index = indexStack[stackIndex--];
+		} else {
+			bool r1 = intersectSegment(node.leftBounds, r, inv, tmin, tmax);
+			bool r2 = intersectSegment(node.rightBounds, r, inv, tmin, tmax);
+			local.boxTests += 2;
+
+			if (!r1 && !r2) {
+				index = indexStack[stackIndex--];
+			} else if (r1) {
+				if (r2) indexStack[++stackIndex] = node.rightOffsetEnd;
+				index++;
+			} else {
+				index = node.rightOffsetEnd;
+			}
+		}
+	}
+
+	addStats(stats, local);
+
+	return hit;
+}
+
+// Returns true on the first leaf with a hit, inner children are pushed
+static bool occludeWideChild(int32_t child, uint32_t count, std::vector<BVHTriangle> const& triangleList,
+	Ray const& r, float tmin, float tmax, TraversalStack<uint32_t>& stack, int& stackSize, TraversalStats& stats)
+{
+	if (child < 0)
+		return false;
+
+	if (count == 0) {
+		stack[stackSize++] = child;
+		return false;
+	}
+
+	return segmentHitsTriangles(triangleList, child, child + count, r, tmin, tmax, stats);
+}
+
+template <unsigned N>
+bool occluded(WideBVH<N> const& bvh, std::vector<BVHTriangle> const& triangleList, Ray const& r,
+	float tmin, float tmax, TraversalStats* stats)
+{
+	TraversalStats local;
+	bool hit = false;
+
+	if (bvh.nodeList.empty())
+		return false;
+
+	glm::vec3 inv = 1.0f / r.d;
+
+	TraversalStack<uint32_t> stack;
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	uint32_t previous = 0;
+	while (stackSize > 0 && !hit) {
+		uint32_t index = stack[--stackSize];
+		WideBVHNode<N> const& node = bvh.nodeList[index];
+		local.nodesVisited++;
+		countNodeFetch(local, previous, index, sizeof(WideBVHNode<N>));
+		local.boxTests += N;
+
+		for (unsigned i = 0; i < N && !hit; ++i)
+			if (segmentHitsSlabs(node.minX[i], node.minY[i], node.minZ[i],
+				node.maxX[i], node.maxY[i], node.maxZ[i], r, inv, tmin, tmax))
+				hit = occludeWideChild(node.child[i], node.count[i], triangleList, r, tmin, tmax,
+					stack, stackSize, local);
+	}
+
+	addStats(stats, local);
+
+	return hit;
+}
+
+template bool occluded<4>(WideBVH<4> const&, std::vector<BVHTriangle> const&, Ray const&, float, float,
+	TraversalStats*);
+template bool occluded<8>(WideBVH<8> const&, std::vector<BVHTriangle> const&, Ray const&, float, float,
+	TraversalStats*);
+
+bool occluded(QuantizedBVH const& bvh, std::vector<BVHTriangle> const& triangleList, Ray const& r,
+	float tmin, float tmax, TraversalStats* stats)
+{
+	TraversalStats local;
+	bool hit = false;
+
+	if (bvh.nodeList.empty())
+		return false;
+
+	glm::vec3 inv = 1.0f / r.d;
+
+	TraversalStack<uint32_t> stack;
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	uint32_t previous = 0;
+	while (stackSize > 0 && !hit) {
+		uint32_t index = stack[--stackSize];
+		QuantizedBVHNode const& node = bvh.nodeList[index];
+		local.nodesVisited++;
+		countNodeFetch(local, previous, index, sizeof(QuantizedBVHNode));
+		local.boxTests += 4;
+
+		glm::vec3 origin(node.origin[0], node.origin[1], node.origin[2]);
+		glm::vec3 scale(quantizedScale(node.exponent[0]), quantizedScale(node.exponent[1]),
+			quantizedScale(node.exponent[2]));
+
+		for (unsigned i = 0; i < 4 && !hit; ++i)
+			if (segmentHitsSlabs(
+				dequantize(origin.x, scale.x, node.qminX[i]),
+				dequantize(origin.y, scale.y, node.qminY[i]),
+				dequantize(origin.z, scale.z, node.qminZ[i]),
+				dequantize(origin.x, scale.x, node.qmaxX[i]),
+				dequantize(origin.y, scale.y, node.qmaxY[i]),
+				dequantize(origin.z, scale.z, node.qmaxZ[i]), r, inv, tmin, tmax))
+				hit = occludeWideChild(node.child[i], node.count[i], triangleList, r, tmin, tmax,
+					stack, stackSize, local);
+	}
+
+	addStats(stats, local);
+
+	return hit;
+}
+
+uint32_t TraversalBVH::nodeCount() const
+{
+	switch (format) {
+	case WIDE4_NODES:
+		return wide4.nodeList.size();
+	case WIDE8_NODES:
+		return wide8.nodeList.size();
+	case QUANTIZED4_NODES:
+		return quantized4.nodeList.size();
+	default:
+		return bvh->nodeList.size();
+	}
+}
+
+size_t TraversalBVH::nodeStride() const
+{
+	switch (format) {
+	case WIDE4_NODES:
+		return sizeof(WideBVHNode<4>);
+	case WIDE8_NODES:
+		return sizeof(WideBVHNode<8>);
+	case QUANTIZED4_NODES:
+		return sizeof(QuantizedBVHNode);
+	default:
+		return sizeof(BVHNode);
+	}
+}
+
+void const* TraversalBVH::nodeData() const
+{
+	switch (format) {
+	case WIDE4_NODES:
+		return wide4.nodeList.data();
+	case WIDE8_NODES:
+		return wide8.nodeList.data();
+	case QUANTIZED4_NODES:
+		return quantized4.nodeList.data();
+	default:
+		return bvh->nodeList.data();
+	}
+}
+
+TraversalBVH makeTraversalBVH(BVH const& bvh, BVHNodeFormat format, BVHNodeLayout layout)
+{
+	TraversalBVH tree;
+	tree.format = format;
+	tree.bvh = &bvh;
+
+	if (format == WIDE4_NODES)
+		tree.wide4 = collapseBVH<4>(bvh);
+	else if (format == WIDE8_NODES)
+		tree.wide8 = collapseBVH<8>(bvh);
+	else if (format == QUANTIZED4_NODES)
+		tree.quantized4 = quantizeBVH(collapseBVH<4>(bvh));
+
+	if (layout == CACHE_OBLIVIOUS_LAYOUT) {
+		layoutVEB(tree.wide4);
+		layoutVEB(tree.wide8);
+		layoutVEB(tree.quantized4);
+	}
+
+	return tree;
+}
+
+bool traceRay(TraversalBVH const& tree, Ray const& r, RayHit& hit, TraversalStats* stats, TraversalOrder order)
+{
+	return traceRay(tree, r, std::numeric_limits<float>::max(), hit, stats, order);
+}
+
+bool traceRay(TraversalBVH const& tree, Ray const& r, float tmax, RayHit& hit, TraversalStats* stats,
+	TraversalOrder order)
+{
+	hit.t = tmax;
+	if (tree.nodeCount() == 0)
+		return false;
+
+	TraversalStats local;
+	std::vector<BVHTriangle> const& triangleList = tree.bvh->triangleList;
+	bool found;
+	switch (tree.format) {
+	case WIDE4_NODES:
+		found = order == FIXED_ORDER ? traceFixed(tree.wide4, triangleList, r, hit, local) :
+			traceNearest<WideBVHNode<4>, 4>(tree.wide4.nodeList, triangleList, r, hit, local);
+		break;
+	case WIDE8_NODES:
+		found = order == FIXED_ORDER ? traceFixed(tree.wide8, triangleList, r, hit, local) :
+			traceNearest<WideBVHNode<8>, 8>(tree.wide8.nodeList, triangleList, r, hit, local);
+		break;
+	case QUANTIZED4_NODES:
+		found = order == FIXED_ORDER ? traceFixed(tree.quantized4, triangleList, r, hit, local) :
+			traceNearest<QuantizedBVHNode, 4>(tree.quantized4.nodeList, triangleList, r, hit, local);
+		break;
+	default:
+		found = order == FIXED_ORDER ? traceFixed(*tree.bvh, r, hit, local) : traceNearest(*tree.bvh, r, hit, local);
+		break;
+	}
+	addStats(stats, local);
+
+	return found;
+}
+
+bool occluded(TraversalBVH const& tree, Ray const& r, float tmin, float tmax, TraversalStats* stats)
+{
+	switch (tree.format) {
+	case WIDE4_NODES:
+		return occluded(tree.wide4, tree.bvh->triangleList, r, tmin, tmax, stats);
+	case WIDE8_NODES:
+		return occluded(tree.wide8, tree.bvh->triangleList, r, tmin, tmax, stats);
+	case QUANTIZED4_NODES:
+		return occluded(tree.quantized4, tree.bvh->triangleList, r, tmin, tmax, stats);
+	default:
+		return occluded(*tree.bvh, r, tmin, tmax, stats);
+	}
+}
+
+const char* traversalOrderName(TraversalOrder order)
+{
+	switch (order) {
+	case FIXED_ORDER:
+		return "fixed";
+	default:
+		return "nearest-first";
+	}
+}
@@ -0,0 +1,140 @@
+#include <wide_bvh.hpp>
+
+struct WideChild {
+  int32_t binaryIndex;
+  AABB bounds;
+};
+
+template <unsigned N>
+static void setWideChild(WideBVHNode<N>& node, unsigned slot, AABB const& bounds,
+  int32_t child, uint32_t count)
+{
+  node.minX[slot] = bounds.min.x;
+  node.minY[slot] = bounds.min.y;
+  node.minZ[slot] = bounds.min.z;
+  node.maxX[slot] = bounds.max.x;
+  node.maxY[slot] = bounds.max.y;
+  node.maxZ[slot] = bounds.max.z;
+  node.child[slot] = child;
+  node.count[slot] = count;
+}
+
+template <unsigned N>
+static uint32_t collapseNode(BVH const& bvh, WideBVH<N>& wide, int32_t binaryIndex)
+{
+  BVHNode const& root = bvh.nodeList[binaryIndex];
+
+  WideChild children[N];
+  unsigned childCount = 2;
+  children[0] = {binaryIndex + 1, root.leftBounds};
+  children[1] = {root.rightOffsetEnd, root.rightBounds};
+
+  // Open the inner child with the largest area until every slot is taken
+  while (childCount < N) {
+    int expand = -1;
+    float expandArea = -1.0f;
+    for (unsigned i = 0; i < childCount; ++i) {
+      BVHNode const& node = bvh.nodeList[children[i].binaryIndex];
+      float area = surfaceArea(children[i].bounds);
+      if (node.isLeafBegin < 0 && area > expandArea) {
+        expand = i;
+        expandArea = area;
+      }
+    }
+
+    if (expand < 0)
+      break;
+
+    int32_t index = children[expand].binaryIndex;
+    BVHNode const& node = bvh.nodeList[index];
+    children[expand] = {index + 1, node.leftBounds};
+    children[childCount++] = {node.rightOffsetEnd, node.rightBounds};
+  }
+
+  uint32_t wideIndex = wide.nodeList.size();
+  wide.nodeList.emplace_back();
+
+  AABB empty = {glm::vec3(0.0f), glm::vec3(0.0f)};
+  for (unsigned i = 0; i < N; ++i)
+    setWideChild(wide.nodeList[wideIndex], i, empty, -1, 0);
+
+  for (unsigned i = 0; i < childCount; ++i) {
+    BVHNode const& node = bvh.nodeList[children[i].binaryIndex];
+
+    if (node.isLeafBegin >= 0) {
+      uint32_t count = node.rightOffsetEnd - node.isLeafBegin;
+      if (count > 0)
+        setWideChild(wide.nodeList[wideIndex], i, children[i].bounds, node.isLeafBegin, count);
+    } else {
+      // nodeList may grow while collapsing the child, index again afterwards
+      uint32_t child = collapseNode(bvh, wide, children[i].binaryIndex);
+      setWideChild(wide.nodeList[wideIndex], i, children[i].bounds, child, 0);
+    }
+  }
+
+  return wideIndex;
+}
+
+template <unsigned N>
+WideBVH<N> collapseBVH(BVH const& bvh)
+{
+  WideBVH<N> wide;
+  if (bvh.nodeList.empty())
+    return wide;
+
+  BVHNode const& root = bvh.nodeList[0];
+  if (root.isLeafBegin >= 0) {
+    // A single leaf stores no bounds of its own
+    AABB bounds = emptyAABB();
+    for (int32_t i = root.isLeafBegin; i < root.rightOffsetEnd; ++i)
+      bounds = mergeAABB(bounds, bvh.refList[i].bounds);
+
+    AABB empty = {glm::vec3(0.0f), glm::vec3(0.0f)};
+    wide.nodeList.emplace_back();
+    for (unsigned i = 0; i < N; ++i)
+      setWideChild(wide.nodeList[0], i, empty, -1, 0);
+    if (root.rightOffsetEnd > root.isLeafBegin)
+      setWideChild(wide.nodeList[0], 0, bounds, root.isLeafBegin,
+        root.rightOffsetEnd - root.isLeafBegin);
+
+    return wide;
+  }
+
+  wide.nodeList.reserve(bvh.nodeList.size() / (N - 1) + 1);
+  collapseNode(bvh, wide, 0);
+
+  return wide;
+}
+
+template WideBVH<4> collapseBVH<4>(BVH const& bvh);
+template WideBVH<8> collapseBVH<8>(BVH const& bvh);
+
+BVHNodeFormat nodeFormatForWidth(unsigned width, bool quantized)
+{
+  // Only 4 children fit a quantized cache line
+  if (quantized)
+    return QUANTIZED4_NODES;
+
+  switch (width) {
+  case 4:
+    return WIDE4_NODES;
+  case 8:
+    return WIDE8_NODES;
+  default:
+    return BINARY_NODES;
+  }
+}
+
+const char* nodeFormatName(BVHNodeFormat format)
+{
+  switch (format) {
+  case WIDE4_NODES:
+    return "wide4";
+  case WIDE8_NODES:
+    return "wide8";
+  case QUANTIZED4_NODES:
+    return "quantized4";
+  default:
+    return "binary";
+  }
+}